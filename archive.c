@@ -0,0 +1,573 @@
+/*
+ * ftreecmp
+ *
+ * Member-wise comparison of archives.
+ *
+ * zip (and hence jar) files record a timestamp for every entry, so each
+ * rebuild produces a different archive even if none of the entries
+ * changed. Instead of comparing the archive byte by byte, we read the
+ * central directories of both files, pair the entries by name, and
+ * compare their CRC-32 and uncompressed size. The CRC covers the
+ * uncompressed data, so nothing needs to be extracted, and neither the
+ * compression method nor the order of entries matters. The type of each
+ * entry, and its permissions if the archive was made on Unix, come from
+ * the external attributes.
+ *
+ * Static libraries (ar archives) have the same problem with the mtime,
+ * uid, gid and mode of their member headers. Here, members are paired by
+ * name, and their contents are compared. For object files that differ,
+ * we also report which ELF sections differ. The archive symbol table is
+ * ignored, as it is derived from the members.
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/stat.h>
+
+#include "fstate.h"
+
+struct archive_entry {
+	char *			name;
+	uint32_t		crc;
+	uint64_t		size;
+	mode_t			mode;		/* zip: type, and permissions if known */
+	off_t			header;		/* ar: offset of member header */
+	off_t			offset;		/* ar: offset of member data */
+	bool			paired;
+	bool			differs;
+	char *			detail;
+};
+
+struct archive_listing {
+	unsigned int		count;
+	struct archive_entry *	entries;
+	struct archive_entry **	sorted;
+};
+
+static void
+archive_listing_destroy(struct archive_listing *list)
+{
+	unsigned int i;
+
+	for (i = 0; i < list->count; ++i) {
+		free(list->entries[i].name);
+		free(list->entries[i].detail);
+	}
+	free(list->entries);
+	free(list->sorted);
+}
+
+static struct archive_entry *
+archive_listing_add(struct archive_listing *list, const char *name, size_t namelen)
+{
+	struct archive_entry *entry;
+
+	if ((list->count % 64) == 0)
+		list->entries = reallocarray(list->entries, list->count + 64, sizeof(list->entries[0]));
+
+	entry = &list->entries[list->count++];
+	memset(entry, 0, sizeof(*entry));
+	entry->name = strndup(name, namelen);
+	return entry;
+}
+
+static int
+archive_entry_compare_name(const void *a, const void *b)
+{
+	const struct archive_entry *ea = *(const struct archive_entry **) a;
+	const struct archive_entry *eb = *(const struct archive_entry **) b;
+	int r;
+
+	if ((r = strcmp(ea->name, eb->name)) != 0)
+		return r;
+	/* entries with the same name are paired in archive order */
+	return (ea < eb)? -1 : (ea > eb);
+}
+
+static void
+archive_listing_sort(struct archive_listing *list)
+{
+	unsigned int i;
+
+	list->sorted = calloc(list->count? list->count : 1, sizeof(list->sorted[0]));
+	for (i = 0; i < list->count; ++i)
+		list->sorted[i] = &list->entries[i];
+	qsort(list->sorted, list->count, sizeof(list->sorted[0]), archive_entry_compare_name);
+}
+
+/*
+ * zip files
+ */
+#define ZIP_EOCD_SIG		0x06054b50
+#define ZIP_EOCD_LEN		22
+#define ZIP64_LOCATOR_SIG	0x07064b50
+#define ZIP64_LOCATOR_LEN	20
+#define ZIP64_EOCD_SIG		0x06064b50
+#define ZIP64_EOCD_LEN		56
+#define ZIP_CDIR_SIG		0x02014b50
+#define ZIP_CDIR_LEN		46
+#define ZIP_HOST_UNIX		3
+#define ZIP_DOS_DIRECTORY	0x10
+
+/* We refuse to read central directories larger than this */
+#define ZIP_CDIR_MAX		(256 << 20)
+
+static inline uint16_t
+get16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t
+get32(const unsigned char *p)
+{
+	return get16(p) | ((uint32_t) get16(p + 2) << 16);
+}
+
+static inline uint64_t
+get64(const unsigned char *p)
+{
+	return get32(p) | ((uint64_t) get32(p + 4) << 32);
+}
+
+/*
+ * Locate the central directory, via the end of central directory record,
+ * which is followed by a comment of up to 64K.
+ */
+static bool
+zip_find_cdir(int fd, off_t file_size, uint64_t *cdir_offset, uint64_t *cdir_size)
+{
+	unsigned char *tail, *eocd = NULL;
+	size_t tail_len;
+	off_t tail_offset;
+	bool rv = false;
+
+	tail_len = ZIP_EOCD_LEN + 65535 + ZIP64_LOCATOR_LEN;
+	if ((off_t) tail_len > file_size)
+		tail_len = file_size;
+	tail_offset = file_size - tail_len;
+
+	tail = malloc(tail_len);
+	if (pread(fd, tail, tail_len, tail_offset) != (ssize_t) tail_len)
+		goto out;
+
+	for (eocd = tail + tail_len - ZIP_EOCD_LEN; eocd >= tail; --eocd) {
+		if (get32(eocd) == ZIP_EOCD_SIG
+		 && eocd + ZIP_EOCD_LEN + get16(eocd + 20) == tail + tail_len)
+			break;
+	}
+	if (eocd < tail)
+		goto out;
+
+	*cdir_size = get32(eocd + 12);
+	*cdir_offset = get32(eocd + 16);
+
+	if (*cdir_offset == 0xffffffff || *cdir_size == 0xffffffff) {
+		unsigned char *locator = eocd - ZIP64_LOCATOR_LEN;
+		unsigned char zip64[ZIP64_EOCD_LEN];
+
+		if (locator < tail || get32(locator) != ZIP64_LOCATOR_SIG)
+			goto out;
+
+		if (pread(fd, zip64, sizeof(zip64), get64(locator + 8)) != sizeof(zip64)
+		 || get32(zip64) != ZIP64_EOCD_SIG)
+			goto out;
+
+		*cdir_size = get64(zip64 + 40);
+		*cdir_offset = get64(zip64 + 48);
+	}
+
+	rv = *cdir_offset + *cdir_size <= (uint64_t) file_size && *cdir_size <= ZIP_CDIR_MAX;
+
+out:
+	free(tail);
+	return rv;
+}
+
+/*
+ * If the uncompressed size doesn't fit into 32 bits, it's in the zip64
+ * extra field.
+ */
+static uint64_t
+zip_entry_size(const unsigned char *hdr, const unsigned char *extra, size_t extra_len)
+{
+	uint64_t size = get32(hdr + 24);
+	size_t pos = 0;
+
+	if (size != 0xffffffff)
+		return size;
+
+	while (pos + 4 <= extra_len) {
+		unsigned int id = get16(extra + pos);
+		unsigned int len = get16(extra + pos + 2);
+
+		if (pos + 4 + len > extra_len)
+			break;
+		/* the zip64 extra field starts with the uncompressed size */
+		if (id == 0x0001 && len >= 8)
+			return get64(extra + pos + 4);
+		pos += 4 + len;
+	}
+
+	return size;
+}
+
+/*
+ * Entries made on Unix carry st_mode in the upper half of the external
+ * attributes. For anything else, we only know whether it's a directory.
+ */
+static mode_t
+zip_entry_mode(const unsigned char *hdr, const char *name, size_t name_len)
+{
+	uint32_t attr = get32(hdr + 38);
+
+	if (hdr[5] == ZIP_HOST_UNIX && (attr >> 16) != 0)
+		return attr >> 16;
+	if ((attr & ZIP_DOS_DIRECTORY) || (name_len && name[name_len - 1] == '/'))
+		return S_IFDIR;
+	return S_IFREG;
+}
+
+static bool
+zip_read_listing(int fd, off_t file_size, const char *path, struct archive_listing *list)
+{
+	uint64_t cdir_offset, cdir_size, pos;
+	unsigned char *cdir;
+	bool rv = false;
+
+	if (!zip_find_cdir(fd, file_size, &cdir_offset, &cdir_size)) {
+		fprintf(stderr, "Error: %s: cannot find zip central directory\n", path);
+		return false;
+	}
+
+	cdir = malloc(cdir_size? cdir_size : 1);
+	if (pread(fd, cdir, cdir_size, cdir_offset) != (ssize_t) cdir_size) {
+		fprintf(stderr, "Error: failed to read from %s: %m\n", path);
+		goto out;
+	}
+
+	for (pos = 0; pos + ZIP_CDIR_LEN <= cdir_size; ) {
+		const unsigned char *hdr = cdir + pos;
+		unsigned int name_len, extra_len, comment_len;
+		struct archive_entry *entry;
+
+		if (get32(hdr) != ZIP_CDIR_SIG)
+			break;
+
+		name_len = get16(hdr + 28);
+		extra_len = get16(hdr + 30);
+		comment_len = get16(hdr + 32);
+		if (pos + ZIP_CDIR_LEN + name_len + extra_len + comment_len > cdir_size)
+			break;
+
+		entry = archive_listing_add(list, (const char *) hdr + ZIP_CDIR_LEN, name_len);
+		entry->crc = get32(hdr + 16);
+		entry->size = zip_entry_size(hdr, hdr + ZIP_CDIR_LEN + name_len, extra_len);
+		entry->mode = zip_entry_mode(hdr, (const char *) hdr + ZIP_CDIR_LEN, name_len);
+
+		pos += ZIP_CDIR_LEN + name_len + extra_len + comment_len;
+	}
+
+	if (pos != cdir_size)
+		fprintf(stderr, "Error: %s: corrupt zip central directory\n", path);
+	else
+		rv = true;
+
+out:
+	free(cdir);
+	return rv;
+}
+
+/*
+ * Entries whose contents are the same, but whose type or permissions
+ * differ, are listed with the mode of both sides in parentheses.
+ */
+static bool
+zip_entries_differ(int old_fd, struct archive_entry *oe, int new_fd, struct archive_entry *ne)
+{
+	char detail[64];
+
+	if (oe->crc != ne->crc || oe->size != ne->size)
+		return true;
+
+	if (oe->mode == ne->mode)
+		return false;
+
+	if ((oe->mode & S_IFMT) != (ne->mode & S_IFMT))
+		snprintf(detail, sizeof(detail), "type %06o -> %06o", oe->mode, ne->mode);
+	else
+		snprintf(detail, sizeof(detail), "mode %04o -> %04o", oe->mode & 07777, ne->mode & 07777);
+	oe->detail = strdup(detail);
+	return true;
+}
+
+/*
+ * ar archives
+ */
+#define AR_MAGIC		"!<arch>\n"
+#define AR_MAGIC_LEN		8
+#define AR_HEADER_LEN		60
+#define AR_BSD_LONGNAME		"#1/"
+
+/* We refuse to read long name tables larger than this */
+#define AR_LONGNAMES_MAX	(64 << 20)
+
+static bool
+ar_read_listing(int fd, off_t file_size, const char *path, struct archive_listing *list)
+{
+	char *longnames = NULL;
+	size_t longnames_len = 0;
+	off_t offset = AR_MAGIC_LEN;
+	bool rv = false;
+
+	while (offset + AR_HEADER_LEN <= file_size) {
+		char hdr[AR_HEADER_LEN], sizebuf[11];
+		struct archive_entry *entry;
+		const char *name = hdr;
+		off_t data, size, next;
+		size_t name_len;
+
+		if (pread(fd, hdr, AR_HEADER_LEN, offset) != AR_HEADER_LEN) {
+			fprintf(stderr, "Error: failed to read from %s: %m\n", path);
+			goto out;
+		}
+		if (hdr[58] != '`' || hdr[59] != '\n')
+			goto corrupt;
+
+		memcpy(sizebuf, hdr + 48, 10);
+		sizebuf[10] = '\0';
+		size = strtoull(sizebuf, NULL, 10);
+
+		data = offset + AR_HEADER_LEN;
+		next = data + size + (size & 1);
+		if (data + size > file_size)
+			goto corrupt;
+
+		/* GNU and BSD symbol tables */
+		if (!memcmp(hdr, "/ ", 2) || !memcmp(hdr, "/SYM64/ ", 8) || !memcmp(hdr, "__.SYMDEF", 9)) {
+			offset = next;
+			continue;
+		}
+
+		/* GNU long name table */
+		if (!memcmp(hdr, "// ", 3)) {
+			if (longnames != NULL || size > AR_LONGNAMES_MAX)
+				goto corrupt;
+			longnames = malloc(size + 1);
+			if (pread(fd, longnames, size, data) != size) {
+				fprintf(stderr, "Error: failed to read from %s: %m\n", path);
+				goto out;
+			}
+			longnames[size] = '\0';
+			longnames_len = size;
+			offset = next;
+			continue;
+		}
+
+		if (hdr[0] == '/' && hdr[1] >= '0' && hdr[1] <= '9') {
+			/* GNU long name: index into the long name table, terminated by "/\n" */
+			unsigned long index = strtoul(hdr + 1, NULL, 10);
+
+			if (index >= longnames_len)
+				goto corrupt;
+			name = longnames + index;
+			for (name_len = 0; index + name_len < longnames_len && name[name_len] != '\n'; ++name_len)
+				;
+			if (name_len && name[name_len - 1] == '/')
+				name_len--;
+			entry = archive_listing_add(list, name, name_len);
+		} else if (!memcmp(hdr, AR_BSD_LONGNAME, 3)) {
+			/* BSD long name: stored at the start of the member data */
+			char namebuf[256];
+
+			name_len = strtoul(hdr + 3, NULL, 10);
+			if (name_len >= sizeof(namebuf) || name_len > size)
+				goto corrupt;
+			if (pread(fd, namebuf, name_len, data) != name_len) {
+				fprintf(stderr, "Error: failed to read from %s: %m\n", path);
+				goto out;
+			}
+			entry = archive_listing_add(list, namebuf, strnlen(namebuf, name_len));
+			data += name_len;
+			size -= name_len;
+		} else {
+			/* short name, terminated by / (GNU) or padded with blanks (BSD) */
+			for (name_len = 0; name_len < 16 && hdr[name_len] != '/' && hdr[name_len] != ' '; ++name_len)
+				;
+			entry = archive_listing_add(list, hdr, name_len);
+		}
+
+		entry->header = offset;
+		entry->offset = data;
+		entry->size = size;
+		offset = next;
+	}
+
+	rv = true;
+	goto out;
+
+corrupt:
+	fprintf(stderr, "Error: %s: corrupt ar archive\n", path);
+out:
+	free(longnames);
+	return rv;
+}
+
+static bool
+ar_members_differ(int old_fd, struct archive_entry *oe, int new_fd, struct archive_entry *ne)
+{
+	if (oe->size == ne->size
+	 && !fcompare_regions_differ(old_fd, oe->offset, new_fd, ne->offset, oe->size))
+		return false;
+
+	/* For object files, find out which sections differ */
+	if (oe->size >= SELFMAG && ne->size >= SELFMAG) {
+		char old_magic[SELFMAG], new_magic[SELFMAG];
+
+		if (pread(old_fd, old_magic, SELFMAG, oe->offset) == SELFMAG
+		 && pread(new_fd, new_magic, SELFMAG, ne->offset) == SELFMAG
+		 && !memcmp(old_magic, ELFMAG, SELFMAG)
+		 && !memcmp(new_magic, ELFMAG, SELFMAG))
+			oe->detail = elf_compare_members(old_fd, oe->header, new_fd, ne->header);
+	}
+	return true;
+}
+
+static const struct {
+	int			format;
+	const char *		name;
+	const char *		magic;
+	unsigned int		magic_len;
+	bool			(*read_listing)(int fd, off_t file_size, const char *path,
+						struct archive_listing *list);
+	bool			(*entries_differ)(int old_fd, struct archive_entry *oe,
+						int new_fd, struct archive_entry *ne);
+} archive_formats[] = {
+	{ ARCHIVE_ZIP,	"zip",	"PK\003\004",	4,		zip_read_listing,	zip_entries_differ },
+	{ ARCHIVE_AR,	"ar",	AR_MAGIC,	AR_MAGIC_LEN,	ar_read_listing,	ar_members_differ },
+	{ ARCHIVE_NONE }
+};
+
+/*
+ * Identify the archive format of a file by its magic.
+ */
+int
+archive_format(int fd)
+{
+	char magic[8];
+	ssize_t n;
+	unsigned int i;
+
+	if ((n = pread(fd, magic, sizeof(magic), 0)) <= 0)
+		return ARCHIVE_NONE;
+
+	for (i = 0; archive_formats[i].format != ARCHIVE_NONE; ++i) {
+		if (n >= archive_formats[i].magic_len
+		 && !memcmp(magic, archive_formats[i].magic, archive_formats[i].magic_len))
+			return archive_formats[i].format;
+	}
+
+	return ARCHIVE_NONE;
+}
+
+const char *
+archive_format_name(int format)
+{
+	unsigned int i;
+
+	for (i = 0; archive_formats[i].format != ARCHIVE_NONE; ++i) {
+		if (archive_formats[i].format == format)
+			return archive_formats[i].name;
+	}
+	return "unknown";
+}
+
+static void
+archive_diff_append(char **buf, size_t *len, const char *prefix, const char *name, const char *detail)
+{
+	size_t n = strlen(prefix) + strlen(name) + 1;
+
+	if (detail)
+		n += strlen(detail) + 2;
+
+	*buf = realloc(*buf, *len + n + 1);
+	*len += sprintf(*buf + *len, "%s%s%s", *len? " " : "", prefix, name);
+	if (detail)
+		*len += sprintf(*buf + *len, "(%s)", detail);
+}
+
+/*
+ * Compare two archives of the given format entry by entry. On success,
+ * *differences is set to a malloc'ed list of the entries that differ, in
+ * archive order, with entries that exist on one side only prefixed with
+ * - or +; or NULL if all entries are identical. Returns false if either
+ * archive could not be read.
+ */
+bool
+archive_compare(int format, int old_fd, off_t old_size, const char *old_path,
+		int new_fd, off_t new_size, const char *new_path, char **differences)
+{
+	struct archive_listing old = { 0 }, new = { 0 };
+	unsigned int i, j, k;
+	char *result = NULL;
+	size_t len = 0;
+	bool rv = false;
+
+	*differences = NULL;
+
+	for (k = 0; archive_formats[k].format != format; ++k) {
+		if (archive_formats[k].format == ARCHIVE_NONE)
+			return false;
+	}
+
+	if (!archive_formats[k].read_listing(old_fd, old_size, old_path, &old)
+	 || !archive_formats[k].read_listing(new_fd, new_size, new_path, &new))
+		goto out;
+
+	archive_listing_sort(&old);
+	archive_listing_sort(&new);
+
+	for (i = j = 0; i < old.count && j < new.count; ) {
+		struct archive_entry *oe = old.sorted[i], *ne = new.sorted[j];
+		int r;
+
+		r = strcmp(oe->name, ne->name);
+		if (r < 0) {
+			i++;
+		} else if (r > 0) {
+			j++;
+		} else {
+			oe->paired = ne->paired = true;
+			oe->differs = archive_formats[k].entries_differ(old_fd, oe, new_fd, ne);
+			i++, j++;
+		}
+	}
+
+	for (i = 0; i < old.count; ++i) {
+		struct archive_entry *oe = &old.entries[i];
+
+		if (!oe->paired)
+			archive_diff_append(&result, &len, "-", oe->name, NULL);
+		else if (oe->differs)
+			archive_diff_append(&result, &len, "", oe->name, oe->detail);
+	}
+
+	for (j = 0; j < new.count; ++j) {
+		if (!new.entries[j].paired)
+			archive_diff_append(&result, &len, "+", new.entries[j].name, NULL);
+	}
+
+	*differences = result;
+	rv = true;
+
+out:
+	archive_listing_destroy(&old);
+	archive_listing_destroy(&new);
+	return rv;
+}
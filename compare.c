@@ -0,0 +1,923 @@
+/*
+ * ftreecmp
+ *
+ * Comparison of file contents.
+ *
+ * Small files are compared sequentially by the calling thread. Files above
+ * a size threshold are cut into chunks that are compared by several threads
+ * concurrently. Chunks are handed out in ascending order; once a chunk finds
+ * a difference, chunks beyond that offset are cancelled, while chunks below
+ * it keep going, so that we still find the lowest differing offset.
+ *
+ * Before any of this, the caller may give us a list of probe regions, in
+ * which a difference is particularly likely (see elf_probe_regions()).
+ * These are compared first; if one of them differs, we're done without
+ * reading the rest of the file. The offset we report in that case is not
+ * necessarily the first difference, so we also report the region.
+ *
+ * Optionally, files are read with O_DIRECT, bypassing the page cache. Reads
+ * go to aligned buffers from a pool that is shared by all threads. Offsets
+ * are always multiples of the buffer size, and the length of the last read
+ * of a file is rounded up to the alignment, so that unaligned tails work.
+ * If the file system rejects O_DIRECT (tmpfs, isofs), or a short read
+ * leaves us at an unaligned offset, we fall back to buffered I/O for that
+ * file.
+ *
+ * Sparse files are compared segment by segment: we look for data and holes
+ * on both sides with SEEK_DATA/SEEK_HOLE, and skip regions that are holes
+ * in both files. Where one file has a hole and the other has data, the
+ * data is compared against the zeros read from the hole, so the hole layout
+ * by itself does not count as a difference, unless strict hole checking
+ * has been requested.
+ *
+ * Each file is read exactly once, so once we're done comparing, there is
+ * no point in keeping its pages in the cache; fcompare_drop_cache() tells
+ * the kernel to drop them, and counts how much was dropped.
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#define _GNU_SOURCE	/* for O_DIRECT */
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+#include "fstate.h"
+
+#define FCOMPARE_CHUNK_SIZE	(8 << 20)
+#define FCOMPARE_ALIGN		4096
+#define FCOMPARE_READAHEAD	(2 << 20)
+
+static off_t			fcompare_parallel_threshold = 64 << 20;
+static unsigned int		fcompare_parallel_threads = 4;
+static bool			fcompare_direct_io = false;
+static bool			fcompare_drop = true;
+static bool			fcompare_strict_holes = false;
+
+/* Statistics */
+static atomic_ullong		fcompare_bytes_read;
+static atomic_ullong		fcompare_bytes_dropped;
+static atomic_ulong		fcompare_files_dropped;
+static atomic_ullong		fcompare_bytes_skipped;
+static atomic_ullong		fcompare_bytes_saved;
+static atomic_ulong		fcompare_probe_hits;
+static atomic_ullong		fcompare_bytes_decompressed;
+static atomic_bool		fcompare_cachestat_missing;
+
+/* Pool of aligned I/O buffers, each holding room for both files */
+static pthread_mutex_t		fcompare_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char **		fcompare_pool;
+static unsigned int		fcompare_pool_count;
+static unsigned int		fcompare_pool_size;
+
+void
+fcompare_set_parallel(off_t threshold, unsigned int nthreads)
+{
+	fcompare_parallel_threshold = threshold;
+	fcompare_parallel_threads = nthreads;
+}
+
+void
+fcompare_set_direct_io(bool enable)
+{
+	fcompare_direct_io = enable;
+}
+
+void
+fcompare_set_strict_holes(bool enable)
+{
+	fcompare_strict_holes = enable;
+}
+
+void
+fcompare_set_drop_cache(bool enable)
+{
+	fcompare_drop = enable;
+}
+
+/*
+ * Get a buffer of 2 * FCOMPARE_BUFSIZE bytes from the pool
+ */
+unsigned char *
+fcompare_buffer_get(void)
+{
+	void *buf = NULL;
+
+	pthread_mutex_lock(&fcompare_pool_lock);
+	if (fcompare_pool_count)
+		buf = fcompare_pool[--fcompare_pool_count];
+	pthread_mutex_unlock(&fcompare_pool_lock);
+
+	if (buf == NULL && posix_memalign(&buf, FCOMPARE_ALIGN, 2 * FCOMPARE_BUFSIZE) != 0) {
+		fprintf(stderr, "Error: unable to allocate I/O buffer\n");
+		return NULL;
+	}
+	return buf;
+}
+
+void
+fcompare_buffer_put(unsigned char *buf)
+{
+	pthread_mutex_lock(&fcompare_pool_lock);
+	if (fcompare_pool_count >= fcompare_pool_size) {
+		fcompare_pool_size += 8;
+		fcompare_pool = reallocarray(fcompare_pool, fcompare_pool_size, sizeof(fcompare_pool[0]));
+	}
+	fcompare_pool[fcompare_pool_count++] = buf;
+	pthread_mutex_unlock(&fcompare_pool_lock);
+}
+
+/*
+ * Switch an open file to O_DIRECT. We do this after opening the file
+ * (rather than passing O_DIRECT to open) so that the ELF probing done by
+ * our caller can still use unaligned reads.
+ */
+static void
+fcompare_enable_direct(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0)
+		return;
+
+	/* If this fails with EINVAL, the file system does not support it,
+	 * and we just keep using buffered I/O. */
+	fcntl(fd, F_SETFL, flags | O_DIRECT);
+}
+
+static void
+fcompare_disable_direct(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) >= 0)
+		fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+}
+
+/*
+ * Read count bytes at offset, or up to the end of file. The read size is
+ * rounded up to the alignment, which only makes a difference for the tail
+ * of the file. Some file systems accept O_DIRECT in open, but reject the
+ * reads; in that case, we retry with buffered I/O. The same goes for a
+ * short read that leaves us at an unaligned offset.
+ */
+static ssize_t
+fcompare_read(int fd, unsigned char *buf, size_t count, off_t offset)
+{
+	size_t done = 0;
+
+	while (done < count) {
+		size_t len = (count - done + FCOMPARE_ALIGN - 1) & ~(size_t) (FCOMPARE_ALIGN - 1);
+		ssize_t n;
+
+		if (fcompare_direct_io && ((offset + done) % FCOMPARE_ALIGN || done % FCOMPARE_ALIGN)) {
+			fcompare_disable_direct(fd);
+			len = count - done;
+		}
+
+		n = pread(fd, buf + done, len, offset + done);
+		if (n < 0 && errno == EINVAL && fcompare_direct_io) {
+			fcompare_disable_direct(fd);
+			n = pread(fd, buf + done, len, offset + done);
+		}
+
+		if (n < 0)
+			return n;
+		if (n == 0)
+			break;
+		done += n;
+	}
+
+	if (done > count)
+		done = count;
+	if (done > 0)
+		atomic_fetch_add_explicit(&fcompare_bytes_read, done, memory_order_relaxed);
+	return done;
+}
+
+/*
+ * Read up to FCOMPARE_IOSIZE bytes at an arbitrary offset into buf, which
+ * holds FCOMPARE_BUFSIZE bytes. With direct I/O, the read is widened to the
+ * alignment, and *data is set to where the requested bytes start. The file
+ * is switched to O_DIRECT only for the duration of the read, because libelf
+ * and the archive readers use the same file descriptor.
+ */
+ssize_t
+fcompare_pread(int fd, unsigned char *buf, size_t count, off_t offset, unsigned char **data)
+{
+	off_t start = offset;
+	ssize_t n;
+
+	if (fcompare_direct_io) {
+		start = offset & ~(off_t) (FCOMPARE_ALIGN - 1);
+		fcompare_enable_direct(fd);
+	}
+
+	n = fcompare_read(fd, buf, count + (offset - start), start);
+
+	if (fcompare_direct_io)
+		fcompare_disable_direct(fd);
+
+	*data = buf + (offset - start);
+	if (n < 0)
+		return n;
+	n -= offset - start;
+	return (n < 0)? 0 : n;
+}
+
+/*
+ * Compare two byte ranges, which may be at different offsets in their
+ * files. Returns true if they differ, or cannot be read.
+ */
+bool
+fcompare_regions_differ(int old_fd, off_t old_offset, int new_fd, off_t new_offset, off_t size)
+{
+	unsigned char *buf, *old_data, *new_data;
+	bool differ = false;
+	off_t done;
+
+	if ((buf = fcompare_buffer_get()) == NULL)
+		return true;
+
+	for (done = 0; done < size && !differ; ) {
+		size_t count = FCOMPARE_IOSIZE;
+
+		if (count > size - done)
+			count = size - done;
+
+		if (fcompare_pread(old_fd, buf, count, old_offset + done, &old_data) != (ssize_t) count
+		 || fcompare_pread(new_fd, buf + FCOMPARE_BUFSIZE, count, new_offset + done, &new_data) != (ssize_t) count
+		 || memcmp(old_data, new_data, count))
+			differ = true;
+		done += count;
+	}
+
+	fcompare_buffer_put(buf);
+	return differ;
+}
+
+/*
+ * Compute the digest of an open file. This reads the file through the
+ * buffer pool, with O_DIRECT if enabled, just like the comparison does.
+ */
+bool
+fcompare_digest(int fd, const char *path, unsigned char *md)
+{
+	unsigned char *buf, *data;
+	struct digest d;
+	off_t offset = 0;
+	ssize_t n;
+
+	if ((buf = fcompare_buffer_get()) == NULL)
+		return false;
+
+	digest_init(&d);
+	while ((n = fcompare_pread(fd, buf, FCOMPARE_IOSIZE, offset, &data)) > 0) {
+		digest_update(&d, data, n);
+		offset += n;
+	}
+	fcompare_buffer_put(buf);
+
+	if (n < 0) {
+		fprintf(stderr, "Error: failed to read from %s: %m\n", path);
+		return false;
+	}
+
+	digest_final(&d, md);
+	return true;
+}
+
+/*
+ * Add a range to the set, keeping it sorted and merging overlapping or
+ * adjacent ranges. Returns false if the set is full.
+ */
+bool
+ignore_set_add(struct ignore_set *set, off_t offset, size_t size)
+{
+	off_t end = offset + size;
+	unsigned int i, j;
+
+	if (size == 0)
+		return true;
+
+	/* find the first range that ends at or after our start */
+	for (i = 0; i < set->count && set->ranges[i].offset + (off_t) set->ranges[i].size < offset; ++i)
+		;
+
+	/* absorb all ranges that overlap or touch the new one */
+	for (j = i; j < set->count && set->ranges[j].offset <= end; ++j) {
+		off_t range_end = set->ranges[j].offset + set->ranges[j].size;
+
+		if (set->ranges[j].offset < offset)
+			offset = set->ranges[j].offset;
+		if (range_end > end)
+			end = range_end;
+	}
+
+	if (i == j) {
+		if (set->count >= IGNORE_SET_MAX)
+			return false;
+		memmove(&set->ranges[i + 1], &set->ranges[i], (set->count - i) * sizeof(set->ranges[0]));
+		set->count++;
+	} else if (j > i + 1) {
+		memmove(&set->ranges[i + 1], &set->ranges[j], (set->count - j) * sizeof(set->ranges[0]));
+		set->count -= j - i - 1;
+	}
+
+	set->ranges[i].offset = offset;
+	set->ranges[i].size = end - offset;
+	return true;
+}
+
+bool
+ignore_set_equal(const struct ignore_set *a, const struct ignore_set *b)
+{
+	return a->count == b->count
+	    && !memcmp(a->ranges, b->ranges, a->count * sizeof(a->ranges[0]));
+}
+
+/*
+ * Clear all bytes of buf that fall into one of the ignored ranges. buf holds
+ * len bytes of file data starting at offset. Ranges may start before the
+ * buffer or extend beyond its end.
+ */
+static void
+ignore_set_whiteout(const struct ignore_set *set, unsigned char *buf, off_t offset, size_t len)
+{
+	off_t end = offset + len;
+	unsigned int lo = 0, hi = set->count;
+
+	/* binary search for the first range that ends after offset */
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (set->ranges[mid].offset + (off_t) set->ranges[mid].size <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < set->count && set->ranges[lo].offset < end; ++lo) {
+		off_t start = set->ranges[lo].offset;
+		off_t stop = start + set->ranges[lo].size;
+
+		if (start < offset)
+			start = offset;
+		if (stop > end)
+			stop = end;
+		memset(buf + (start - offset), 0, stop - start);
+	}
+}
+
+static inline off_t
+first_difference(const unsigned char *a, const unsigned char *b, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && a[i] == b[i]; ++i)
+		;
+	return i;
+}
+
+/*
+ * Compare the byte range [offset, offset + size) of both files. If the
+ * range differs, the offset of the first difference is stored in *diff.
+ * If cancel is given, we give up as soon as it drops below the offset
+ * we're looking at, because someone already found an earlier difference.
+ * Returns false on error.
+ */
+static bool
+fcompare_data(struct fcompare *fc, off_t offset, off_t size, atomic_llong *cancel, off_t *diff)
+{
+	unsigned char *old_buf, *new_buf;
+	off_t end = offset + size;
+	bool status = true;
+
+	if ((old_buf = fcompare_buffer_get()) == NULL)
+		return false;
+	new_buf = old_buf + FCOMPARE_BUFSIZE;
+
+	*diff = -1;
+	while (offset < end) {
+		size_t count = FCOMPARE_BUFSIZE;
+		ssize_t old_len, new_len;
+
+		if (cancel && atomic_load_explicit(cancel, memory_order_relaxed) <= offset)
+			break;
+
+		if (count > end - offset)
+			count = end - offset;
+
+		if ((old_len = fcompare_read(fc->old_fd, old_buf, count, offset)) < 0) {
+			fprintf(stderr, "Error: failed to read from %s: %m\n", fc->old_path);
+			status = false;
+			break;
+		}
+
+		if ((new_len = fcompare_read(fc->new_fd, new_buf, count, offset)) < 0) {
+			fprintf(stderr, "Error: failed to read from %s: %m\n", fc->new_path);
+			status = false;
+			break;
+		}
+
+		if (fc->skip != NULL) {
+			ignore_set_whiteout(fc->skip, old_buf, offset, old_len);
+			ignore_set_whiteout(fc->skip, new_buf, offset, new_len);
+		}
+
+		if (old_len != new_len || memcmp(old_buf, new_buf, old_len)) {
+			size_t len = (old_len < new_len)? old_len : new_len;
+
+			*diff = offset + first_difference(old_buf, new_buf, len);
+			break;
+		}
+
+		/* file shrunk underneath us */
+		if (old_len == 0) {
+			*diff = offset;
+			break;
+		}
+
+		offset += old_len;
+	}
+
+	fcompare_buffer_put(old_buf);
+	return status;
+}
+
+/*
+ * Find the end of the data or hole segment of fd that contains pos.
+ * Sets *is_data accordingly.
+ */
+static off_t
+fcompare_segment_end(int fd, off_t pos, off_t end, bool *is_data)
+{
+	off_t next;
+
+	if ((next = lseek(fd, pos, SEEK_DATA)) < 0 || next > pos) {
+		/* we're in a hole; ENXIO means it extends to the end of file */
+		*is_data = false;
+		return (next < 0 || next > end)? end : next;
+	}
+
+	*is_data = true;
+	if ((next = lseek(fd, pos, SEEK_HOLE)) < 0 || next > end)
+		return end;
+	return next;
+}
+
+/*
+ * Compare a range of two files that have holes.
+ */
+static bool
+fcompare_sparse(struct fcompare *fc, off_t offset, off_t size, atomic_llong *cancel, off_t *diff)
+{
+	off_t pos = offset, end = offset + size;
+
+	*diff = -1;
+	while (pos < end) {
+		bool old_data, new_data;
+		off_t old_end, new_end, seg_end;
+
+		if (cancel && atomic_load_explicit(cancel, memory_order_relaxed) <= pos)
+			break;
+
+		old_end = fcompare_segment_end(fc->old_fd, pos, end, &old_data);
+		new_end = fcompare_segment_end(fc->new_fd, pos, end, &new_data);
+		seg_end = (old_end < new_end)? old_end : new_end;
+		if (seg_end <= pos)
+			seg_end = end;
+
+		if (!old_data && !new_data) {
+			atomic_fetch_add_explicit(&fcompare_bytes_skipped, 2 * (seg_end - pos), memory_order_relaxed);
+		} else if (old_data != new_data && fcompare_strict_holes) {
+			*diff = pos;
+			break;
+		} else {
+			if (!fcompare_data(fc, pos, seg_end - pos, cancel, diff))
+				return false;
+			if (*diff >= 0)
+				break;
+		}
+
+		pos = seg_end;
+	}
+
+	return true;
+}
+
+/*
+ * Returns true if the file has a hole before end
+ */
+static bool
+fcompare_has_holes(int fd, off_t end)
+{
+	off_t hole;
+
+	hole = lseek(fd, 0, SEEK_HOLE);
+	return hole >= 0 && hole < end;
+}
+
+static bool
+fcompare_range(struct fcompare *fc, off_t offset, off_t size, atomic_llong *cancel, off_t *diff)
+{
+	if (fc->sparse)
+		return fcompare_sparse(fc, offset, size, cancel, diff);
+	return fcompare_data(fc, offset, size, cancel, diff);
+}
+
+/*
+ * Range-parallel comparison of large files
+ */
+struct fcompare_parallel {
+	struct fcompare *	fc;
+	unsigned long		nchunks;
+	atomic_ulong		next_chunk;
+	atomic_llong		first_diff;
+	atomic_bool		failed;
+};
+
+static void *
+fcompare_parallel_thread(void *arg)
+{
+	struct fcompare_parallel *par = arg;
+	struct fcompare *fc = par->fc;
+	unsigned long chunk;
+
+	while ((chunk = atomic_fetch_add(&par->next_chunk, 1)) < par->nchunks) {
+		off_t offset = chunk * (off_t) FCOMPARE_CHUNK_SIZE;
+		off_t size = FCOMPARE_CHUNK_SIZE;
+		off_t diff, current;
+
+		/* chunks are handed out in ascending order, so all remaining
+		 * chunks are beyond the difference found */
+		if (atomic_load(&par->first_diff) <= offset)
+			break;
+
+		if (size > fc->size - offset)
+			size = fc->size - offset;
+
+		if (!fcompare_range(fc, offset, size, &par->first_diff, &diff)) {
+			atomic_store(&par->failed, true);
+			atomic_store(&par->first_diff, -1);
+			break;
+		}
+
+		if (diff < 0)
+			continue;
+
+		current = atomic_load(&par->first_diff);
+		while (diff < current
+		    && !atomic_compare_exchange_weak(&par->first_diff, &current, diff))
+			;
+	}
+
+	return NULL;
+}
+
+static bool
+fcompare_parallel(struct fcompare *fc)
+{
+	struct fcompare_parallel par;
+	unsigned int i, nthreads = fcompare_parallel_threads;
+	pthread_t *threads;
+
+	memset(&par, 0, sizeof(par));
+	par.fc = fc;
+	par.nchunks = (fc->size + FCOMPARE_CHUNK_SIZE - 1) / FCOMPARE_CHUNK_SIZE;
+	atomic_init(&par.first_diff, LLONG_MAX);
+
+	if (nthreads > par.nchunks)
+		nthreads = par.nchunks;
+
+	/* the calling thread takes part, too */
+	threads = calloc(nthreads, sizeof(threads[0]));
+	for (i = 1; i < nthreads; ++i)
+		pthread_create(&threads[i], NULL, fcompare_parallel_thread, &par);
+	fcompare_parallel_thread(&par);
+	for (i = 1; i < nthreads; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	if (atomic_load(&par.failed))
+		return false;
+
+	fc->diff_offset = atomic_load(&par.first_diff);
+	if (fc->diff_offset == LLONG_MAX)
+		fc->diff_offset = -1;
+	return true;
+}
+
+/*
+ * Compare two decompressed streams. If they differ, *diff_offset is set to
+ * the offset of the first difference in the uncompressed data. Returns
+ * false on error.
+ */
+bool
+fcompare_streams(struct zstream *old, struct zstream *new, off_t *diff_offset)
+{
+	unsigned char *old_buf, *new_buf;
+	off_t offset = 0;
+	bool status = true;
+
+	if ((old_buf = fcompare_buffer_get()) == NULL)
+		return false;
+	new_buf = old_buf + FCOMPARE_BUFSIZE;
+
+	*diff_offset = -1;
+	while (true) {
+		ssize_t old_len, new_len;
+
+		if ((old_len = zstream_read(old, old_buf, FCOMPARE_BUFSIZE)) < 0
+		 || (new_len = zstream_read(new, new_buf, FCOMPARE_BUFSIZE)) < 0) {
+			status = false;
+			break;
+		}
+
+		atomic_fetch_add_explicit(&fcompare_bytes_decompressed, old_len + new_len, memory_order_relaxed);
+
+		if (old_len != new_len || memcmp(old_buf, new_buf, old_len)) {
+			size_t len = (old_len < new_len)? old_len : new_len;
+
+			*diff_offset = offset + first_difference(old_buf, new_buf, len);
+			break;
+		}
+
+		if (old_len < FCOMPARE_BUFSIZE)
+			break;
+		offset += old_len;
+	}
+
+	fcompare_buffer_put(old_buf);
+	return status;
+}
+
+/*
+ * Read the next chunk of a decompressed kernel module, keeping track of
+ * its size and its last ELF_MODULE_TRAILER_LEN bytes.
+ */
+struct fcompare_module {
+	unsigned char *		buf;
+	ssize_t			len;
+	off_t			size;
+	unsigned char		tail[ELF_MODULE_TRAILER_LEN];
+	bool			done;
+};
+
+static bool
+fcompare_module_read(struct fcompare_module *m, struct zstream *zs)
+{
+	const size_t tail_len = ELF_MODULE_TRAILER_LEN;
+
+	if ((m->len = zstream_read(zs, m->buf, FCOMPARE_BUFSIZE)) < 0)
+		return false;
+
+	atomic_fetch_add_explicit(&fcompare_bytes_decompressed, m->len, memory_order_relaxed);
+
+	if (m->len >= tail_len) {
+		memcpy(m->tail, m->buf + m->len - tail_len, tail_len);
+	} else if (m->len) {
+		memmove(m->tail, m->tail + m->len, tail_len - m->len);
+		memcpy(m->tail + tail_len - m->len, m->buf, m->len);
+	}
+
+	m->size += m->len;
+	m->done = (m->len < FCOMPARE_BUFSIZE);
+	return true;
+}
+
+/*
+ * Compare two compressed kernel modules. Their signature trailer is at the
+ * end of the decompressed data, so unlike fcompare_streams(), we read both
+ * streams to the end even after finding a difference. *old_body and
+ * *new_body are set to the size of the module proper, or -1 if a module
+ * is not signed. Returns false on error.
+ */
+bool
+fcompare_module_streams(struct zstream *old, struct zstream *new, off_t *diff_offset,
+		off_t *old_body, off_t *new_body)
+{
+	struct fcompare_module m_old, m_new;
+	unsigned char *buf;
+	off_t offset = 0;
+	bool status = true;
+
+	if ((buf = fcompare_buffer_get()) == NULL)
+		return false;
+
+	memset(&m_old, 0, sizeof(m_old));
+	memset(&m_new, 0, sizeof(m_new));
+	m_old.buf = buf;
+	m_new.buf = buf + FCOMPARE_BUFSIZE;
+
+	*diff_offset = -1;
+	while (!m_old.done || !m_new.done) {
+		bool both = !m_old.done && !m_new.done;
+
+		if ((!m_old.done && !fcompare_module_read(&m_old, old))
+		 || (!m_new.done && !fcompare_module_read(&m_new, new))) {
+			status = false;
+			break;
+		}
+
+		if (*diff_offset < 0) {
+			if (!both) {
+				*diff_offset = offset;
+			} else if (m_old.len != m_new.len || memcmp(m_old.buf, m_new.buf, m_old.len)) {
+				size_t len = (m_old.len < m_new.len)? m_old.len : m_new.len;
+
+				*diff_offset = offset + first_difference(m_old.buf, m_new.buf, len);
+			}
+		}
+
+		/* only used until we find a difference, when both are the same length */
+		offset += m_old.len;
+	}
+
+	fcompare_buffer_put(buf);
+
+	*old_body = elf_module_signature_trailer(m_old.tail, m_old.size);
+	*new_body = elf_module_signature_trailer(m_new.tail, m_new.size);
+	return status;
+}
+
+/*
+ * Compare the probe regions. The regions are extended to the I/O alignment,
+ * so that they can be read with O_DIRECT, too; comparing a few extra bytes
+ * does no harm. Returns false on error.
+ */
+static bool
+fcompare_probes(struct fcompare *fc)
+{
+	off_t probed = 0;
+	unsigned int i;
+
+	for (i = 0; i < fc->nprobes; ++i) {
+		const struct fregion *r = &fc->probes[i];
+		off_t start, end;
+
+		start = r->offset & ~(off_t) (FCOMPARE_ALIGN - 1);
+		end = (r->offset + r->size + FCOMPARE_ALIGN - 1) & ~(off_t) (FCOMPARE_ALIGN - 1);
+		if (end > fc->size)
+			end = fc->size;
+		if (start >= end)
+			continue;
+
+		if (!fcompare_range(fc, start, end - start, NULL, &fc->diff_offset))
+			return false;
+
+		probed += end - start;
+		if (fc->diff_offset >= 0) {
+			fc->diff_region = r->name;
+			atomic_fetch_add(&fcompare_probe_hits, 1);
+			if (fc->size > probed)
+				atomic_fetch_add(&fcompare_bytes_saved, 2 * (fc->size - probed));
+			break;
+		}
+	}
+
+	return true;
+}
+
+static void
+fcompare_readahead(int fd)
+{
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fd, 0, FCOMPARE_READAHEAD, POSIX_FADV_WILLNEED);
+}
+
+/*
+ * Compare the contents of two open files of fc->size bytes each. On return,
+ * fc->diff_offset holds the offset of the first difference, or -1 if the
+ * files are identical. Returns false on error.
+ */
+bool
+fcompare_run(struct fcompare *fc)
+{
+	fc->diff_offset = -1;
+	fc->diff_region = NULL;
+
+	if (fcompare_direct_io) {
+		fcompare_enable_direct(fc->old_fd);
+		fcompare_enable_direct(fc->new_fd);
+	}
+
+	fc->sparse = fcompare_has_holes(fc->old_fd, fc->size)
+		  || fcompare_has_holes(fc->new_fd, fc->size);
+
+	if (fc->nprobes) {
+		if (!fcompare_probes(fc))
+			return false;
+		if (fc->diff_offset >= 0)
+			return true;
+	}
+
+	/* From here on, we read both files front to back. Tell the kernel to
+	 * use a larger readahead window, and start reading right away. */
+	if (!fcompare_direct_io) {
+		fcompare_readahead(fc->old_fd);
+		fcompare_readahead(fc->new_fd);
+	}
+
+	if (fcompare_parallel_threshold && fcompare_parallel_threads > 1
+	 && fc->size >= fcompare_parallel_threshold)
+		return fcompare_parallel(fc);
+
+	return fcompare_range(fc, 0, fc->size, NULL, &fc->diff_offset);
+}
+
+/*
+ * cachestat(2) tells us how many pages of a file are in the page cache.
+ * It is fairly new (Linux 6.5), so glibc may not know about it yet.
+ */
+#ifndef __NR_cachestat
+# define __NR_cachestat	451
+#endif
+
+struct fcompare_cachestat_range {
+	uint64_t	off;
+	uint64_t	len;
+};
+
+struct fcompare_cachestat {
+	uint64_t	nr_cache;
+	uint64_t	nr_dirty;
+	uint64_t	nr_writeback;
+	uint64_t	nr_evicted;
+	uint64_t	nr_recently_evicted;
+};
+
+static long
+fcompare_cached_pages(int fd)
+{
+	struct fcompare_cachestat_range range = { 0, 0 };
+	struct fcompare_cachestat cs;
+
+	if (atomic_load(&fcompare_cachestat_missing))
+		return -1;
+
+	if (syscall(__NR_cachestat, fd, &range, &cs, 0) < 0) {
+		if (errno == ENOSYS)
+			atomic_store(&fcompare_cachestat_missing, true);
+		return -1;
+	}
+	return cs.nr_cache;
+}
+
+static void
+__fcompare_drop_cache(int fd, off_t size)
+{
+	long before, after;
+
+	before = fcompare_cached_pages(fd);
+	if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0)
+		return;
+
+	/* Without cachestat, assume that the whole file was cached */
+	if (before < 0 || (after = fcompare_cached_pages(fd)) < 0) {
+		atomic_fetch_add(&fcompare_bytes_dropped, size);
+	} else if (before > after) {
+		atomic_fetch_add(&fcompare_bytes_dropped, (before - after) * sysconf(_SC_PAGESIZE));
+	}
+	atomic_fetch_add(&fcompare_files_dropped, 1);
+}
+
+/*
+ * Drop the pages of both files from the page cache
+ */
+void
+fcompare_drop_cache(struct fcompare *fc)
+{
+	if (!fcompare_drop)
+		return;
+
+	__fcompare_drop_cache(fc->old_fd, fc->size);
+	__fcompare_drop_cache(fc->new_fd, fc->size);
+}
+
+void
+fcompare_print_stats(FILE *fp)
+{
+	fprintf(fp, "Content comparison: %llu bytes read, %llu bytes of holes skipped\n",
+			atomic_load(&fcompare_bytes_read),
+			atomic_load(&fcompare_bytes_skipped));
+	fprintf(fp, "  probing: %lu differences found early, saving up to %llu bytes of reads\n",
+			atomic_load(&fcompare_probe_hits),
+			atomic_load(&fcompare_bytes_saved));
+	fprintf(fp, "  decompression: %llu bytes of uncompressed data compared\n",
+			atomic_load(&fcompare_bytes_decompressed));
+	if (fcompare_drop)
+		fprintf(fp, "  page cache: dropped %llu bytes of %lu files%s\n",
+				atomic_load(&fcompare_bytes_dropped),
+				atomic_load(&fcompare_files_dropped),
+				atomic_load(&fcompare_cachestat_missing)? " (estimated, cachestat not available)" : "");
+}
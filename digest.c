@@ -0,0 +1,160 @@
+/*
+ * ftreecmp
+ *
+ * SHA-256 message digest, used for identifying file contents
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "fstate.h"
+
+static const uint32_t	sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t
+ror32(uint32_t x, unsigned int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static void
+sha256_transform(struct digest *d, const unsigned char *block)
+{
+	uint32_t w[64], a, b, c, e, f, g, h, dd;
+	unsigned int i;
+
+	for (i = 0; i < 16; ++i)
+		w[i] = (block[4 * i] << 24) | (block[4 * i + 1] << 16) | (block[4 * i + 2] << 8) | block[4 * i + 3];
+	for (; i < 64; ++i) {
+		uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = d->state[0]; b = d->state[1]; c = d->state[2]; dd = d->state[3];
+	e = d->state[4]; f = d->state[5]; g = d->state[6]; h = d->state[7];
+
+	for (i = 0; i < 64; ++i) {
+		uint32_t t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+		h = g; g = f; f = e; e = dd + t1;
+		dd = c; c = b; b = a; a = t1 + t2;
+	}
+
+	d->state[0] += a; d->state[1] += b; d->state[2] += c; d->state[3] += dd;
+	d->state[4] += e; d->state[5] += f; d->state[6] += g; d->state[7] += h;
+}
+
+void
+digest_init(struct digest *d)
+{
+	static const uint32_t sha256_init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(d->state, sha256_init, sizeof(d->state));
+	d->count = 0;
+}
+
+void
+digest_update(struct digest *d, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	unsigned int fill = d->count % sizeof(d->block);
+
+	d->count += len;
+
+	if (fill) {
+		unsigned int n = sizeof(d->block) - fill;
+
+		if (n > len)
+			n = len;
+		memcpy(d->block + fill, p, n);
+		p += n;
+		len -= n;
+
+		if (fill + n < sizeof(d->block))
+			return;
+		sha256_transform(d, d->block);
+	}
+
+	while (len >= sizeof(d->block)) {
+		sha256_transform(d, p);
+		p += sizeof(d->block);
+		len -= sizeof(d->block);
+	}
+
+	if (len)
+		memcpy(d->block, p, len);
+}
+
+void
+digest_final(struct digest *d, unsigned char *md)
+{
+	uint64_t bits = d->count * 8;
+	unsigned char pad[72];
+	unsigned int fill, npad, i;
+
+	fill = d->count % sizeof(d->block);
+	npad = (fill < 56)? 56 - fill : 120 - fill;
+
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; ++i)
+		pad[npad + i] = bits >> (56 - 8 * i);
+	digest_update(d, pad, npad + 8);
+
+	for (i = 0; i < 8; ++i) {
+		md[4 * i] = d->state[i] >> 24;
+		md[4 * i + 1] = d->state[i] >> 16;
+		md[4 * i + 2] = d->state[i] >> 8;
+		md[4 * i + 3] = d->state[i];
+	}
+}
+
+/*
+ * Compute the SHA-256 digest of a regular file
+ */
+bool
+digest_file(const char *path, unsigned char *md)
+{
+	unsigned char buffer[8192];
+	struct digest d;
+	int fd, n;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "Error: unable to open %s: %m\n", path);
+		return false;
+	}
+
+	digest_init(&d);
+	while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+		digest_update(&d, buffer, n);
+	close(fd);
+
+	if (n < 0) {
+		fprintf(stderr, "Error: failed to read from %s: %m\n", path);
+		return false;
+	}
+
+	digest_final(&d, md);
+	return true;
+}
@@ -0,0 +1,1068 @@
+/*
+ * ftreecmp
+ *
+ * ELF and ar specific helpers for comparing files.
+ *
+ * When two ELF files differ, the difference is usually in a few well known
+ * places: the ELF header, the build-id note, the .gnu_debuglink section,
+ * the .comment section, and the section header table at the end. For ar
+ * archives, it is usually the member headers, which carry timestamps.
+ * elf_probe_regions() locates these regions, so that they can be compared
+ * before the rest of the file.
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libelf.h>
+#include <gelf.h>
+
+#include "fstate.h"
+
+/* not in older glibc headers */
+#ifndef ELFCOMPRESS_ZSTD
+# define ELFCOMPRESS_ZSTD	2
+#endif
+
+/* not in glibc's elf.h */
+#ifndef VERSYM_HIDDEN
+# define VERSYM_HIDDEN		0x8000
+# define VERSYM_VERSION		0x7fff
+#endif
+
+#define AR_MAGIC		"!<arch>\n"
+#define AR_MAGIC_LEN		8
+#define AR_HEADER_LEN		60
+
+static void
+probe_add(struct fregion *regions, unsigned int *count, unsigned int max,
+		const char *name, off_t offset, off_t size, off_t file_size)
+{
+	if (*count >= max || size <= 0 || offset < 0 || offset >= file_size)
+		return;
+	if (size > file_size - offset)
+		size = file_size - offset;
+
+	regions[*count].name = name;
+	regions[*count].offset = offset;
+	regions[*count].size = size;
+	(*count)++;
+}
+
+static unsigned int
+elf_probe_elf(int fd, off_t file_size, struct fregion *regions, unsigned int max)
+{
+	static const char *interesting[] = {
+		".note.gnu.build-id",
+		".gnu_debuglink",
+		".comment",
+		NULL
+	};
+	unsigned int count = 0;
+	GElf_Ehdr ehdr;
+	Elf_Scn *scn;
+	size_t shstrndx;
+	Elf *elf;
+
+	if (!(elf = elf_begin(fd, ELF_C_READ, NULL)))
+		return 0;
+
+	if (elf_kind(elf) != ELF_K_ELF || gelf_getehdr(elf, &ehdr) != &ehdr)
+		goto out;
+
+	probe_add(regions, &count, max, "ELF header", 0, ehdr.e_ehsize, file_size);
+
+	if (elf_getshdrstrndx(elf, &shstrndx) == 0) {
+		unsigned int i;
+
+		/* probe in the order given above, not in file order */
+		for (i = 0; interesting[i]; ++i) {
+			for (scn = NULL; (scn = elf_nextscn(elf, scn)) != NULL; ) {
+				GElf_Shdr shdr;
+				const char *name;
+
+				if (gelf_getshdr(scn, &shdr) != &shdr
+				 || shdr.sh_type == SHT_NOBITS
+				 || (name = elf_strptr(elf, shstrndx, shdr.sh_name)) == NULL)
+					continue;
+
+				if (!strcmp(name, interesting[i]))
+					probe_add(regions, &count, max, interesting[i],
+							shdr.sh_offset, shdr.sh_size, file_size);
+			}
+		}
+	}
+
+	probe_add(regions, &count, max, "section headers",
+			ehdr.e_shoff, (off_t) ehdr.e_shnum * ehdr.e_shentsize, file_size);
+
+out:
+	elf_end(elf);
+	return count;
+}
+
+/*
+ * ar archive: probe the member headers, which contain the mtime, uid
+ * and gid of each member.
+ */
+static unsigned int
+elf_probe_ar(int fd, off_t file_size, struct fregion *regions, unsigned int max)
+{
+	unsigned int count = 0;
+	off_t offset = AR_MAGIC_LEN;
+
+	while (count < max && offset + AR_HEADER_LEN <= file_size) {
+		char hdr[AR_HEADER_LEN + 1];
+		unsigned long size;
+
+		if (pread(fd, hdr, AR_HEADER_LEN, offset) != AR_HEADER_LEN)
+			break;
+		if (hdr[58] != '`' || hdr[59] != '\n')
+			break;
+
+		hdr[58] = '\0';
+		size = strtoul(hdr + 48, NULL, 10);
+
+		probe_add(regions, &count, max, "ar member header", offset, AR_HEADER_LEN, file_size);
+		offset += AR_HEADER_LEN + size + (size & 1);
+	}
+
+	return count;
+}
+
+/*
+ * Find the regions of an ELF file or ar archive in which differences are
+ * most likely. Returns the number of regions found.
+ */
+unsigned int
+elf_probe_regions(int fd, off_t file_size, struct fregion *regions, unsigned int max)
+{
+	char magic[AR_MAGIC_LEN];
+
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+		return 0;
+
+	if (!memcmp(magic, ELFMAG, SELFMAG))
+		return elf_probe_elf(fd, file_size, regions, max);
+	if (!memcmp(magic, AR_MAGIC, AR_MAGIC_LEN))
+		return elf_probe_ar(fd, file_size, regions, max);
+	return 0;
+}
+
+/*
+ * Section-by-section comparison of two ELF files.
+ */
+struct elf_section {
+	const char *	name;
+	unsigned int	index;
+	GElf_Shdr	shdr;
+	bool		paired;
+	bool		differs;
+};
+
+struct elf_file {
+	int		fd;
+	Elf *		archive;	/* for archive members */
+	Elf *		elf;
+	off_t		base;		/* offset of the ELF image in the file */
+	off_t		size;		/* size of the ELF image */
+	GElf_Ehdr	ehdr;
+	unsigned int	nsections;
+	struct elf_section *sections;
+	struct elf_section **sorted;
+};
+
+static void
+elf_file_destroy(struct elf_file *ef)
+{
+	free(ef->sections);
+	free(ef->sorted);
+	if (ef->elf)
+		elf_end(ef->elf);
+	if (ef->archive)
+		elf_end(ef->archive);
+}
+
+static int
+elf_section_compare_name(const void *a, const void *b)
+{
+	const struct elf_section *sa = *(const struct elf_section **) a;
+	const struct elf_section *sb = *(const struct elf_section **) b;
+	int r;
+
+	if ((r = strcmp(sa->name, sb->name)) != 0)
+		return r;
+	/* sections with the same name are paired in file order */
+	return (int) sa->index - (int) sb->index;
+}
+
+/*
+ * Open an ELF file, or the member of an ar archive whose header is at the
+ * given offset. For plain files, member is -1.
+ */
+static bool
+elf_file_init(struct elf_file *ef, int fd, off_t member)
+{
+	size_t shnum, shstrndx;
+	Elf_Scn *scn;
+	unsigned int i;
+
+	memset(ef, 0, sizeof(*ef));
+	ef->fd = fd;
+
+	if (member >= 0) {
+		if (!(ef->archive = elf_begin(fd, ELF_C_READ, NULL))
+		 || elf_kind(ef->archive) != ELF_K_AR
+		 || elf_rand(ef->archive, member) != (size_t) member)
+			return false;
+	}
+
+	if (!(ef->elf = elf_begin(fd, ELF_C_READ, ef->archive)))
+		return false;
+	if ((ef->base = elf_getbase(ef->elf)) < 0)
+		ef->base = 0;
+
+	if (ef->archive) {
+		Elf_Arhdr *arhdr;
+
+		if (!(arhdr = elf_getarhdr(ef->elf)))
+			return false;
+		ef->size = arhdr->ar_size;
+	} else {
+		struct stat stb;
+
+		if (fstat(fd, &stb) < 0)
+			return false;
+		ef->size = stb.st_size;
+	}
+
+	if (elf_kind(ef->elf) != ELF_K_ELF
+	 || gelf_getehdr(ef->elf, &ef->ehdr) != &ef->ehdr
+	 || elf_getshdrnum(ef->elf, &shnum) != 0
+	 || elf_getshdrstrndx(ef->elf, &shstrndx) != 0)
+		return false;
+
+	ef->sections = calloc(shnum? shnum : 1, sizeof(ef->sections[0]));
+	ef->sorted = calloc(shnum? shnum : 1, sizeof(ef->sorted[0]));
+
+	for (scn = NULL; (scn = elf_nextscn(ef->elf, scn)) != NULL; ) {
+		struct elf_section *s;
+
+		if (ef->nsections >= shnum)
+			break;
+
+		s = &ef->sections[ef->nsections];
+		if (gelf_getshdr(scn, &s->shdr) != &s->shdr)
+			return false;
+		if ((s->name = elf_strptr(ef->elf, shstrndx, s->shdr.sh_name)) == NULL)
+			return false;
+		s->index = elf_ndxscn(scn);
+		ef->nsections++;
+	}
+
+	for (i = 0; i < ef->nsections; ++i)
+		ef->sorted[i] = &ef->sections[i];
+	qsort(ef->sorted, ef->nsections, sizeof(ef->sorted[0]), elf_section_compare_name);
+	return true;
+}
+
+/*
+ * Everything in the ELF header but the location and size of the section
+ * header table, which moves when section sizes change.
+ */
+static bool
+elf_headers_differ(const GElf_Ehdr *old, const GElf_Ehdr *new)
+{
+	return memcmp(old->e_ident, new->e_ident, EI_NIDENT)
+	    || old->e_type != new->e_type
+	    || old->e_machine != new->e_machine
+	    || old->e_version != new->e_version
+	    || old->e_entry != new->e_entry
+	    || old->e_phoff != new->e_phoff
+	    || old->e_flags != new->e_flags
+	    || old->e_ehsize != new->e_ehsize
+	    || old->e_phentsize != new->e_phentsize
+	    || old->e_phnum != new->e_phnum
+	    || old->e_shentsize != new->e_shentsize;
+}
+
+static bool
+elf_program_headers_differ(struct elf_file *old, struct elf_file *new)
+{
+	size_t old_phnum, new_phnum, i;
+
+	if (elf_getphdrnum(old->elf, &old_phnum) != 0
+	 || elf_getphdrnum(new->elf, &new_phnum) != 0)
+		return true;
+
+	if (old_phnum != new_phnum)
+		return true;
+
+	for (i = 0; i < old_phnum; ++i) {
+		GElf_Phdr old_phdr, new_phdr;
+
+		if (gelf_getphdr(old->elf, i, &old_phdr) != &old_phdr
+		 || gelf_getphdr(new->elf, i, &new_phdr) != &new_phdr)
+			return true;
+		if (memcmp(&old_phdr, &new_phdr, sizeof(old_phdr)))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Compare the file contents of two sections, which may live at different
+ * offsets in their respective files.
+ */
+static bool
+elf_section_contents_differ(struct elf_file *old, const GElf_Shdr *old_shdr,
+			struct elf_file *new, const GElf_Shdr *new_shdr)
+{
+	if (old_shdr->sh_size != new_shdr->sh_size)
+		return true;
+
+	/* nothing in the file */
+	if (old_shdr->sh_type == SHT_NOBITS)
+		return false;
+
+	return fcompare_regions_differ(old->fd, old->base + old_shdr->sh_offset,
+				new->fd, new->base + new_shdr->sh_offset, old_shdr->sh_size);
+}
+
+/*
+ * Compressed sections (SHF_COMPRESSED) start with a compression header,
+ * followed by the compressed data. We don't use gelf_getchdr(), because it
+ * reads the entire section into memory.
+ */
+struct elf_section_stream {
+	int		format;
+	off_t		offset;		/* of the (compressed) data */
+	off_t		size;
+	uint64_t	uncompressed_size;
+	uint64_t	uncompressed_align;
+};
+
+static inline uint32_t
+elf_get32(const struct elf_file *ef, const unsigned char *p)
+{
+	if (ef->ehdr.e_ident[EI_DATA] == ELFDATA2MSB)
+		return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	return ((uint32_t) p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+static inline uint64_t
+elf_get64(const struct elf_file *ef, const unsigned char *p)
+{
+	if (ef->ehdr.e_ident[EI_DATA] == ELFDATA2MSB)
+		return ((uint64_t) elf_get32(ef, p) << 32) | elf_get32(ef, p + 4);
+	return ((uint64_t) elf_get32(ef, p + 4) << 32) | elf_get32(ef, p);
+}
+
+static bool
+elf_section_stream_init(struct elf_file *ef, const GElf_Shdr *shdr, struct elf_section_stream *ss)
+{
+	unsigned char chdr[sizeof(Elf64_Chdr)];
+	size_t chdr_len;
+	uint32_t type;
+
+	ss->format = ZSTREAM_NONE;
+	ss->offset = ef->base + shdr->sh_offset;
+	ss->size = shdr->sh_size;
+	ss->uncompressed_size = shdr->sh_size;
+	ss->uncompressed_align = shdr->sh_addralign;
+
+	if (!(shdr->sh_flags & SHF_COMPRESSED))
+		return true;
+
+	chdr_len = (ef->ehdr.e_ident[EI_CLASS] == ELFCLASS64)? sizeof(Elf64_Chdr) : sizeof(Elf32_Chdr);
+	if (shdr->sh_size < chdr_len
+	 || pread(ef->fd, chdr, chdr_len, ss->offset) != (ssize_t) chdr_len)
+		return false;
+
+	type = elf_get32(ef, chdr);
+	if (ef->ehdr.e_ident[EI_CLASS] == ELFCLASS64) {
+		ss->uncompressed_size = elf_get64(ef, chdr + 8);
+		ss->uncompressed_align = elf_get64(ef, chdr + 16);
+	} else {
+		ss->uncompressed_size = elf_get32(ef, chdr + 4);
+		ss->uncompressed_align = elf_get32(ef, chdr + 8);
+	}
+
+	if (type == ELFCOMPRESS_ZLIB)
+		ss->format = ZSTREAM_ZLIB;
+	else if (type == ELFCOMPRESS_ZSTD)
+		ss->format = ZSTREAM_ZSTD;
+	else
+		return false;
+
+	ss->offset += chdr_len;
+	ss->size -= chdr_len;
+	return true;
+}
+
+/*
+ * Compare the uncompressed contents of two sections, at least one of which
+ * is compressed. The data is decompressed in chunks, so memory use is bounded
+ * no matter how large the debug info gets.
+ */
+static bool
+elf_compressed_sections_differ(struct elf_file *old, const GElf_Shdr *old_shdr,
+			struct elf_file *new, const GElf_Shdr *new_shdr)
+{
+	struct elf_section_stream old_ss, new_ss;
+	struct zstream *old_zs = NULL, *new_zs = NULL;
+	off_t diff_offset = 0;
+	bool rv = true;
+
+	if (!elf_section_stream_init(old, old_shdr, &old_ss)
+	 || !elf_section_stream_init(new, new_shdr, &new_ss)
+	 || old_ss.uncompressed_size != new_ss.uncompressed_size
+	 || old_ss.uncompressed_align != new_ss.uncompressed_align)
+		return true;
+
+	if ((old_zs = zstream_open_range(old->fd, old_ss.format, "old section", old_ss.offset, old_ss.size))
+	 && (new_zs = zstream_open_range(new->fd, new_ss.format, "new section", new_ss.offset, new_ss.size))
+	 && fcompare_streams(old_zs, new_zs, &diff_offset))
+		rv = (diff_offset >= 0);
+
+	if (old_zs)
+		zstream_close(old_zs);
+	if (new_zs)
+		zstream_close(new_zs);
+	return rv;
+}
+
+/*
+ * sh_link, and sh_info for relocations and with SHF_INFO_LINK, refer to
+ * other sections by index. Indices shift when sections are added or
+ * removed, so compare the names of the sections they refer to.
+ */
+static const char *
+elf_section_name(const struct elf_file *ef, GElf_Word index)
+{
+	unsigned int i;
+
+	if (index == SHN_UNDEF)
+		return "";
+	for (i = 0; i < ef->nsections; ++i) {
+		if (ef->sections[i].index == index)
+			return ef->sections[i].name;
+	}
+	return NULL;
+}
+
+static bool
+elf_section_refs_differ(const struct elf_file *old, GElf_Word old_index,
+			const struct elf_file *new, GElf_Word new_index)
+{
+	const char *old_name = elf_section_name(old, old_index);
+	const char *new_name = elf_section_name(new, new_index);
+
+	return !old_name || !new_name || strcmp(old_name, new_name);
+}
+
+static bool
+elf_sections_differ(struct elf_file *old, const struct elf_section *os,
+			struct elf_file *new, const struct elf_section *ns)
+{
+	const GElf_Shdr *oh = &os->shdr, *nh = &ns->shdr;
+
+	if (oh->sh_type != nh->sh_type
+	 || (oh->sh_flags & ~SHF_COMPRESSED) != (nh->sh_flags & ~SHF_COMPRESSED)
+	 || oh->sh_addr != nh->sh_addr
+	 || oh->sh_entsize != nh->sh_entsize
+	 || elf_section_refs_differ(old, oh->sh_link, new, nh->sh_link))
+		return true;
+
+	if (oh->sh_type == SHT_REL || oh->sh_type == SHT_RELA || (oh->sh_flags & SHF_INFO_LINK)) {
+		if (elf_section_refs_differ(old, oh->sh_info, new, nh->sh_info))
+			return true;
+	} else if (oh->sh_info != nh->sh_info) {
+		return true;
+	}
+
+	/* for compressed sections, this is the alignment of the uncompressed data */
+	if ((oh->sh_flags | nh->sh_flags) & SHF_COMPRESSED)
+		return elf_compressed_sections_differ(old, oh, new, nh);
+
+	if (oh->sh_addralign != nh->sh_addralign)
+		return true;
+	return elf_section_contents_differ(old, oh, new, nh);
+}
+
+/*
+ * The parts of an ELF image that are not covered by the headers, the
+ * section header table or any section; usually alignment padding.
+ */
+struct elf_range {
+	off_t		start, end;
+};
+
+static int
+elf_range_compare(const void *a, const void *b)
+{
+	const struct elf_range *ra = a, *rb = b;
+
+	if (ra->start != rb->start)
+		return (ra->start < rb->start)? -1 : 1;
+	return 0;
+}
+
+static bool
+elf_region_is_zero(const struct elf_file *ef, off_t offset, off_t size)
+{
+	unsigned char buf[4096];
+
+	while (size > 0) {
+		size_t count = sizeof(buf);
+		size_t i;
+
+		if (count > size)
+			count = size;
+		if (pread(ef->fd, buf, count, ef->base + offset) != (ssize_t) count)
+			return false;
+		for (i = 0; i < count; ++i) {
+			if (buf[i])
+				return false;
+		}
+		offset += count;
+		size -= count;
+	}
+	return true;
+}
+
+/*
+ * Padding is fine if it is all zero. Anything else is acceptable only
+ * inside a loadable segment, where the layout is fixed by the program
+ * headers, and then it must be identical in the other file.
+ */
+static bool
+elf_gap_differs(struct elf_file *ef, struct elf_file *other, off_t start, off_t end)
+{
+	size_t phnum, i;
+
+	if (elf_region_is_zero(ef, start, end - start))
+		return false;
+
+	if (elf_getphdrnum(ef->elf, &phnum) != 0)
+		return true;
+
+	for (i = 0; i < phnum; ++i) {
+		GElf_Phdr phdr;
+
+		if (gelf_getphdr(ef->elf, i, &phdr) != &phdr)
+			return true;
+		if (phdr.p_type == PT_LOAD
+		 && phdr.p_offset <= (GElf_Off) start
+		 && (GElf_Off) end <= phdr.p_offset + phdr.p_filesz)
+			return end > other->size
+			    || fcompare_regions_differ(ef->fd, ef->base + start,
+						other->fd, other->base + start, end - start);
+	}
+
+	return true;
+}
+
+static bool
+elf_gaps_differ(struct elf_file *ef, struct elf_file *other)
+{
+	struct elf_range *ranges;
+	unsigned int i, count = 0;
+	size_t phnum, shnum;
+	off_t covered = 0;
+	bool differ = false;
+
+	if (elf_getphdrnum(ef->elf, &phnum) != 0 || elf_getshdrnum(ef->elf, &shnum) != 0)
+		return true;
+
+	ranges = calloc(ef->nsections + 3, sizeof(ranges[0]));
+	ranges[count++] = (struct elf_range) { 0, ef->ehdr.e_ehsize };
+	if (phnum)
+		ranges[count++] = (struct elf_range) {
+			ef->ehdr.e_phoff, ef->ehdr.e_phoff + phnum * ef->ehdr.e_phentsize
+		};
+	if (shnum)
+		ranges[count++] = (struct elf_range) {
+			ef->ehdr.e_shoff, ef->ehdr.e_shoff + shnum * ef->ehdr.e_shentsize
+		};
+	for (i = 0; i < ef->nsections; ++i) {
+		const GElf_Shdr *shdr = &ef->sections[i].shdr;
+
+		if (shdr->sh_type != SHT_NOBITS)
+			ranges[count++] = (struct elf_range) {
+				shdr->sh_offset, shdr->sh_offset + shdr->sh_size
+			};
+	}
+
+	qsort(ranges, count, sizeof(ranges[0]), elf_range_compare);
+	for (i = 0; i <= count && !differ; ++i) {
+		off_t start = (i < count)? ranges[i].start : ef->size;
+
+		if (start > covered)
+			differ = elf_gap_differs(ef, other, covered, start);
+		if (i < count && ranges[i].end > covered)
+			covered = ranges[i].end;
+	}
+
+	free(ranges);
+	return differ;
+}
+
+static void
+elf_diff_append(char **buf, size_t *len, const char *prefix, const char *name)
+{
+	size_t n = strlen(prefix) + strlen(name) + 1;
+
+	*buf = realloc(*buf, *len + n + 1);
+	*len += sprintf(*buf + *len, "%s%s%s", *len? " " : "", prefix, name);
+}
+
+/*
+ * Compare two ELF files section by section. Sections are paired by name,
+ * and compared by their attributes and contents, irrespective of their
+ * location in the file. Returns a malloc'ed list of what differs, with
+ * sections in file order, and sections that exist in one file only
+ * prefixed with - or +. Returns NULL if either file is not an ELF file.
+ */
+char *
+elf_compare_sections(int old_fd, int new_fd)
+{
+	return elf_compare_members(old_fd, -1, new_fd, -1);
+}
+
+/*
+ * Same as above, for two object files inside ar archives. old_member and
+ * new_member are the offsets of the ar member headers.
+ */
+char *
+elf_compare_members(int old_fd, off_t old_member, int new_fd, off_t new_member)
+{
+	struct elf_file old = { 0 }, new = { 0 };
+	char *result = NULL;
+	size_t len = 0;
+	unsigned int i, j;
+
+	if (!elf_file_init(&old, old_fd, old_member) || !elf_file_init(&new, new_fd, new_member))
+		goto out;
+
+	/* make sure we return an empty string rather than NULL */
+	result = strdup("");
+
+	if (elf_headers_differ(&old.ehdr, &new.ehdr))
+		elf_diff_append(&result, &len, "", "ELF header");
+
+	if (elf_program_headers_differ(&old, &new))
+		elf_diff_append(&result, &len, "", "program headers");
+
+	if (elf_gaps_differ(&old, &new) || elf_gaps_differ(&new, &old))
+		elf_diff_append(&result, &len, "", "data outside sections");
+
+	for (i = j = 0; i < old.nsections && j < new.nsections; ) {
+		struct elf_section *os = old.sorted[i], *ns = new.sorted[j];
+		int r;
+
+		r = strcmp(os->name, ns->name);
+		if (r < 0) {
+			i++;
+		} else if (r > 0) {
+			j++;
+		} else {
+			os->paired = ns->paired = true;
+			os->differs = elf_sections_differ(&old, os, &new, ns);
+			i++, j++;
+		}
+	}
+
+	for (i = 0; i < old.nsections; ++i) {
+		struct elf_section *os = &old.sections[i];
+
+		if (!os->paired)
+			elf_diff_append(&result, &len, "-", os->name);
+		else if (os->differs)
+			elf_diff_append(&result, &len, "", os->name);
+	}
+
+	for (j = 0; j < new.nsections; ++j) {
+		if (!new.sections[j].paired)
+			elf_diff_append(&result, &len, "+", new.sections[j].name);
+	}
+
+out:
+	elf_file_destroy(&old);
+	elf_file_destroy(&new);
+	return result;
+}
+
+/*
+ * The exported ABI of a shared object: the defined global and weak symbols
+ * in .dynsym with default or protected visibility. Each symbol is named
+ * name@version, or name@@version for the default version of a symbol, or
+ * just by its name if it is not versioned. Only .dynsym, its string table,
+ * .gnu.version and .gnu.version_d are read, via the section table.
+ */
+#define EXPORTS_MAX_REPORTED	32
+
+struct elf_exports {
+	unsigned int	count;
+	char **		names;
+	unsigned char	digest[DIGEST_SIZE];
+};
+
+static void
+elf_exports_destroy(struct elf_exports *ex)
+{
+	unsigned int i;
+
+	for (i = 0; i < ex->count; ++i)
+		free(ex->names[i]);
+	free(ex->names);
+}
+
+static int
+elf_exports_compare_name(const void *a, const void *b)
+{
+	return strcmp(*(const char **) a, *(const char **) b);
+}
+
+static Elf_Data *
+elf_section_data(struct elf_file *ef, Elf32_Word type, const GElf_Shdr **shdr)
+{
+	unsigned int i;
+
+	for (i = 0; i < ef->nsections; ++i) {
+		struct elf_section *s = &ef->sections[i];
+		Elf_Scn *scn;
+
+		if (s->shdr.sh_type != type)
+			continue;
+		if (!(scn = elf_getscn(ef->elf, s->index)))
+			return NULL;
+		if (shdr)
+			*shdr = &s->shdr;
+		return elf_getdata(scn, NULL);
+	}
+	return NULL;
+}
+
+/*
+ * Find the name of a version definition, given its index.
+ */
+static const char *
+elf_version_name(struct elf_file *ef, Elf_Data *verdef, GElf_Word strndx, unsigned int ndx)
+{
+	GElf_Verdef vd;
+	GElf_Verdaux vda;
+	int offset = 0;
+
+	if (verdef == NULL)
+		return NULL;
+
+	while (gelf_getverdef(verdef, offset, &vd) == &vd) {
+		if (vd.vd_ndx == ndx) {
+			if (gelf_getverdaux(verdef, offset + vd.vd_aux, &vda) != &vda)
+				return NULL;
+			return elf_strptr(ef->elf, strndx, vda.vda_name);
+		}
+		if (vd.vd_next == 0)
+			break;
+		offset += vd.vd_next;
+	}
+	return NULL;
+}
+
+static bool
+elf_exports_init(struct elf_file *ef, struct elf_exports *ex)
+{
+	const GElf_Shdr *dynsym_shdr, *verdef_shdr = NULL;
+	Elf_Data *dynsym, *versym, *verdef;
+	GElf_Word strndx, verdef_strndx = 0;
+	struct digest digest;
+	GElf_Sym sym;
+	size_t nsyms;
+	unsigned int i;
+
+	memset(ex, 0, sizeof(*ex));
+	if (ef->ehdr.e_type != ET_DYN
+	 || !(dynsym = elf_section_data(ef, SHT_DYNSYM, &dynsym_shdr))
+	 || dynsym_shdr->sh_entsize == 0)
+		return false;
+
+	strndx = dynsym_shdr->sh_link;
+	nsyms = dynsym_shdr->sh_size / dynsym_shdr->sh_entsize;
+
+	versym = elf_section_data(ef, SHT_GNU_versym, NULL);
+	if ((verdef = elf_section_data(ef, SHT_GNU_verdef, &verdef_shdr)) != NULL)
+		verdef_strndx = verdef_shdr->sh_link;
+
+	ex->names = calloc(nsyms? nsyms : 1, sizeof(ex->names[0]));
+
+	/* symbol 0 is the undefined symbol */
+	for (i = 1; i < nsyms; ++i) {
+		const char *name, *version = NULL;
+		GElf_Versym vs = 0;
+		int bind;
+
+		if (gelf_getsym(dynsym, i, &sym) != &sym)
+			break;
+
+		bind = GELF_ST_BIND(sym.st_info);
+		if (sym.st_shndx == SHN_UNDEF
+		 || (bind != STB_GLOBAL && bind != STB_WEAK && bind != STB_GNU_UNIQUE)
+		 || GELF_ST_TYPE(sym.st_info) == STT_SECTION
+		 || GELF_ST_TYPE(sym.st_info) == STT_FILE
+		 || (GELF_ST_VISIBILITY(sym.st_other) != STV_DEFAULT
+		  && GELF_ST_VISIBILITY(sym.st_other) != STV_PROTECTED))
+			continue;
+
+		if (!(name = elf_strptr(ef->elf, strndx, sym.st_name)))
+			continue;
+
+		/* index 1 is the unversioned global scope */
+		if (versym && gelf_getversym(versym, i, &vs) == &vs && (vs & VERSYM_VERSION) > 1)
+			version = elf_version_name(ef, verdef, verdef_strndx, vs & VERSYM_VERSION);
+
+		/* the linker defines an absolute symbol for each version node */
+		if (version && sym.st_shndx == SHN_ABS && !strcmp(name, version))
+			continue;
+
+		if (version == NULL) {
+			ex->names[ex->count++] = strdup(name);
+		} else {
+			char *versioned = malloc(strlen(name) + strlen(version) + 3);
+
+			sprintf(versioned, "%s%s%s", name, (vs & VERSYM_HIDDEN)? "@" : "@@", version);
+			ex->names[ex->count++] = versioned;
+		}
+	}
+
+	qsort(ex->names, ex->count, sizeof(ex->names[0]), elf_exports_compare_name);
+
+	digest_init(&digest);
+	for (i = 0; i < ex->count; ++i)
+		digest_update(&digest, ex->names[i], strlen(ex->names[i]) + 1);
+	digest_final(&digest, ex->digest);
+	return true;
+}
+
+/*
+ * Compare the exported symbols of two shared objects. Returns a malloc'ed
+ * list of the symbols that were removed (prefixed with -) or added (with +),
+ * which is empty if the sets are identical. Returns NULL if either file is
+ * not a shared object with a dynamic symbol table.
+ */
+char *
+elf_compare_exports(int old_fd, int new_fd)
+{
+	struct elf_file old = { 0 }, new = { 0 };
+	struct elf_exports old_ex = { 0 }, new_ex = { 0 };
+	unsigned int i, j, reported = 0, omitted = 0;
+	char *result = NULL;
+	size_t len = 0;
+
+	if (!elf_file_init(&old, old_fd, -1) || !elf_file_init(&new, new_fd, -1)
+	 || !elf_exports_init(&old, &old_ex) || !elf_exports_init(&new, &new_ex))
+		goto out;
+
+	result = strdup("");
+	if (!memcmp(old_ex.digest, new_ex.digest, DIGEST_SIZE))
+		goto out;
+
+	for (i = j = 0; i < old_ex.count || j < new_ex.count; ) {
+		const char *prefix, *name;
+		int r;
+
+		if (i >= old_ex.count)
+			r = 1;
+		else if (j >= new_ex.count)
+			r = -1;
+		else
+			r = strcmp(old_ex.names[i], new_ex.names[j]);
+
+		if (r == 0) {
+			i++, j++;
+			continue;
+		}
+
+		if (r < 0)
+			prefix = "-", name = old_ex.names[i++];
+		else
+			prefix = "+", name = new_ex.names[j++];
+
+		if (reported++ < EXPORTS_MAX_REPORTED)
+			elf_diff_append(&result, &len, prefix, name);
+		else
+			omitted++;
+	}
+
+	if (omitted) {
+		char more[32];
+
+		snprintf(more, sizeof(more), "(%u more)", omitted);
+		elf_diff_append(&result, &len, "", more);
+	}
+
+out:
+	elf_exports_destroy(&old_ex);
+	elf_exports_destroy(&new_ex);
+	elf_file_destroy(&old);
+	elf_file_destroy(&new);
+	return result;
+}
+
+/*
+ * .gnu_debuglink contains a filename (which should never change), and a CRC
+ * of the debuginfo file (which usually does change).
+ */
+static bool
+elf_locate_debuglink_crc(int fd, const GElf_Shdr *shdr, struct ignore_set *set)
+{
+	unsigned char data[2048];
+	off_t align = shdr->sh_addralign? shdr->sh_addralign : 1;
+	size_t size = shdr->sh_size;
+	size_t k;
+
+	if (size > sizeof(data))
+		return false;
+
+	/* make sure alignment is a power of 2 */
+	if (align & (align - 1))
+		return false;
+
+	if (pread(fd, data, size, shdr->sh_offset) != (ssize_t) size)
+		return false;
+
+	/* find the end of the name */
+	for (k = 0; k < size && data[k] != 0; ++k)
+		;
+
+	k += 1;	/* consume NUL */
+	k = ((k + align - 1) & ~(align - 1));
+
+	if (k >= size || (size - k != 4 && size - k != 8))
+		return false;
+
+	return ignore_set_add(set, shdr->sh_offset + k, size - k);
+}
+
+/*
+ * Find the descriptor of the GNU build-id note, if this note section has one.
+ */
+static bool
+elf_locate_buildid_note(Elf_Scn *scn, const GElf_Shdr *shdr, struct ignore_set *set)
+{
+	Elf_Data *data;
+	size_t offset, name_offset, desc_offset;
+	GElf_Nhdr nhdr;
+
+	if ((data = elf_rawdata(scn, NULL)) == NULL)
+		return false;
+
+	offset = 0;
+	while (offset < data->d_size
+	    && (offset = gelf_getnote(data, offset, &nhdr, &name_offset, &desc_offset)) > 0) {
+		if (nhdr.n_type == NT_GNU_BUILD_ID
+		 && nhdr.n_namesz == sizeof(ELF_NOTE_GNU)
+		 && !memcmp((char *) data->d_buf + name_offset, ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU)))
+			return ignore_set_add(set, shdr->sh_offset + desc_offset, nhdr.n_descsz);
+	}
+
+	return false;
+}
+
+/*
+ * Collect the byte ranges of volatile data that should be ignored when
+ * comparing this file. classes is a mask of ELF_IGNORE_* flags. Returns
+ * false if the file is not an ELF file, or nothing was found.
+ */
+bool
+elf_identify_ignore_ranges(int fd, unsigned int classes, struct ignore_set *set)
+{
+	Elf *elf = NULL;
+	Elf_Scn *scn;
+	size_t shstrndx;
+
+	memset(set, 0, sizeof(*set));
+
+	if (!(elf = elf_begin(fd, ELF_C_READ, NULL)))
+		return false;
+
+	if (elf_kind(elf) != ELF_K_ELF
+	 || elf_getshdrstrndx(elf, &shstrndx) != 0)
+		goto out;
+
+	for (scn = NULL; (scn = elf_nextscn(elf, scn)) != NULL; ) {
+		GElf_Shdr shdr;
+		const char *name;
+
+		if (gelf_getshdr(scn, &shdr) != &shdr
+		 || (name = elf_strptr(elf, shstrndx, shdr.sh_name)) == NULL)
+			break;
+
+		if ((classes & ELF_IGNORE_DEBUGLINK_CRC)
+		 && !strcmp(name, ".gnu_debuglink"))
+			elf_locate_debuglink_crc(fd, &shdr, set);
+
+		if ((classes & ELF_IGNORE_BUILDID_NOTE)
+		 && shdr.sh_type == SHT_NOTE)
+			elf_locate_buildid_note(scn, &shdr, set);
+	}
+
+out:
+	elf_end(elf);
+	return set->count != 0;
+}
+
+/*
+ * Signed kernel modules end with a PKCS#7 signature, followed by a
+ * struct module_signature and a magic string:
+ *
+ *	module | signature | struct module_signature | "~Module signature appended~\n"
+ *
+ * If the file has this trailer, return the size of the module proper,
+ * else -1. This only reads the last few bytes of the file.
+ */
+#define MODULE_SIG_MAGIC	"~Module signature appended~\n"
+#define MODULE_SIG_MAGIC_LEN	(sizeof(MODULE_SIG_MAGIC) - 1)
+#define MODULE_SIG_INFO_LEN	12	/* sizeof(struct module_signature) */
+
+off_t
+elf_module_signature(int fd, off_t file_size)
+{
+	unsigned char tail[ELF_MODULE_TRAILER_LEN];
+
+	if (file_size < ELF_MODULE_TRAILER_LEN
+	 || pread(fd, tail, sizeof(tail), file_size - ELF_MODULE_TRAILER_LEN) != sizeof(tail))
+		return -1;
+
+	return elf_module_signature_trailer(tail, file_size);
+}
+
+/*
+ * Same as above, given the last ELF_MODULE_TRAILER_LEN bytes of a module
+ * of file_size bytes; used for compressed modules.
+ */
+off_t
+elf_module_signature_trailer(const unsigned char *tail, off_t file_size)
+{
+	uint32_t sig_len;
+
+	if (file_size < ELF_MODULE_TRAILER_LEN)
+		return -1;
+
+	if (memcmp(tail + MODULE_SIG_INFO_LEN, MODULE_SIG_MAGIC, MODULE_SIG_MAGIC_LEN))
+		return -1;
+
+	/* sig_len is the last member of struct module_signature, big endian */
+	sig_len = ((uint32_t) tail[8] << 24) | (tail[9] << 16) | (tail[10] << 8) | tail[11];
+	if (sig_len > file_size - ELF_MODULE_TRAILER_LEN)
+		return -1;
+
+	return file_size - ELF_MODULE_TRAILER_LEN - sig_len;
+}
@@ -0,0 +1,187 @@
+/*
+ * ftreecmp
+ *
+ * External sorting of directory entries.
+ *
+ * For directories with a huge number of entries, dstate_read() does not
+ * keep the whole listing in memory. Instead, it sorts chunks of entries and
+ * spills each of them to a temporary file as a sorted run. Afterwards, the
+ * entries are returned in order by merging all runs.
+ *
+ * Each record in a run consists of a 2 byte name length, the d_type byte,
+ * and the name itself (without the NUL byte).
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+
+#include "fstate.h"
+
+struct extsort_run {
+	FILE *			fp;
+	bool			eof;
+
+	/* the current record */
+	unsigned char		type;
+	char			name[NAME_MAX + 1];
+};
+
+struct extsort {
+	unsigned int		nruns;
+	struct extsort_run *	runs;
+
+	unsigned long		entries;
+};
+
+struct extsort *
+extsort_new(void)
+{
+	return calloc(1, sizeof(struct extsort));
+}
+
+void
+extsort_free(struct extsort *xs)
+{
+	unsigned int i;
+
+	for (i = 0; i < xs->nruns; ++i) {
+		if (xs->runs[i].fp)
+			fclose(xs->runs[i].fp);
+	}
+	free(xs->runs);
+	free(xs);
+}
+
+/*
+ * Write one sorted run.
+ */
+bool
+extsort_add_run(struct extsort *xs, unsigned int count,
+		const char *(*get_entry)(void *user, unsigned int i, unsigned char *type),
+		void *user)
+{
+	struct extsort_run *run;
+	unsigned int i;
+	FILE *fp;
+
+	if ((fp = tmpfile()) == NULL) {
+		fprintf(stderr, "Error: unable to create temporary file for sorting: %m\n");
+		return false;
+	}
+
+	for (i = 0; i < count; ++i) {
+		unsigned char type, hdr[3];
+		const char *name;
+		size_t len;
+
+		name = get_entry(user, i, &type);
+		len = strlen(name);
+
+		hdr[0] = len >> 8;
+		hdr[1] = len;
+		hdr[2] = type;
+		if (fwrite(hdr, sizeof(hdr), 1, fp) != 1
+		 || fwrite(name, len, 1, fp) != 1) {
+			fprintf(stderr, "Error: unable to write temporary file for sorting: %m\n");
+			fclose(fp);
+			return false;
+		}
+	}
+
+	if (fflush(fp) != 0) {
+		fprintf(stderr, "Error: unable to write temporary file for sorting: %m\n");
+		fclose(fp);
+		return false;
+	}
+
+	xs->runs = reallocarray(xs->runs, xs->nruns + 1, sizeof(xs->runs[0]));
+	run = &xs->runs[xs->nruns++];
+	memset(run, 0, sizeof(*run));
+	run->fp = fp;
+
+	xs->entries += count;
+	return true;
+}
+
+static bool
+extsort_run_advance(struct extsort_run *run)
+{
+	unsigned char hdr[3];
+	size_t n, len;
+
+	if ((n = fread(hdr, 1, sizeof(hdr), run->fp)) == 0 && !ferror(run->fp)) {
+		run->eof = true;
+		return true;
+	}
+
+	len = (hdr[0] << 8) | hdr[1];
+	if (n != sizeof(hdr) || len > NAME_MAX
+	 || (len && fread(run->name, len, 1, run->fp) != 1)) {
+		if (ferror(run->fp))
+			fprintf(stderr, "Error: unable to read temporary file while sorting directory: %m\n");
+		else
+			fprintf(stderr, "Error: corrupt temporary file while sorting directory\n");
+		run->eof = true;
+		return false;
+	}
+
+	run->name[len] = '\0';
+	run->type = hdr[2];
+	return true;
+}
+
+/*
+ * Done writing runs; prepare for merging.
+ */
+bool
+extsort_finish(struct extsort *xs)
+{
+	unsigned int i;
+
+	for (i = 0; i < xs->nruns; ++i) {
+		struct extsort_run *run = &xs->runs[i];
+
+		rewind(run->fp);
+		if (!extsort_run_advance(run))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Copy the next entry in sort order to name, which must have room for
+ * NAME_MAX + 1 bytes. The number of runs is small, so a linear scan for
+ * the smallest head is good enough.
+ * Returns 1 for an entry, 0 once all runs are exhausted, and -1 if a run
+ * could not be read.
+ */
+int
+extsort_next(struct extsort *xs, char *name, unsigned char *type)
+{
+	struct extsort_run *best = NULL;
+	unsigned int i;
+
+	for (i = 0; i < xs->nruns; ++i) {
+		struct extsort_run *run = &xs->runs[i];
+
+		if (run->eof)
+			continue;
+		if (best == NULL || strcmp(run->name, best->name) < 0)
+			best = run;
+	}
+
+	if (best == NULL)
+		return 0;
+
+	strcpy(name, best->name);
+	*type = best->type;
+
+	if (!extsort_run_advance(best))
+		return -1;
+	return 1;
+}
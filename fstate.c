@@ -7,7 +7,13 @@
  * Written by okir@suse.com
  */
 
+#define _GNU_SOURCE	/* for statx */
+
 #include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -29,14 +35,21 @@ __drop_string(char **vp)
 	*vp = NULL;
 }
 
-struct fstate *
-fstate_new(const char *name, int type)
+/*
+ * Create a handle for an entry of a directory listing
+ */
+static struct fstate *
+fstate_new(struct dstate *ds, unsigned int index)
 {
 	struct fstate *fs;
 
-	fs = calloc(1, sizeof(*fs) + 1);
-	fs->name = strdup(name);
-	fs->type = type;
+	fs = calloc(1, sizeof(*fs));
+	fs->parent = ds;
+	fs->index = index;
+	fs->name = dstate_entry_name(ds, index);
+	fs->type = ds->type[index];
+	if (ds->inode[index].mode)
+		fs->inode = &ds->inode[index];
 
 	return fs;
 }
@@ -44,17 +57,40 @@ fstate_new(const char *name, int type)
 void
 fstate_free(struct fstate *fs)
 {
-	__drop_string(&fs->name);
+	/* Only detached entries own their name */
+	if (fs->parent == NULL)
+		free((char *) fs->name);
+
 	__drop_string(&fs->path);
 	__drop_string(&fs->link_dest);
 
-	if (fs->stb)
-		free(fs->stb);
-
 	memset(fs, 0, sizeof(*fs));
 	free(fs);
 }
 
+/*
+ * Create a copy of a directory entry that is no longer tied to its
+ * parent dstate, and hence survives dstate_free()
+ */
+struct fstate *
+fstate_clone(struct fstate *fs)
+{
+	struct fstate *clone;
+
+	clone = calloc(1, sizeof(*clone));
+	clone->name = strdup(fs->name);
+	clone->type = fs->type;
+	clone->path = strdup(fstate_path(fs));
+	if (fs->inode) {
+		clone->detached_inode = *fs->inode;
+		clone->inode = &clone->detached_inode;
+	}
+	if (fs->link_dest)
+		clone->link_dest = strdup(fs->link_dest);
+
+	return clone;
+}
+
 const char *
 fstate_path(struct fstate *fs)
 {
@@ -67,13 +103,6 @@ fstate_path(struct fstate *fs)
 	return fs->path;
 }
 
-static int
-fstate_compare_name(const void *a, const void *b)
-{
-	return strcmp((*(const struct fstate **) a)->name,
-			(*(const struct fstate **) b)->name);
-}
-
 struct dstate *
 fstate_descend(struct fstate *fs)
 {
@@ -89,6 +118,9 @@ fstate_descend(struct fstate *fs)
 	return ds;
 }
 
+/*
+ * Open a file for reading its contents
+ */
 int
 fstate_open(struct fstate *fs)
 {
@@ -102,11 +134,57 @@ fstate_open(struct fstate *fs)
 	return fd;
 }
 
-struct stat *
+/*
+ * Find the physical location of the start of a file on its block device.
+ * FIEMAP works on most local file systems; isofs only supports the older
+ * FIBMAP, which requires CAP_SYS_RAWIO. Without it, we use the inode
+ * number instead; on isofs, it is derived from the position of the
+ * directory record, and mkisofs writes file data in that same order.
+ */
+bool
+fstate_physical_location(struct fstate *fs, uint64_t *location)
+{
+	union {
+		struct fiemap	fm;
+		char		buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	} req;
+	bool found = false;
+	int fd, block = 0, blksize;
+	struct stat stb;
+
+	*location = 0;
+	if ((fd = open(fstate_path(fs), O_RDONLY)) < 0)
+		return false;
+
+	memset(&req, 0, sizeof(req));
+	req.fm.fm_length = FIEMAP_MAX_OFFSET;
+	req.fm.fm_extent_count = 1;
+
+	if (ioctl(fd, FS_IOC_FIEMAP, &req.fm) == 0) {
+		if (req.fm.fm_mapped_extents) {
+			*location = req.fm.fm_extents[0].fe_physical;
+			found = true;
+		}
+	} else if (ioctl(fd, FIBMAP, &block) == 0) {
+		if (block != 0 && ioctl(fd, FIGETBSZ, &blksize) == 0) {
+			*location = (uint64_t) block * blksize;
+			found = true;
+		}
+	} else if (fstat(fd, &stb) == 0 && stb.st_size != 0) {
+		*location = stb.st_ino;
+		found = true;
+	}
+
+	close(fd);
+	return found;
+}
+
+struct finode *
 fstate_stat(struct fstate *fs)
 {
-	if (fs->stb == NULL) {
+	if (fs->inode == NULL) {
 		const char *path = fstate_path(fs);
+		struct finode *inode;
 		struct stat stb;
 
 		if (lstat(path, &stb) < 0) {
@@ -114,10 +192,173 @@ fstate_stat(struct fstate *fs)
 			return NULL;
 		}
 
-		fs->stb = malloc(sizeof(stb));
-		memcpy(fs->stb, &stb, sizeof(stb));
+		if (fs->parent)
+			inode = &fs->parent->inode[fs->index];
+		else
+			inode = &fs->detached_inode;
+
+		inode->mode = stb.st_mode;
+		inode->uid = stb.st_uid;
+		inode->gid = stb.st_gid;
+		inode->size = stb.st_size;
+		inode->rdev = stb.st_rdev;
+		fs->inode = inode;
+	}
+	return fs->inode;
+}
+
+bool
+fstate_digest(struct fstate *fs, unsigned char *md)
+{
+	return digest_file(fstate_path(fs), md);
+}
+
+/*
+ * Bulk walk of a directory subtree, for reporting it in summary form.
+ * We read directories with getdents64 into a large buffer, and stat the
+ * entries of each buffer relative to the directory fd, asking statx for
+ * nothing but type and size. Subdirectories are put on an explicit stack
+ * of paths and visited once the directory is done, so that only one
+ * directory is open at a time, however deep the tree.
+ */
+struct fsummary_walk {
+	struct fsummary *	sum;
+	fsummary_fn_t *		fn;
+	void *			user;
+	char			path[PATH_MAX];
+
+	/* directories still to visit; the last one is next */
+	unsigned int		npending;
+	char **			pending;
+};
+
+struct linux_dirent64 {
+	uint64_t		d_ino;
+	int64_t			d_off;
+	unsigned short		d_reclen;
+	unsigned char		d_type;
+	char			d_name[];
+};
+
+static bool
+__fstate_summarize_dir(struct fsummary_walk *walk, int dirfd, size_t pathlen)
+{
+	char *buffer, **subdirs = NULL;
+	unsigned int i, nsubdirs = 0;
+	bool status = true;
+	long n;
+
+	buffer = malloc(65536);
+	while ((n = syscall(SYS_getdents64, dirfd, buffer, 65536)) > 0) {
+		long pos;
+
+		for (pos = 0; pos < n; ) {
+			struct linux_dirent64 *de = (struct linux_dirent64 *) (buffer + pos);
+			unsigned int type = de->d_type;
+			struct statx stx;
+
+			pos += de->d_reclen;
+
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+
+			if (type == DT_REG || type == DT_UNKNOWN) {
+				if (statx(dirfd, de->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+						STATX_TYPE | STATX_SIZE, &stx) < 0) {
+					fprintf(stderr, "Error: unable to stat %s/%s: %m\n", walk->path, de->d_name);
+					status = false;
+					continue;
+				}
+				type = IFTODT(stx.stx_mode);
+			}
+
+			walk->sum->entries++;
+			switch (type) {
+			case DT_REG:
+				walk->sum->files++;
+				walk->sum->bytes += stx.stx_size;
+				if (walk->fn) {
+					snprintf(walk->path + pathlen, sizeof(walk->path) - pathlen, "/%s", de->d_name);
+					if (!walk->fn(walk->path, type, stx.stx_size, walk->user))
+						status = false;
+					walk->path[pathlen] = '\0';
+				}
+				break;
+
+			case DT_DIR:
+				walk->sum->dirs++;
+				subdirs = reallocarray(subdirs, nsubdirs + 1, sizeof(subdirs[0]));
+				subdirs[nsubdirs++] = strdup(de->d_name);
+				break;
+
+			case DT_LNK:
+				walk->sum->symlinks++;
+				break;
+
+			default:
+				walk->sum->other++;
+			}
+		}
+	}
+
+	if (n < 0) {
+		fprintf(stderr, "Error: unable to read directory %s: %m\n", walk->path);
+		status = false;
+	}
+	free(buffer);
+
+	/* push in reverse, so that they are visited in directory order */
+	walk->pending = reallocarray(walk->pending, walk->npending + nsubdirs, sizeof(walk->pending[0]));
+	for (i = nsubdirs; i-- > 0; ) {
+		snprintf(walk->path + pathlen, sizeof(walk->path) - pathlen, "/%s", subdirs[i]);
+		walk->pending[walk->npending++] = strdup(walk->path);
+		walk->path[pathlen] = '\0';
+		free(subdirs[i]);
+	}
+	free(subdirs);
+
+	return status;
+}
+
+/*
+ * Count the entries below a directory. If fn is given, it is invoked for
+ * every regular file.
+ */
+bool
+fstate_summarize(struct fstate *fs, struct fsummary *sum, fsummary_fn_t *fn, void *user)
+{
+	struct fsummary_walk walk;
+	bool status = true;
+
+	memset(sum, 0, sizeof(*sum));
+	memset(&walk, 0, sizeof(walk));
+	walk.sum = sum;
+	walk.fn = fn;
+	walk.user = user;
+
+	walk.pending = malloc(sizeof(walk.pending[0]));
+	walk.pending[walk.npending++] = strdup(fstate_path(fs));
+
+	while (walk.npending) {
+		char *path = walk.pending[--(walk.npending)];
+		int fd;
+
+		snprintf(walk.path, sizeof(walk.path), "%s", path);
+		free(path);
+
+		if ((fd = open(walk.path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) < 0) {
+			fprintf(stderr, "Error: unable to open directory %s: %m\n", walk.path);
+			status = false;
+			continue;
+		}
+
+		if (!__fstate_summarize_dir(&walk, fd, strlen(walk.path)))
+			status = false;
+		close(fd);
 	}
-	return fs->stb;
+	free(walk.pending);
+
+	return status;
 }
 
 bool
@@ -132,83 +373,433 @@ fstate_readlink(struct fstate *fs)
 	if (fs->link_dest == NULL) {
 		const char *path = fstate_path(fs);
 		char pathbuf[PATH_MAX];
+		ssize_t n;
 
-		if (readlink(path, pathbuf, sizeof(pathbuf)) < 0) {
+		if ((n = readlink(path, pathbuf, sizeof(pathbuf) - 1)) < 0) {
 			fprintf(stderr, "Error: readlink(%s) failed: %m\n", path);
 			return NULL;
 		}
+		pathbuf[n] = '\0';
 		fs->link_dest = strdup(pathbuf);
 	}
 
 	return fs->link_dest;
 }
 
+/* Total size of all directory listings in memory */
+static atomic_size_t	dstate_memory = 0;
+
+/* Directories with more entries than this are sorted on disk */
+static unsigned int	dstate_spill_threshold = 65536;
+
+#define DSTATE_WINDOW_SIZE	4096
+
 struct dstate *
 dstate_new(const char *path)
 {
 	struct dstate *ds;
 
-	ds = calloc(1, sizeof(*ds) + 1);
+	ds = calloc(1, sizeof(*ds));
 	ds->path = strdup(path);
+	atomic_init(&ds->refcount, 1);
 	return ds;
 }
 
+/*
+ * Keep the dstate and its listing alive while entries are being looked at
+ * by the pipeline. Each reference is dropped by dstate_free().
+ */
 void
-dstate_free(struct dstate *ds)
+dstate_hold(struct dstate *ds)
+{
+	atomic_fetch_add(&ds->refcount, 1);
+}
+
+/*
+ * Drop the listing, but keep the dstate itself
+ */
+static void
+dstate_release(struct dstate *ds)
 {
 	unsigned int i;
 
-	for (i = 0; i < ds->count; ++i)
-		fstate_free(ds->files[i]);
+	if (ds->files) {
+		for (i = 0; i < ds->count; ++i) {
+			if (ds->files[i])
+				fstate_free(ds->files[i]);
+		}
+		free(ds->files);
+		ds->files = NULL;
+	}
+
+	free(ds->names);
+	free(ds->name_off);
+	free(ds->name_pfx);
+	free(ds->type);
+	free(ds->inode);
+	ds->names = NULL;
+	ds->name_off = NULL;
+	ds->name_pfx = NULL;
+	ds->type = NULL;
+	ds->inode = NULL;
+
+	ds->count = 0;
+	ds->names_len = 0;
+
+	dstate_memory -= ds->mem_size;
+	ds->mem_size = 0;
+}
+
+void
+dstate_free(struct dstate *ds)
+{
+	if (atomic_fetch_sub(&ds->refcount, 1) > 1)
+		return;
+
+	dstate_release(ds);
+	if (ds->xsort)
+		extsort_free(ds->xsort);
+	free(ds->resume_name);
+	free(ds->path);
 
 	memset(ds, 0, sizeof(*ds));
 	free(ds);
 }
 
-static struct fstate *
-dstate_add_entry(struct dstate *ds, const char *name, int type)
+/*
+ * The first 8 bytes of a name, as a big-endian integer. Comparing two
+ * prefixes gives the same result as strcmp on the first 8 bytes.
+ */
+static inline uint64_t
+name_prefix(const char *name)
 {
-	struct fstate *fs;
+	uint64_t pfx = 0;
+	unsigned int i;
 
-	fs = fstate_new(name, type);
-	if ((ds->count % 16) == 0)
-		ds->files = reallocarray(ds->files, ds->count + 16, sizeof(ds->files[0]));
-	ds->files[ds->count++] = fs;
-	fs->parent = ds;
+	for (i = 0; i < 8 && name[i]; ++i)
+		pfx |= (uint64_t) (unsigned char) name[i] << (56 - 8 * i);
+	return pfx;
+}
 
-	return fs;
+/*
+ * Compare two names, given their prefixes. If the prefixes are equal and
+ * the last byte of the prefix is NUL, the names are shorter than 8 bytes
+ * and hence identical.
+ */
+static inline int
+name_compare(uint64_t pfx_a, const char *name_a, uint64_t pfx_b, const char *name_b)
+{
+	if (pfx_a != pfx_b)
+		return (pfx_a < pfx_b)? -1 : 1;
+	if ((pfx_a & 0xff) == 0)
+		return 0;
+	return strcmp(name_a + 8, name_b + 8);
+}
+
+/* Used for sorting the listing */
+struct dstate_sort_entry {
+	uint64_t	pfx;
+	uint32_t	off;
+	unsigned char	type;
+};
+
+static int
+dstate_sort_compare(const void *a, const void *b, void *names)
+{
+	const struct dstate_sort_entry *ea = a, *eb = b;
+
+	return name_compare(ea->pfx, (char *) names + ea->off, eb->pfx, (char *) names + eb->off);
+}
+
+/*
+ * Install a sorted listing. The dstate takes ownership of the names blob.
+ */
+static void
+dstate_set_listing(struct dstate *ds, struct dstate_sort_entry *entries, unsigned int count,
+		char *names, size_t names_len, size_t names_size)
+{
+	unsigned int i;
+
+	ds->count = count;
+	ds->names = names;
+	ds->names_len = names_len;
+
+	ds->name_off = calloc(count + 1, sizeof(ds->name_off[0]));
+	ds->name_pfx = calloc(count + 1, sizeof(ds->name_pfx[0]));
+	ds->type = calloc(count + 1, sizeof(ds->type[0]));
+	ds->inode = calloc(count + 1, sizeof(ds->inode[0]));
+
+	for (i = 0; i < count; ++i) {
+		ds->name_off[i] = entries[i].off;
+		ds->name_pfx[i] = entries[i].pfx;
+		ds->type[i] = entries[i].type;
+	}
+
+	ds->mem_size = names_size + count * (sizeof(ds->name_off[0]) + sizeof(ds->name_pfx[0])
+				+ sizeof(ds->type[0]) + sizeof(ds->inode[0]) + sizeof(ds->files[0]));
+	dstate_memory += ds->mem_size;
+}
+
+/*
+ * Helper for collecting directory entries before sorting them
+ */
+struct dstate_collect {
+	struct dstate_sort_entry *entries;
+	unsigned int		count;
+	char *			names;
+	size_t			names_len;
+	size_t			names_size;
+};
+
+static void
+dstate_collect_add(struct dstate_collect *c, const char *name, unsigned char type)
+{
+	size_t len = strlen(name) + 1;
+
+	while (c->names_len + len > c->names_size) {
+		c->names_size = c->names_size? 2 * c->names_size : 4096;
+		c->names = realloc(c->names, c->names_size);
+	}
+
+	if ((c->count % 64) == 0)
+		c->entries = reallocarray(c->entries, c->count + 64, sizeof(c->entries[0]));
+
+	c->entries[c->count].pfx = name_prefix(name);
+	c->entries[c->count].off = c->names_len;
+	c->entries[c->count].type = type;
+	c->count++;
+
+	memcpy(c->names + c->names_len, name, len);
+	c->names_len += len;
+}
+
+static const char *
+dstate_collect_get(void *user, unsigned int i, unsigned char *type)
+{
+	struct dstate_collect *c = user;
+
+	*type = c->entries[i].type;
+	return c->names + c->entries[i].off;
+}
+
+/*
+ * Sort the collected entries, and write them to a new run
+ */
+static bool
+dstate_spill(struct dstate *ds, struct dstate_collect *c)
+{
+	qsort_r(c->entries, c->count, sizeof(c->entries[0]), dstate_sort_compare, c->names);
+
+	if (ds->xsort == NULL)
+		ds->xsort = extsort_new();
+	if (!extsort_add_run(ds->xsort, c->count, dstate_collect_get, c))
+		return false;
+
+	c->count = 0;
+	c->names_len = 0;
+	return true;
+}
+
+/*
+ * For externally sorted directories, we only keep a window of entries
+ * in memory. Replace it with the next batch of entries from the merge.
+ */
+static bool
+dstate_fill_window(struct dstate *ds)
+{
+	struct dstate_collect c;
+	char name[NAME_MAX + 1];
+	unsigned char type;
+	int rv = 1;
+
+	dstate_release(ds);
+	ds->cursor = 0;
+
+	memset(&c, 0, sizeof(c));
+	while (c.count < DSTATE_WINDOW_SIZE && (rv = extsort_next(ds->xsort, name, &type)) > 0)
+		dstate_collect_add(&c, name, type);
+
+	if (rv < 0) {
+		/* don't pretend the directory ends here */
+		fprintf(stderr, "Error: failed to read the sorted listing of %s\n", ds->path);
+		free(c.entries);
+		free(c.names);
+		ds->xsort_done = true;
+		ds->failed = true;
+		return false;
+	}
+
+	/* entries come out of the merge in sorted order already */
+	dstate_set_listing(ds, c.entries, c.count, c.names, c.names_len, c.names_size);
+	free(c.entries);
+
+	if (c.count == 0)
+		ds->xsort_done = true;
+	return true;
+}
+
+void
+dstate_set_spill_threshold(unsigned int count)
+{
+	dstate_spill_threshold = count;
 }
 
+/*
+ * Read and sort the listing of a directory. If the directory has more than
+ * dstate_spill_threshold entries, we sort it on disk in chunks of that
+ * size, and consume the merged result through a small window.
+ */
 bool
 dstate_read(struct dstate *ds)
 {
+	struct dstate_collect c;
 	DIR *dir;
 	struct dirent *de;
+	bool status = true;
 
 	if (!(dir = opendir(ds->path))) {
 		fprintf(stderr, "Error: unable to open directory %s: %m\n", ds->path);
 		return false;
 	}
 
+	memset(&c, 0, sizeof(c));
 	while ((de = readdir(dir)) != NULL) {
 		if (!strcmp(de->d_name, ".")
 		 || !strcmp(de->d_name, ".."))
 			continue;
 
-		dstate_add_entry(ds, de->d_name, de->d_type);
+		dstate_collect_add(&c, de->d_name, de->d_type);
+
+		if (dstate_spill_threshold && c.count >= dstate_spill_threshold
+		 && !dstate_spill(ds, &c)) {
+			status = false;
+			break;
+		}
 	}
 	closedir(dir);
 
-	qsort(ds->files, ds->count, sizeof(ds->files[0]), fstate_compare_name);
+	if (status && ds->xsort != NULL) {
+		if (c.count && !dstate_spill(ds, &c))
+			status = false;
+		free(c.entries);
+		free(c.names);
+
+		return status && extsort_finish(ds->xsort) && dstate_fill_window(ds);
+	}
+
+	if (!status) {
+		free(c.entries);
+		free(c.names);
+		return false;
+	}
+
+	qsort_r(c.entries, c.count, sizeof(c.entries[0]), dstate_sort_compare, c.names);
+	dstate_set_listing(ds, c.entries, c.count, c.names, c.names_len, c.names_size);
+	free(c.entries);
+
+	return true;
+}
+
+size_t
+dstate_memory_used(void)
+{
+	return dstate_memory;
+}
+
+/*
+ * Drop the listing of a directory we're not currently looking at, remembering
+ * where we were. dstate_restore() re-reads the listing and positions the
+ * cursor on the first entry not yet processed.
+ */
+void
+dstate_evict(struct dstate *ds)
+{
+	/* externally sorted directories only hold a small window anyway */
+	if (ds->evicted || ds->xsort)
+		return;
+
+	/* the pipeline is still looking at some of its entries */
+	if (atomic_load(&ds->refcount) > 1)
+		return;
+
+	if (ds->cursor < ds->count)
+		ds->resume_name = strdup(dstate_entry_name(ds, ds->cursor));
+	dstate_release(ds);
+	ds->evicted = true;
+}
+
+bool
+dstate_restore(struct dstate *ds)
+{
+	unsigned int lo, hi;
+	uint64_t pfx;
+
+	if (!ds->evicted)
+		return true;
+	ds->evicted = false;
+	ds->cursor = 0;
 
+	/* we had already processed all entries */
+	if (ds->resume_name == NULL)
+		return true;
+
+	if (!dstate_read(ds))
+		return false;
+
+	/* find the first entry >= resume_name */
+	pfx = name_prefix(ds->resume_name);
+	for (lo = 0, hi = ds->count; lo < hi; ) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (name_compare(ds->name_pfx[mid], dstate_entry_name(ds, mid), pfx, ds->resume_name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	ds->cursor = lo;
+
+	free(ds->resume_name);
+	ds->resume_name = NULL;
 	return true;
 }
 
+/*
+ * Return the entry at the cursor. NULL means we're at the end of the
+ * listing, or that reading it failed, in which case ds->failed is set.
+ */
 struct fstate *
 dstate_current_entry(struct dstate *ds)
 {
-	if (ds->cursor >= ds->count)
-		return NULL;
-	return ds->files[ds->cursor];
+	unsigned int i = ds->cursor;
+
+	if (i >= ds->count) {
+		if (ds->xsort == NULL || ds->xsort_done || !dstate_fill_window(ds))
+			return NULL;
+		if ((i = ds->cursor) >= ds->count)
+			return NULL;
+	}
+
+	if (ds->files == NULL)
+		ds->files = calloc(ds->count, sizeof(ds->files[0]));
+	if (ds->files[i] == NULL)
+		ds->files[i] = fstate_new(ds, i);
+	return ds->files[i];
+}
+
+void
+dstate_advance(struct dstate *ds)
+{
+	ds->cursor += 1;
 }
 
+/*
+ * Compare the names of the current entries of two directories
+ */
+int
+dstate_compare_current(const struct dstate *a, const struct dstate *b)
+{
+	unsigned int i = a->cursor, j = b->cursor;
+
+	return name_compare(a->name_pfx[i], dstate_entry_name(a, i),
+			b->name_pfx[j], dstate_entry_name(b, j));
+}
@@ -11,12 +11,28 @@
 #define FSTATE_H
 
 #include <sys/stat.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * The inode attributes we look at. This is a small subset of struct stat,
+ * so that the listing of a large directory stays compact.
+ */
+struct finode {
+	uint32_t	mode;		/* 0 means "not yet populated" */
+	uint32_t	uid;
+	uint32_t	gid;
+	uint32_t	pad;
+	uint64_t	size;
+	uint64_t	rdev;
+};
 
 /* Represents any sort of directory entry */
 struct fstate {
-	/* These are initialized from readdir info inside dstate_read() */
+	/* These are initialized from the dstate listing */
 	struct dstate	*parent;
-	char *		name;
+	unsigned int	index;
+	const char *	name;
 	int		type;
 
 	/* the remainder is populated on-demand */
@@ -24,34 +40,120 @@ struct fstate {
 	/* fully qualified path */
 	char *		path;
 
-	/* the stat buffer */
-	struct stat *	stb;
+	/* inode attributes; points into the parent's listing, or to
+	 * detached_inode for entries that were cloned */
+	struct finode *	inode;
+	struct finode	detached_inode;
 
 	/* symlink destination */
 	char *		link_dest;
 };
 
-/* Represents a directory that we want to descend into */
+/*
+ * Represents a directory that we want to descend into.
+ *
+ * The listing is kept as a structure of arrays, sorted by name. All names
+ * are packed into one blob, and for each entry we keep the first 8 bytes
+ * of its name as a big-endian integer, so that most comparisons in the
+ * merge loop of compare_directories() never touch the names themselves.
+ * struct fstate handles are created only for entries that are looked at.
+ */
 struct dstate {
 	char *		path;
-	DIR *		f;
+
+	/* held by the walk, and by pipeline jobs for its entries */
+	atomic_uint	refcount;
 
 	unsigned int	cursor;
 
 	unsigned int	count;
+	char *		names;
+	size_t		names_len;
+	uint32_t *	name_off;
+	uint64_t *	name_pfx;
+	unsigned char *	type;
+	struct finode *	inode;
+
 	struct fstate **files;
+
+	/* memory used by the listing, and state for evicting it */
+	size_t		mem_size;
+	bool		evicted;
+	char *		resume_name;
+
+	/* for huge directories: the listing is sorted on disk, and the
+	 * arrays above hold a window of the merged result */
+	struct extsort *xsort;
+	bool		xsort_done;
+
+	/* reading the rest of the listing failed */
+	bool		failed;
 };
 
 extern struct dstate *		dstate_new(const char *path);
+extern void			dstate_hold(struct dstate *ds);
 extern void			dstate_free(struct dstate *ds);
 extern bool			dstate_read(struct dstate *ds);
 extern struct fstate *		dstate_current_entry(struct dstate *ds);
+extern void			dstate_advance(struct dstate *ds);
+extern void			dstate_set_spill_threshold(unsigned int count);
+extern int			dstate_compare_current(const struct dstate *a, const struct dstate *b);
+extern void			dstate_evict(struct dstate *ds);
+extern bool			dstate_restore(struct dstate *ds);
+extern size_t			dstate_memory_used(void);
+
+static inline const char *
+dstate_entry_name(const struct dstate *ds, unsigned int i)
+{
+	return ds->names + ds->name_off[i];
+}
 
 extern const char *		fstate_path(struct fstate *fs);
 extern struct dstate *		fstate_descend(struct fstate *fs);
 extern int			fstate_open(struct fstate *fs);
-extern struct stat *		fstate_stat(struct fstate *fs);
+extern bool			fstate_physical_location(struct fstate *fs, uint64_t *location);
+extern struct finode *		fstate_stat(struct fstate *fs);
 extern const char *		fstate_readlink(struct fstate *fs);
+extern bool			fstate_digest(struct fstate *fs, unsigned char *md);
+
+/* External sorting of huge directories */
+struct extsort;
+
+extern struct extsort *		extsort_new(void);
+extern void			extsort_free(struct extsort *xs);
+extern bool			extsort_add_run(struct extsort *xs, unsigned int count,
+					const char *(*get_entry)(void *user, unsigned int i, unsigned char *type),
+					void *user);
+extern bool			extsort_finish(struct extsort *xs);
+extern int			extsort_next(struct extsort *xs, char *name, unsigned char *type);
+
+/* Iterative traversal of two trees */
+struct walk;
+
+extern struct walk *		walk_new(size_t mem_budget);
+extern void			walk_free(struct walk *walk);
+extern void			walk_push(struct walk *walk, struct dstate *old, struct dstate *new, int how);
+extern bool			walk_descend(struct walk *walk, struct fstate *old, struct fstate *new);
+extern bool			walk_next(struct walk *walk, struct fstate **old, struct fstate **new, int *how);
+extern bool			walk_one_sided(const struct walk *walk);
+extern bool			walk_failed(const struct walk *walk);
+
+/* Summary of a directory subtree */
+struct fsummary {
+	unsigned long		entries;
+	unsigned long		files;
+	unsigned long		dirs;
+	unsigned long		symlinks;
+	unsigned long		other;
+	unsigned long long	bytes;
+};
+
+typedef bool			fsummary_fn_t(const char *path, int type, off_t size, void *user);
+
+extern bool			fstate_summarize(struct fstate *fs, struct fsummary *sum,
+					fsummary_fn_t *fn, void *user);
+extern struct fstate *		fstate_clone(struct fstate *fs);
+extern void			fstate_free(struct fstate *fs);
 
 struct report;
 
@@ -61,9 +163,279 @@ extern void			report_free(struct report *);
 #define FSTATE_CHANGED_CRIT	0x0001	/* file type, owner, set*id bits, sticky bits ... */
 #define FSTATE_CHANGED_MODE	0x0002	/* file modes */
 #define FSTATE_CHANGED_DATA	0x0004	/* file content, incl link tgt */
+#define FSTATE_CHANGED_CONTAINER 0x0008	/* compressed data or archive differs, contents are the same */
 #define FSTATE_CHANGED_ADDED	0x0010
 #define FSTATE_CHANGED_REMOVED	0x0020
+#define FSTATE_CHANGED_MOVED	0x0040
+#define FSTATE_CHANGED_SIGNATURE 0x0080	/* kernel module signature differs, module is the same */
 
 extern bool			report_changed_file(struct report *report, int how, struct fstate *fs);
+extern bool			report_moved_file(struct report *report, struct fstate *old, struct fstate *new);
+extern void			report_detail(struct report *report, const char *fmt, ...);
+extern void			report_diff(struct report *report, const char *diff);
+extern bool			report_changed_tree(struct report *report, int how, struct fstate *fs,
+					const struct fsummary *sum);
+
+typedef bool			report_held_fn_t(struct report *report, void *entry, void *user);
+
+extern bool			report_hold(struct report *report, void *entry);
+extern bool			report_release(struct report *report, report_held_fn_t *fn, void *user);
+
+#define DIGEST_SIZE		32
+
+/* SHA-256 */
+struct digest {
+	uint32_t	state[8];
+	uint64_t	count;
+	unsigned char	block[64];
+};
+
+extern void			digest_init(struct digest *d);
+extern void			digest_update(struct digest *d, const void *data, size_t len);
+extern void			digest_final(struct digest *d, unsigned char *md);
+extern bool			digest_file(const char *path, unsigned char *md);
+
+/* Pairing of added and removed entries that were merely moved */
+struct movedet;
+struct move_entry;
+
+typedef bool			movedet_report_fn_t(struct report *report, int how, struct fstate *fs,
+					struct move_entry *e, bool *descend);
+
+extern struct movedet *		movedet_new(void);
+extern void			movedet_free(struct movedet *md);
+extern struct move_entry *	movedet_add(struct movedet *md, int how, struct fstate *fs);
+extern void			movedet_pair(struct movedet *md);
+extern bool			movedet_report(struct move_entry *e, struct report *report,
+					movedet_report_fn_t *report_fn);
+extern bool			move_entry_summarize(struct move_entry *e, struct fsummary *sum,
+					fsummary_fn_t *fn, void *user);
+
+/* Comparison of file contents */
+struct ignore_range {
+	off_t		offset;
+	size_t		size;
+};
+
+/* Sorted set of non-overlapping ranges to ignore */
+#define IGNORE_SET_MAX		16
+
+struct ignore_set {
+	unsigned int	count;
+	struct ignore_range ranges[IGNORE_SET_MAX];
+};
+
+struct fregion {
+	const char *	name;
+	off_t		offset;
+	off_t		size;
+};
+
+#define FCOMPARE_MAX_PROBES	16
+
+struct fcompare {
+	int		old_fd;
+	int		new_fd;
+	const char *	old_path;
+	const char *	new_path;
+	off_t		size;
+	const struct ignore_set *skip;
+	bool		sparse;			/* at least one file has holes */
+
+	/* regions to compare first */
+	unsigned int	nprobes;
+	struct fregion	probes[FCOMPARE_MAX_PROBES];
+
+	/* result */
+	off_t		diff_offset;
+	const char *	diff_region;		/* set if found by probing */
+};
+
+/* Size of the pool buffers (each holds two of these), and the largest
+ * read fcompare_pread() does into one half */
+#define FCOMPARE_BUFSIZE	65536
+#define FCOMPARE_IOSIZE		(FCOMPARE_BUFSIZE - 4096)
+
+extern void			fcompare_set_parallel(off_t threshold, unsigned int nthreads);
+extern void			fcompare_set_direct_io(bool enable);
+extern void			fcompare_set_drop_cache(bool enable);
+extern void			fcompare_set_strict_holes(bool enable);
+extern bool			fcompare_run(struct fcompare *fc);
+extern void			fcompare_drop_cache(struct fcompare *fc);
+extern void			fcompare_print_stats(FILE *fp);
+extern unsigned char *		fcompare_buffer_get(void);
+extern void			fcompare_buffer_put(unsigned char *buf);
+extern ssize_t			fcompare_pread(int fd, unsigned char *buf, size_t count, off_t offset,
+					unsigned char **data);
+extern bool			fcompare_digest(int fd, const char *path, unsigned char *md);
+extern bool			fcompare_regions_differ(int old_fd, off_t old_offset,
+					int new_fd, off_t new_offset, off_t size);
+extern bool			ignore_set_add(struct ignore_set *set, off_t offset, size_t size);
+extern bool			ignore_set_equal(const struct ignore_set *a, const struct ignore_set *b);
+
+/* Decompression of gzip, xz, zstd and bzip2 files */
+enum {
+	ZSTREAM_NONE = 0,
+	ZSTREAM_GZIP,
+	ZSTREAM_XZ,
+	ZSTREAM_ZSTD,
+	ZSTREAM_BZIP2,
+	ZSTREAM_ZLIB,				/* no magic; used for ELF sections */
+};
+
+struct zstream;
+
+extern int			zstream_format(int fd);
+extern const char *		zstream_format_name(int format);
+extern struct zstream *		zstream_open(int fd, int format, const char *path);
+extern struct zstream *		zstream_open_range(int fd, int format, const char *path,
+					off_t offset, off_t size);
+extern ssize_t			zstream_read(struct zstream *zs, void *buf, size_t len);
+extern void			zstream_close(struct zstream *zs);
+extern bool			fcompare_streams(struct zstream *old, struct zstream *new, off_t *diff_offset);
+extern bool			fcompare_module_streams(struct zstream *old, struct zstream *new, off_t *diff_offset,
+					off_t *old_body, off_t *new_body);
+
+/* Member-wise comparison of archives */
+enum {
+	ARCHIVE_NONE = 0,
+	ARCHIVE_ZIP,
+	ARCHIVE_AR,
+};
+
+extern int			archive_format(int fd);
+extern const char *		archive_format_name(int format);
+extern bool			archive_compare(int format, int old_fd, off_t old_size, const char *old_path,
+					int new_fd, off_t new_size, const char *new_path, char **differences);
+
+/* ELF and ar specific helpers */
+extern unsigned int		elf_probe_regions(int fd, off_t file_size, struct fregion *regions,
+					unsigned int max);
+extern char *			elf_compare_sections(int old_fd, int new_fd);
+/* struct module_signature plus the magic string */
+#define ELF_MODULE_TRAILER_LEN	(12 + 28)
+
+extern off_t			elf_module_signature(int fd, off_t file_size);
+extern off_t			elf_module_signature_trailer(const unsigned char *tail, off_t file_size);
+extern char *			elf_compare_members(int old_fd, off_t old_member, int new_fd, off_t new_member);
+extern char *			elf_compare_exports(int old_fd, int new_fd);
+extern bool			elf_identify_ignore_ranges(int fd, unsigned int classes, struct ignore_set *set);
+
+/* Classes of volatile ELF data, for elf_identify_ignore_ranges() */
+#define ELF_IGNORE_BUILDID_NOTE		0x0001
+#define ELF_IGNORE_DEBUGLINK_CRC	0x0002
+
+/* Python bytecode */
+extern bool			pyc_identify_ignore_ranges(int fd, const char *path, unsigned int classes,
+					struct ignore_set *set);
+
+#define PYC_IGNORE_TIMESTAMP		0x0004
+
+/* Unified diffs of text files */
+extern char *			textdiff_unified(const char *old, size_t old_size,
+					const char *new, size_t new_size, unsigned int max_lines);
+
+/* Staged, multi-threaded comparison of entry pairs */
+struct pjob_digest {
+	char *		path;
+	unsigned char	md[DIGEST_SIZE];
+};
+
+struct pjob {
+	unsigned long	seq;
+	bool		single;			/* entry exists on one side only */
+	bool		descend;		/* the walker descended into this pair */
+	bool		compare_content;	/* set by the metadata stage */
+	bool		failed;
+	int		how;
+	off_t		diff_offset;		/* content difference, or -1 */
+	const char *	diff_region;		/* ... found by probing this region */
+	char *		diff_sections;		/* ELF sections that differ */
+	char *		diff_exports;		/* exported symbols added or removed */
+	const char *	container;		/* compression or archive format */
+	char *		diff_entries;		/* archive entries that differ */
+	char *		diff_text;		/* unified diff of text files */
+	char *		cached_verdict;		/* verdict cache record backing the above */
+	uint64_t	old_location;		/* for layout order */
+	uint64_t	new_location;
+	struct fstate *	old;
+	struct fstate *	new;
+	struct move_entry *held;		/* held back until moves are paired */
+	struct fsummary	summary;		/* of a one-sided directory, with -s */
+	struct pjob_digest *digests;		/* of one-sided files, for the media index */
+	unsigned int	ndigests;
+	bool		partial;		/* ... some of which could not be read */
+};
+
+struct pipeline_ops {
+	bool		(*metadata)(struct pjob *job);
+	bool		(*content)(struct pjob *job);
+	bool		(*report)(struct report *report, struct pjob *job);
+};
+
+struct pipeline;
+
+extern struct pipeline *	pipeline_new(const struct pipeline_ops *ops, struct report *report,
+					unsigned int nworkers);
+extern void			pipeline_submit(struct pipeline *pipe, struct pjob *job);
+extern bool			pipeline_finish(struct pipeline *pipe);
+extern void			pipeline_print_stats(FILE *fp);
+extern void			pipeline_set_layout_order(bool enable);
+
+/* On-disk hash table */
+struct hashdb;
+
+typedef bool			hashdb_fn_t(const void *key, size_t keylen, const void *data, size_t datalen, void *user);
+
+extern struct hashdb *		hashdb_open(const char *path, bool writable);
+extern void			hashdb_close(struct hashdb *db);
+extern void			hashdb_set_sync(struct hashdb *db, bool enable);
+extern bool			hashdb_insert(struct hashdb *db, const void *key, size_t keylen,
+					const void *data, size_t datalen);
+extern bool			hashdb_lookup(struct hashdb *db, const void *key, size_t keylen,
+					hashdb_fn_t *fn, void *user);
+extern bool			hashdb_foreach(struct hashdb *db, hashdb_fn_t *fn,
+					bool (*bucket_done)(void *user), void *user);
+extern bool			hashdb_remove(struct hashdb *db, hashdb_fn_t *match, void *user);
+
+/* Media-wide index of added and removed files, for detecting moves between packages */
+struct mindex;
+
+extern struct mindex *		mindex_open(const char *path, const char *package,
+					const char *old_root, const char *new_root);
+extern void			mindex_close(struct mindex *idx);
+extern bool			mindex_add(struct mindex *idx, int how, const char *path,
+					const unsigned char *md);
+extern bool			mindex_report_moves(const char *path);
+
+/* Persistent cache of verdicts of normalized comparisons */
+struct vcache;
+
+extern struct vcache *		vcache_open(const char *path, uint32_t options);
+extern void			vcache_close(struct vcache *vc);
+extern bool			vcache_lookup(struct vcache *vc, const unsigned char *old_md,
+					const unsigned char *new_md, struct pjob *job);
+extern bool			vcache_store(struct vcache *vc, const unsigned char *old_md,
+					const unsigned char *new_md, const struct pjob *job);
+extern void			vcache_print_stats(FILE *fp);
+
+/* Comparison modes that change verdicts, in addition to the ignore classes */
+#define VCACHE_OPT_DECOMPRESS		0x00010000
+#define VCACHE_OPT_ELF_SECTIONS		0x00020000
+
+/* Store for the results of comparing a set of packages */
+struct results;
+
+typedef bool			results_fn_t(const char *package, const char *verdict,
+					const char *body, size_t len, void *user);
+
+extern struct results *		results_open(const char *path, bool writable);
+extern void			results_close(struct results *res);
+extern bool			results_add(struct results *res, const char *package, const char *verdict,
+					const void *body, size_t len);
+extern char *			results_lookup(struct results *res, const char *package,
+					char **body, size_t *len);
+extern bool			results_foreach(struct results *res, const char *verdict, bool with_body,
+					results_fn_t *fn, void *user);
 
 #endif /* FSTATE_H */
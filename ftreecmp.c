@@ -16,24 +16,119 @@
 #include <dirent.h>
 #include <limits.h>
 
-#include <elf.h>
-#include <gelf.h>
+#include <libelf.h>
 
 #include "fstate.h"
 
+/* Below this size, probing ELF files for likely differences does not pay off */
+#define PROBE_THRESHOLD		(256 << 10)
+
+/* Text files are diffed with -u if they are no larger than this */
+#define TEXTDIFF_MAX_SIZE	(1 << 20)
+#define TEXTDIFF_MAX_LINES	100
+/* A file is text if there is no NUL byte in its first block */
+#define TEXTDIFF_BLOCK_SIZE	4096
+
+/* Below this size, looking inside files is cheaper than digesting both
+ * of them for the verdict cache */
+#define VCACHE_MIN_SIZE		(64 << 10)
+
 static bool			opt_debug = false;
-static bool			opt_ignore_buildid = false;
+static unsigned int		opt_ignore = 0;
+static bool			opt_detect_moves = false;
+static bool			opt_summarize = false;
+static bool			opt_elf_sections = false;
+static bool			opt_decompress = false;
+static bool			opt_text_diff = false;
+static size_t			opt_memory_budget = 128 << 20;
+static unsigned int		opt_jobs = 4;
+static bool			opt_pipeline_stats = false;
+static off_t			opt_parallel_threshold = 64 << 20;
+
+static struct movedet *		moves = NULL;
+static struct mindex *		media_index = NULL;
+static struct vcache *		verdicts = NULL;
+
+static bool			compare_trees(struct report *report, struct walk *walk);
+static bool			stage_metadata(struct pjob *job);
+static bool			stage_content(struct pjob *job);
+static bool			stage_report(struct report *report, struct pjob *job);
+static bool			report_single(struct report *report, struct pjob *job, struct fstate *fs,
+					bool *descend);
+static bool			report_held_entry(struct report *report, void *entry, void *user);
+
+static const struct {
+	const char *	name;
+	unsigned int	classes;
+} ignore_classes[] = {
+	{ "elf-buildid",	ELF_IGNORE_BUILDID_NOTE | ELF_IGNORE_DEBUGLINK_CRC },
+	{ "elf-debuglink",	ELF_IGNORE_DEBUGLINK_CRC },
+	{ "pyc-timestamp",	PYC_IGNORE_TIMESTAMP },
+	{ NULL }
+};
+
+/*
+ * Parse a comma separated list of classes of volatile data to ignore.
+ */
+static bool
+parse_ignore_classes(const char *arg, unsigned int *classes)
+{
+	char *copy, *name, *saveptr = NULL;
+	bool ok = true;
+
+	copy = strdup(arg);
+	for (name = strtok_r(copy, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+		unsigned int i;
+
+		for (i = 0; ignore_classes[i].name; ++i) {
+			if (!strcmp(ignore_classes[i].name, name))
+				break;
+		}
+
+		if (ignore_classes[i].name == NULL) {
+			fprintf(stderr, "Error: unknown class \"%s\" for -i\n", name);
+			ok = false;
+			break;
+		}
+		*classes |= ignore_classes[i].classes;
+	}
 
-static bool			compare_directories(struct report *report, struct dstate *old, struct dstate *new);
-static bool			compare_files(struct report *report, struct fstate *old, struct fstate *new);
-static bool			report_recursively(struct report *report, int how, struct fstate *fs);
+	free(copy);
+	return ok;
+}
 
 static void
 usage(int exitval)
 {
 	fprintf(stderr,
-		"Usage: ftreecmp [-dh] old_dir new_dir\n"
+		"Usage: ftreecmp [-dehHmsSuz] [-i class,...] [-j threads] [-L entries] [-M MiB] [-O ioopt] [-R MiB] [-V cache] [-x index] [-N package] old_dir new_dir\n"
+		"       ftreecmp -X index\n"
 		" -d    enable debugging output\n"
+		" -e    for ELF files that differ, report which sections differ, and for shared\n"
+		"       objects, which exported symbols were added or removed\n"
+		" -i    ignore volatile data when comparing files; a comma separated list of\n"
+		"       \"elf-buildid\" (build-id note and debuglink CRC), \"elf-debuglink\" (debuglink CRC only)\n"
+		"       and \"pyc-timestamp\" (source mtime and size in .pyc headers)\n"
+		" -H    treat a different layout of holes in sparse files as a content change\n"
+		" -j    number of threads comparing file contents (default 4)\n"
+		" -O    I/O options; \"direct\" reads file contents with O_DIRECT, bypassing the page cache,\n"
+		"       \"cache\" keeps file contents in the page cache after comparing them,\n"
+		"       \"layout\" compares files in the order of their location on disk\n"
+		" -R    compare files larger than this many MiB with several threads (default 64, 0 means never)\n"
+		" -L    sort directories with more entries than this on disk (default 65536, 0 means never)\n"
+		" -m    detect files and directories that were moved\n"
+		" -M    memory budget for directory listings, in MiB (default 128, 0 means unlimited)\n"
+		" -N    name of the package being compared\n"
+		" -s    summarize directories that were added or removed as a whole\n"
+		" -S    print pipeline and I/O statistics to stderr when done\n"
+		" -u    for text files that differ, print a unified diff (text files up to 1 MiB,\n"
+		"       at most 100 lines of diff)\n"
+		" -V    cache the verdicts of looking inside files that differ (see -e and -z) in this file,\n"
+		"       keyed by the digests of both files\n"
+		" -x    record added and removed files in a media-wide index\n"
+		" -X    report files that moved between packages, using the media-wide index\n"
+		" -z    compare gzip, xz, zstd and bzip2 compressed files by their uncompressed contents,\n"
+		"       and zip/jar and ar archives entry by entry\n"
 		" -h    display this help message output\n"
 	       );
 	exit(exitval);
@@ -43,25 +138,101 @@ int
 main(int argc, char **argv)
 {
 	char *opt_package_name = NULL;
+	char *opt_index_path = NULL;
+	char *opt_index_report = NULL;
+	char *opt_verdict_cache = NULL;
 	struct report *report;
 	struct dstate *old, *new;
+	struct walk *walk;
 	int exitval = 0;
 	int c;
 
-	while ((c = getopt(argc, argv, "dhi:N:")) != -1) {
+	while ((c = getopt(argc, argv, "dehHi:j:L:mM:N:O:R:sSuV:x:X:z")) != -1) {
 		switch (c) {
 		case 'd':
 			opt_debug = true;
 			break;
 
+		case 'e':
+			opt_elf_sections = true;
+			break;
+
+		case 'H':
+			fcompare_set_strict_holes(true);
+			break;
+
 		case 'i':
-			if (!strcmp(optarg, "elf-buildid"))
-				opt_ignore_buildid = true;
+			if (!parse_ignore_classes(optarg, &opt_ignore))
+				usage(1);
 			break;
+
+		case 'j':
+			opt_jobs = strtoul(optarg, NULL, 0);
+			if (opt_jobs == 0)
+				usage(1);
+			break;
+
+		case 'L':
+			dstate_set_spill_threshold(strtoul(optarg, NULL, 0));
+			break;
+
+		case 'm':
+			opt_detect_moves = true;
+			break;
+
+		case 'M':
+			opt_memory_budget = strtoul(optarg, NULL, 0) << 20;
+			break;
+
 		case 'N':
 			opt_package_name = optarg;
 			break;
 
+		case 'O':
+			if (!strcmp(optarg, "direct")) {
+				fcompare_set_direct_io(true);
+			} else if (!strcmp(optarg, "cache")) {
+				fcompare_set_drop_cache(false);
+			} else if (!strcmp(optarg, "layout")) {
+				pipeline_set_layout_order(true);
+			} else {
+				fprintf(stderr, "Error: unknown I/O option \"%s\"\n", optarg);
+				usage(1);
+			}
+			break;
+
+		case 'R':
+			opt_parallel_threshold = strtoul(optarg, NULL, 0) << 20;
+			break;
+
+		case 's':
+			opt_summarize = true;
+			break;
+
+		case 'S':
+			opt_pipeline_stats = true;
+			break;
+
+		case 'u':
+			opt_text_diff = true;
+			break;
+
+		case 'V':
+			opt_verdict_cache = optarg;
+			break;
+
+		case 'x':
+			opt_index_path = optarg;
+			break;
+
+		case 'X':
+			opt_index_report = optarg;
+			break;
+
+		case 'z':
+			opt_decompress = true;
+			break;
+
 		case 'h':
 			usage(0);
 		default:
@@ -69,379 +240,999 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (opt_index_report != NULL) {
+		if (argc != optind)
+			usage(1);
+		return mindex_report_moves(opt_index_report)? 0 : 1;
+	}
+
 	if (argc - optind != 2)
 		usage(1);
 
+	if (opt_index_path != NULL) {
+		media_index = mindex_open(opt_index_path, opt_package_name, argv[optind], argv[optind + 1]);
+		if (media_index == NULL)
+			return 1;
+	}
+
+	/* libelf needs to be initialized before the pipeline threads use it */
+	if (elf_version(EV_CURRENT) == EV_NONE) {
+		fprintf(stderr, "Error: unable to initialize libelf\n");
+		return 1;
+	}
+
+	if (opt_verdict_cache != NULL) {
+		uint32_t options = opt_ignore;
+
+		if (opt_decompress)
+			options |= VCACHE_OPT_DECOMPRESS;
+		if (opt_elf_sections)
+			options |= VCACHE_OPT_ELF_SECTIONS;
+		if (!(verdicts = vcache_open(opt_verdict_cache, options)))
+			return 1;
+	}
+
+	fcompare_set_parallel(opt_parallel_threshold, opt_jobs);
+
 	report = report_new(opt_package_name);
 
+	if (opt_detect_moves)
+		moves = movedet_new();
+
 	old = dstate_new(argv[optind++]);
 	new = dstate_new(argv[optind++]);
+	walk = walk_new(opt_memory_budget);
 
-	if (!dstate_read(old) || !dstate_read(new)
-	 || !compare_directories(report, old, new))
+	if (!dstate_read(old) || !dstate_read(new)) {
+		dstate_free(old);
+		dstate_free(new);
 		exitval = 1;
+	} else {
+		walk_push(walk, old, new, 0);
+		if (!compare_trees(report, walk))
+			exitval = 1;
+	}
+	walk_free(walk);
+
+	if (moves != NULL) {
+		movedet_pair(moves);
+		if (!report_release(report, report_held_entry, NULL))
+			exitval = 1;
+		movedet_free(moves);
+	}
 
-	dstate_free(old);
-	dstate_free(new);
 	report_free(report);
 
+	if (opt_pipeline_stats) {
+		pipeline_print_stats(stderr);
+		fcompare_print_stats(stderr);
+		if (verdicts != NULL)
+			vcache_print_stats(stderr);
+	}
+
+	if (verdicts != NULL)
+		vcache_close(verdicts);
+
+	if (media_index != NULL)
+		mindex_close(media_index);
+
 	return exitval;
 }
 
 /*
- * Recursively compare two directories
+ * Jobs use the walker's entries, and hold a reference on their directory
+ * until they are done. The path is set up front, so that the stages never
+ * modify the entry concurrently with the walker. Externally sorted
+ * directories replace their window of entries as the walk moves on, so
+ * their entries are copied instead.
  */
-static bool
-compare_directories(struct report *report, struct dstate *old, struct dstate *new)
+static struct fstate *
+pjob_entry(struct fstate *fs)
 {
-	struct fstate *old_fs = NULL, *new_fs = NULL;
-	bool status = true;
+	fstate_path(fs);
+	if (fs->parent == NULL || fs->parent->xsort)
+		return fstate_clone(fs);
 
-	if (opt_debug)
-		printf("D: Comparing %s vs %s\n", old->path, new->path);
+	dstate_hold(fs->parent);
+	return fs;
+}
 
-	old->cursor = 0;
-	new->cursor = 0;
+static void
+pjob_drop_entry(struct fstate *fs)
+{
+	if (fs->parent)
+		dstate_free(fs->parent);
+	else
+		fstate_free(fs);
+}
 
-	while (true) {
-		int rv;
+static struct pjob *
+pjob_new(struct fstate *old, struct fstate *new, int how)
+{
+	struct pjob *job;
+
+	job = calloc(1, sizeof(*job));
+	job->how = how;
+	job->single = (how != 0);
+	job->diff_offset = -1;
+	if (old)
+		job->old = pjob_entry(old);
+	if (new)
+		job->new = pjob_entry(new);
+	return job;
+}
 
-		if ((old_fs = dstate_current_entry(old)) == NULL) {
-			while ((new_fs = dstate_current_entry(new)) != NULL) {
-				report_recursively(report, FSTATE_CHANGED_ADDED, new_fs);
-				new->cursor += 1;
-			}
-			break;
-		}
+static void
+pjob_free_digests(struct pjob *job)
+{
+	unsigned int i;
 
-		if ((new_fs = dstate_current_entry(new)) == NULL) {
-			while ((old_fs = dstate_current_entry(old)) != NULL) {
-				report_recursively(report, FSTATE_CHANGED_REMOVED, old_fs);
-				old->cursor += 1;
-			}
-			break;
-		}
+	for (i = 0; i < job->ndigests; ++i)
+		free(job->digests[i].path);
+	free(job->digests);
+	job->digests = NULL;
+	job->ndigests = 0;
+}
+
+static void
+pjob_free(struct pjob *job)
+{
+	if (job->old)
+		pjob_drop_entry(job->old);
+	if (job->new)
+		pjob_drop_entry(job->new);
+	free(job->diff_sections);
+	free(job->diff_exports);
+	free(job->diff_entries);
+	free(job->diff_text);
+	free(job->cached_verdict);
+	pjob_free_digests(job);
+	free(job);
+}
+
+/*
+ * Compare two trees. Directories are traversed iteratively, using an
+ * explicit stack of directory pairs kept by the walk. The caller acts as
+ * the walker stage of the pipeline; everything else happens in the
+ * stages below.
+ */
+static bool
+compare_trees(struct report *report, struct walk *walk)
+{
+	static const struct pipeline_ops ops = {
+		.metadata	= stage_metadata,
+		.content	= stage_content,
+		.report		= stage_report,
+	};
+	struct fstate *old_fs, *new_fs;
+	struct pipeline *pipe;
+	bool status = true;
+	int how;
 
-		rv = strcmp(old_fs->name, new_fs->name);
-		if (rv < 0) {
-			report_recursively(report, FSTATE_CHANGED_REMOVED, old_fs);
-			old->cursor += 1;
-		} else if (rv > 0) {
-			report_recursively(report, FSTATE_CHANGED_ADDED, new_fs);
-			new->cursor += 1;
+	pipe = pipeline_new(&ops, report, opt_jobs);
+	while (walk_next(walk, &old_fs, &new_fs, &how)) {
+		struct pjob *job;
+		bool descend;
+
+		if (how == 0) {
+			job = pjob_new(old_fs, new_fs, 0);
+			descend = (old_fs->type == DT_DIR && new_fs->type == DT_DIR);
 		} else {
-			if (!compare_files(report, old_fs, new_fs))
-				status = false;
-			new->cursor += 1;
-			old->cursor += 1;
+			struct fstate *fs = old_fs? old_fs : new_fs;
+
+			/* Entries that exist on one side only may have been moved.
+			 * They keep their place in the report, but are reported
+			 * only once pairing is done. */
+			if (moves != NULL && !walk_one_sided(walk)) {
+				job = pjob_new(NULL, NULL, how);
+				job->held = movedet_add(moves, how, fs);
+				pipeline_submit(pipe, job);
+				continue;
+			}
+
+			job = pjob_new(old_fs, new_fs, how);
+			descend = (fs->type == DT_DIR && !opt_summarize);
 		}
+
+		job->descend = descend;
+		pipeline_submit(pipe, job);
+
+		if (descend && !walk_descend(walk, old_fs, new_fs))
+			status = false;
 	}
 
+	if (!pipeline_finish(pipe))
+		status = false;
+	if (walk_failed(walk))
+		status = false;
 	return status;
 }
 
-struct ignore_range {
-	loff_t		offset;
-	size_t		size;
+/*
+ * Find the volatile data in a file that we've been asked to ignore.
+ */
+static bool
+identify_ignore_ranges(int fd, const char *path, struct ignore_set *set)
+{
+	return elf_identify_ignore_ranges(fd, opt_ignore, set)
+	    || pyc_identify_ignore_ranges(fd, path, opt_ignore, set);
+}
+
+/*
+ * Kernel modules may be shipped compressed; they are signed before they
+ * are compressed.
+ */
+static const char *		kernel_module_suffixes[] = {
+	".ko", ".ko.gz", ".ko.xz", ".ko.zst", NULL
 };
 
+static bool
+is_kernel_module(const struct fstate *fs)
+{
+	size_t len = strlen(fs->name);
+	unsigned int i;
+
+	for (i = 0; kernel_module_suffixes[i]; ++i) {
+		size_t n = strlen(kernel_module_suffixes[i]);
+
+		if (len > n && !strcmp(fs->name + len - n, kernel_module_suffixes[i]))
+			return true;
+	}
+	return false;
+}
+
+static bool
+is_compressed_kernel_module(const struct fstate *fs)
+{
+	size_t len = strlen(fs->name);
+
+	return is_kernel_module(fs) && strcmp(fs->name + len - 3, ".ko");
+}
+
 /*
- * .gnu_debuglink contains a filename (which should never change), and a build id
- * (which usually does change).
+ * Compare the signatures of two signed kernel modules, whose module
+ * proper has the same size. Returns true if they differ.
  */
 static bool
-elf_locate_build_id(int fd, Elf64_Off offset, Elf64_Xword size, unsigned int align, struct ignore_range *range)
+compare_module_signatures(struct fcompare *fc, off_t old_size, off_t new_size)
 {
-	unsigned char *data;
-	unsigned int k;
-	int n;
+	size_t len = old_size - fc->size;
+	unsigned char *old_sig, *new_sig;
+	bool differ = true;
+
+	if (old_size != new_size)
+		return true;
+
+	old_sig = malloc(len);
+	new_sig = malloc(len);
+	if (pread(fc->old_fd, old_sig, len, fc->size) == (ssize_t) len
+	 && pread(fc->new_fd, new_sig, len, fc->size) == (ssize_t) len)
+		differ = memcmp(old_sig, new_sig, len) != 0;
+
+	free(old_sig);
+	free(new_sig);
+	return differ;
+}
 
-	if (size > 2048)
-		return false;
+/*
+ * For compressed kernel modules that differ, compare the decompressed
+ * modules, and check whether only their signatures differ.
+ */
+static void
+compare_compressed_modules(struct pjob *job)
+{
+	struct fstate *old = job->old, *new = job->new;
+	struct zstream *old_zs = NULL, *new_zs = NULL;
+	off_t diff_offset, old_body, new_body;
+	struct fcompare fc;
+	int format;
 
-	/* make sure alignment is a power of 2 */
-	if (align & (align - 1))
-		return false;
+	memset(&fc, 0, sizeof(fc));
+	fc.size = old->inode->size;
+	fc.new_fd = -1;
 
-	if (lseek64(fd, offset, SEEK_SET) < 0) {
-		printf("lseek(%lu) failed: %m\n", (long) offset);
-		return false;
+	if ((fc.old_fd = fstate_open(old)) < 0 || (fc.new_fd = fstate_open(new)) < 0)
+		goto out;
+
+	if ((format = zstream_format(fc.old_fd)) == ZSTREAM_NONE || zstream_format(fc.new_fd) != format)
+		goto out;
+
+	if (!(old_zs = zstream_open(fc.old_fd, format, fstate_path(old)))
+	 || !(new_zs = zstream_open(fc.new_fd, format, fstate_path(new)))
+	 || !fcompare_module_streams(old_zs, new_zs, &diff_offset, &old_body, &new_body))
+		goto out;
+
+	if (diff_offset < 0) {
+		job->how &= ~FSTATE_CHANGED_DATA;
+		job->how |= FSTATE_CHANGED_CONTAINER;
+		job->container = zstream_format_name(format);
+	} else if (old_body >= 0 && old_body == new_body && diff_offset >= old_body) {
+		job->how &= ~FSTATE_CHANGED_DATA;
+		job->how |= FSTATE_CHANGED_SIGNATURE;
 	}
 
-	if ((data = alloca(size)) == NULL)
-		return false;
+	/* the offset found by comparing the compressed files means nothing now */
+	if (!(job->how & FSTATE_CHANGED_DATA)) {
+		job->diff_offset = -1;
+		job->diff_region = NULL;
+	}
 
-	n = read(fd, data, size);
-	if (n != size)
-		return false;
+	fcompare_drop_cache(&fc);
 
-	/* find the end of the name */
-	for (k = 0; k < size && data[k] != 0; ++k)
-		;
+out:
+	if (old_zs)
+		zstream_close(old_zs);
+	if (new_zs)
+		zstream_close(new_zs);
+	if (fc.old_fd >= 0)
+		close(fc.old_fd);
+	if (fc.new_fd >= 0)
+		close(fc.new_fd);
+}
 
-	k += 1;	/* consume NUL */
-	k = ((k + align - 1) & ~(align - 1));
+/*
+ * Files that differ are looked at again by inspect_files()
+ */
+static inline bool
+will_inspect(const struct pjob *job)
+{
+	return (job->how & FSTATE_CHANGED_DATA) && (opt_decompress || opt_elf_sections);
+}
 
-	if (k >= size)
-		return false;
+/*
+ * Compare the contents of two regular files. If they differ, the job is
+ * marked FSTATE_CHANGED_DATA, and job->diff_offset is set to the offset of
+ * a difference, if known. This is the first difference, unless it was
+ * found by probing job->diff_region.
+ *
+ * For signed kernel modules, the module and the signature are compared
+ * separately; if only the signature differs, the job is marked
+ * FSTATE_CHANGED_SIGNATURE instead.
+ */
+static void
+compare_regular_files(struct pjob *job)
+{
+	struct fstate *old = job->old, *new = job->new;
+	struct finode *old_inode = old->inode;
+	struct finode *new_inode = new->inode;
+	struct ignore_set old_ignore, new_ignore;
+	bool module_signed = false, signature_differs = false;
+	struct fcompare fc;
+
+	job->diff_offset = -1;
+	if (old_inode->size != new_inode->size && !is_kernel_module(old))
+		goto differ;
+
+	memset(&fc, 0, sizeof(fc));
+	fc.old_path = fstate_path(old);
+	fc.new_path = fstate_path(new);
+	fc.size = old_inode->size;
+
+	if ((fc.old_fd = fstate_open(old)) < 0)
+		goto differ;
+	if ((fc.new_fd = fstate_open(new)) < 0) {
+		close(fc.old_fd);
+		goto differ;
+	}
 
-	range->offset = offset + k;
-	range->size = size - k;
+	/* Signed kernel modules: the signature is in the tail probe */
+	if (is_kernel_module(old)) {
+		off_t old_body = elf_module_signature(fc.old_fd, old_inode->size);
+		off_t new_body = elf_module_signature(fc.new_fd, new_inode->size);
 
-	if (range->size != 4 && range->size != 8)
-		return false;
+		if (old_body >= 0 && old_body == new_body) {
+			fc.size = old_body;
+			module_signed = true;
+			/* before fcompare_run(), which may switch the fds to O_DIRECT */
+			signature_differs = compare_module_signatures(&fc, old_inode->size, new_inode->size);
+		}
+	}
 
-	return true;
+	if (old_inode->size != new_inode->size && !module_signed) {
+		job->how |= FSTATE_CHANGED_DATA;
+		goto out;
+	}
+
+	/* Volatile fields are ignored only if they're in the same place in both files */
+	if (opt_ignore
+	 && identify_ignore_ranges(fc.old_fd, fc.old_path, &old_ignore)
+	 && identify_ignore_ranges(fc.new_fd, fc.new_path, &new_ignore)
+	 && ignore_set_equal(&old_ignore, &new_ignore))
+		fc.skip = &old_ignore;
+
+	/* For large ELF files and archives, look at the likely differences first */
+	if (fc.size >= PROBE_THRESHOLD)
+		fc.nprobes = elf_probe_regions(fc.old_fd, fc.size, fc.probes, FCOMPARE_MAX_PROBES);
+
+	if (opt_debug)
+		printf("D: comparing regular files %s vs %s\n", old->name, new->name);
+
+	if (!fcompare_run(&fc) || fc.diff_offset >= 0)
+		job->how |= FSTATE_CHANGED_DATA;
+	else if (signature_differs)
+		job->how |= FSTATE_CHANGED_SIGNATURE;
+
+	job->diff_offset = fc.diff_offset;
+	job->diff_region = fc.diff_region;
+
+	/* inspect_files() reads them again, and drops them when done */
+	if (!will_inspect(job))
+		fcompare_drop_cache(&fc);
+
+out:
+	close(fc.old_fd);
+	close(fc.new_fd);
+	return;
+
+differ:
+	job->how |= FSTATE_CHANGED_DATA;
 }
 
 static bool
-elf_identify_debug_section(int fd, struct ignore_range *ignore)
+read_file_range(int fd, const char *path, char *buf, size_t len, off_t offset)
 {
-	static bool elf_checked = false;
-	Elf *elf = NULL;
-	Elf_Scn *scn;
-	bool rv = false;
-	size_t shstrndx;
+	while (len) {
+		ssize_t n;
 
-	if (!opt_ignore_buildid)
-		goto out;
-
-	if (!elf_checked) {
-		if (elf_version(EV_CURRENT)== EV_NONE)
+		if ((n = pread(fd, buf, len, offset)) < 0) {
+			fprintf(stderr, "Error: failed to read from %s: %m\n", path);
+			return false;
+		}
+		if (n == 0) {
+			fprintf(stderr, "Error: %s: file shrank while reading it\n", path);
 			return false;
-		elf_checked = true;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
 	}
+	return true;
+}
+
+/*
+ * Compare two small text files, and compute a unified diff of them if
+ * they differ. The first block of each file is read to find out whether
+ * it's text; if it is, the rest is read into the same buffer, so that
+ * each file is read exactly once.
+ * Returns false if either file is not text (or too large), in which case
+ * the caller compares them the usual way.
+ */
+static bool
+compare_text_files(struct pjob *job)
+{
+	struct fstate *old = job->old, *new = job->new;
+	off_t old_size = old->inode->size, new_size = new->inode->size;
+	size_t old_head, new_head;
+	char *old_buf = NULL, *new_buf = NULL;
+	struct fcompare fc;
+	bool handled = false;
+
+	if (old_size > TEXTDIFF_MAX_SIZE || new_size > TEXTDIFF_MAX_SIZE || is_kernel_module(old))
+		return false;
+
+	memset(&fc, 0, sizeof(fc));
+	fc.old_path = fstate_path(old);
+	fc.new_path = fstate_path(new);
+	fc.size = old_size;
+	fc.new_fd = -1;
 
-	if (!(elf = elf_begin(fd, ELF_C_READ, NULL)))
+	if ((fc.old_fd = fstate_open(old)) < 0 || (fc.new_fd = fstate_open(new)) < 0)
 		goto out;
 
-	if (elf_kind(elf) != ELF_K_ELF)
+	old_buf = malloc(old_size + 1);
+	new_buf = malloc(new_size + 1);
+
+	old_head = (old_size < TEXTDIFF_BLOCK_SIZE)? old_size : TEXTDIFF_BLOCK_SIZE;
+	new_head = (new_size < TEXTDIFF_BLOCK_SIZE)? new_size : TEXTDIFF_BLOCK_SIZE;
+	if (!read_file_range(fc.old_fd, fc.old_path, old_buf, old_head, 0)
+	 || !read_file_range(fc.new_fd, fc.new_path, new_buf, new_head, 0))
 		goto out;
 
-	if (elf_getshdrstrndx(elf, &shstrndx) != 0)
+	if (memchr(old_buf, '\0', old_head) || memchr(new_buf, '\0', new_head))
 		goto out;
 
-	for (scn = NULL; (scn = elf_nextscn(elf, scn)) != NULL; ) {
-		GElf_Shdr shdr;
-		const char *name;
+	handled = true;
+	job->how &= ~FSTATE_CHANGED_DATA;
+	job->diff_offset = -1;
 
-		if (gelf_getshdr(scn , &shdr) != &shdr)
-			goto out;
+	if (!read_file_range(fc.old_fd, fc.old_path, old_buf + old_head, old_size - old_head, old_head)
+	 || !read_file_range(fc.new_fd, fc.new_path, new_buf + new_head, new_size - new_head, new_head)) {
+		job->how |= FSTATE_CHANGED_DATA;
+		goto out;
+	}
 
-		if ((name = elf_strptr(elf, shstrndx, shdr.sh_name)) == NULL )
-			goto out;
+	if (old_size == new_size) {
+		off_t i;
 
-		if (!strcmp(name, ".gnu_debuglink")
-		 && elf_locate_build_id(fd, shdr.sh_offset, shdr.sh_size, shdr.sh_addralign, ignore)) {
-			// printf("build id at range <%lu,%u>\n", (long) ignore->offset, (int)  ignore->size);
-			rv = true;
+		if (!memcmp(old_buf, new_buf, old_size))
 			goto out;
-		}
+
+		for (i = 0; old_buf[i] == new_buf[i]; ++i)
+			;
+		job->diff_offset = i;
 	}
 
-out:
-	if (elf != NULL)
-		elf_end(elf);
+	if (opt_debug)
+		printf("D: diffing text files %s vs %s\n", old->name, new->name);
 
-	/* rewind fd after messing around with ELF headers etc */
-	lseek(fd, 0, SEEK_SET);
+	job->how |= FSTATE_CHANGED_DATA;
+	job->diff_text = textdiff_unified(old_buf, old_size, new_buf, new_size, TEXTDIFF_MAX_LINES);
 
-	return rv;
+out:
+	if (handled)
+		fcompare_drop_cache(&fc);
+	if (fc.old_fd >= 0)
+		close(fc.old_fd);
+	if (fc.new_fd >= 0)
+		close(fc.new_fd);
+	free(old_buf);
+	free(new_buf);
+	return handled;
 }
 
-static void
-ignored_range_whiteout(struct ignore_range *skip, unsigned char *buf, loff_t offset, unsigned int len)
+/*
+ * Metadata stage: stat both entries and compare their attributes. For
+ * regular files of the same size, the contents are compared by the next
+ * stage. Returns false iff there was an error.
+ */
+static bool
+compare_metadata(struct pjob *job)
 {
-	loff_t relative_end, relative_start;
+	struct fstate *old = job->old, *new = job->new;
+	struct finode *old_inode, *new_inode;
+	bool status = true;
+	int how = 0;
 
-	if (offset >= skip->offset + skip->size)
-		return;
-	if (skip->offset >= offset + len)
-		return;
+	if (old->type != new->type)
+		return fstate_stat(old) && fstate_stat(new);
 
-	relative_end = skip->offset + skip->size - offset;
-	if (relative_end < 0 || (loff_t) len < relative_end)
-		return;
+	if (!(old_inode = fstate_stat(old)) || !(new_inode = fstate_stat(new)))
+		return false;
 
-	relative_start = skip->offset - offset;
-	if (relative_start < 0)
-		relative_start = 0;
+	if ((S_ISUID|S_ISGID|S_ISVTX) & (old_inode->mode ^ new_inode->mode))
+		how |= FSTATE_CHANGED_CRIT;
+	if (old_inode->uid != new_inode->uid
+	 || old_inode->gid != new_inode->gid)
+		how |= FSTATE_CHANGED_CRIT;
+	if (ALLPERMS & (old_inode->mode ^ new_inode->mode))
+		how |= FSTATE_CHANGED_MODE;
+
+	switch (old->type) {
+	case DT_REG:
+		if (old_inode->size != new_inode->size) {
+			how |= FSTATE_CHANGED_DATA;
+			/* let the content stage look inside compressed and ELF files,
+			 * at module signatures, and diff text files */
+			job->compare_content = opt_elf_sections || opt_decompress || opt_text_diff
+					|| is_kernel_module(old);
+		} else
+			job->compare_content = true;
+		break;
+
+	case DT_LNK:
+		{
+			const char *old_link, *new_link;
+
+			if (!(old_link = fstate_readlink(old))
+			 || !(new_link = fstate_readlink(new))) {
+				status = false;
+			} else if (strcmp(old_link, new_link))
+				how |= FSTATE_CHANGED_DATA;
+		}
+		break;
 
-	// printf("white out %ld bytes at buffer offset %ld\n", (long) (relative_end - relative_start), (long) relative_start);
-	memset(buf + relative_start, 0, relative_end - relative_start);
+	case DT_CHR:
+	case DT_BLK:
+		if (old_inode->rdev != new_inode->rdev)
+			how |= FSTATE_CHANGED_DATA;
+		break;
+
+	default:
+		/* no checks beyond basic inode attr checks */
+	}
+
+	job->how = how;
+	return status;
 }
 
-/*
- * Compare the contents of two regular files
- */
 static bool
-compare_regular_files(struct report *report, struct fstate *old, struct fstate *new)
+stage_metadata(struct pjob *job)
 {
-	struct stat *old_stat = old->stb;
-	struct stat *new_stat = new->stb;
-	struct ignore_range old_buildid, new_buildid, *skip = NULL;
-	int old_fd, new_fd;
-	loff_t offset;
-	int status = true;
+	struct fstate *fs;
 
-	if (old_stat->st_size != new_stat->st_size)
-		return false;
+	if (!job->single)
+		return compare_metadata(job);
+
+	/* looked at only once moves have been paired */
+	if (job->held)
+		return true;
 
-	if ((old_fd = fstate_open(old)) < 0)
+	/* Prefetch everything the report writer needs */
+	fs = job->old? job->old : job->new;
+	if (!fstate_stat(fs))
 		return false;
-	if ((new_fd = fstate_open(new)) < 0) {
-		close(old_fd);
+	if (fs->type == DT_LNK && !fstate_readlink(fs))
 		return false;
+
+	/* summaries and media index digests are read by the content stage */
+	job->compare_content = (opt_summarize && fs->type == DT_DIR)
+			|| (media_index != NULL && fs->type == DT_REG && fs->inode->size != 0);
+	return true;
+}
+
+/*
+ * For ELF files that differ, find out which sections differ, or which
+ * exported symbols were added or removed, using one of the elf_compare_*
+ * functions.
+ */
+static char *
+compare_elf_files(int old_fd, int new_fd, char *(*compare_fn)(int, int))
+{
+	char *result;
+
+	if ((result = compare_fn(old_fd, new_fd)) != NULL && *result == '\0') {
+		free(result);
+		result = NULL;
 	}
+	return result;
+}
 
-	if (elf_identify_debug_section(old_fd, &old_buildid)
-	 && elf_identify_debug_section(new_fd, &new_buildid)
-	 && !memcmp(&old_buildid, &new_buildid, sizeof(old_buildid)))
-		skip = &old_buildid;
+/*
+ * Compare two files that are compressed in the same format by their
+ * uncompressed contents, two archives of the same format entry by entry, or
+ * two ELF files section by section (with compressed sections decompressed).
+ * If the contents are identical, the job is marked FSTATE_CHANGED_CONTAINER.
+ * For archives that differ, we record the entries that differ.
+ * Returns false on error.
+ */
+static bool
+compare_container(struct pjob *job, int old_fd, int new_fd)
+{
+	struct fstate *old = job->old, *new = job->new;
+	struct zstream *old_zs = NULL, *new_zs = NULL;
+	bool status = false;
+	char *sections;
+	off_t diff_offset;
+	int format;
+
+	if ((format = zstream_format(old_fd)) != ZSTREAM_NONE && zstream_format(new_fd) == format) {
+		if (!(old_zs = zstream_open(old_fd, format, fstate_path(old)))
+		 || !(new_zs = zstream_open(new_fd, format, fstate_path(new)))
+		 || !fcompare_streams(old_zs, new_zs, &diff_offset))
+			goto out;
 
-	if (opt_debug)
-		printf("D: comparing regular files %s vs %s\n", old->name, new->name);
+		status = true;
+		if (diff_offset >= 0)
+			goto out;
 
-	offset = 0;
-	while (status) {
-		unsigned char old_buf[8192], new_buf[8192];
-		int old_len, new_len;
+		job->container = zstream_format_name(format);
+	} else
+	if ((format = archive_format(old_fd)) != ARCHIVE_NONE && archive_format(new_fd) == format) {
+		if (!archive_compare(format,
+					old_fd, old->inode->size, fstate_path(old),
+					new_fd, new->inode->size, fstate_path(new),
+					&job->diff_entries))
+			goto out;
 
-		if ((old_len = read(old_fd, old_buf, sizeof(old_buf))) < 0) {
-			fprintf(stderr, "Error: failed to read from %s: %m\n", fstate_path(old));
-			status = false;
-			break;
+		status = true;
+		job->container = archive_format_name(format);
+		if (job->diff_entries)
+			goto out;
+	} else
+	if ((sections = elf_compare_sections(old_fd, new_fd)) != NULL) {
+		status = true;
+
+		/* All sections are the same; e.g. debug info compressed differently */
+		if (*sections == '\0') {
+			free(sections);
+			job->container = "ELF";
+		} else {
+			if (opt_elf_sections)
+				job->diff_sections = sections;
+			else
+				free(sections);
+			goto out;
 		}
+	} else {
+		/* nothing we know how to look into */
+		status = true;
+		goto out;
+	}
 
-		if ((new_len = read(new_fd, new_buf, sizeof(new_buf))) < 0) {
-			fprintf(stderr, "Error: failed to read from %s: %m\n", fstate_path(new));
-			status = false;
-			break;
-		}
+	if (opt_debug)
+		printf("D: %s: %s contents are identical\n", fstate_path(new), job->container);
+	job->how &= ~FSTATE_CHANGED_DATA;
+	job->how |= FSTATE_CHANGED_CONTAINER;
 
-		if (skip != NULL) {
-			ignored_range_whiteout(skip, old_buf, offset, old_len);
-			ignored_range_whiteout(skip, new_buf, offset, new_len);
-		}
+out:
+	if (old_zs)
+		zstream_close(old_zs);
+	if (new_zs)
+		zstream_close(new_zs);
+	return status;
+}
 
-		if (old_len != new_len || memcmp(old_buf, new_buf, old_len)) {
-			status = false;
-			break;
-		}
+/*
+ * For files that differ, look inside them: compare compressed files and
+ * archives by their contents, and ELF files section by section.
+ * Returns false on error.
+ */
+static bool
+look_inside(struct pjob *job, int old_fd, int new_fd)
+{
+	if (opt_decompress) {
+		if (!compare_container(job, old_fd, new_fd))
+			return false;
+		if (!(job->how & FSTATE_CHANGED_DATA))
+			return true;
+	}
 
-		if (old_len == 0)
-			break;
+	if (opt_elf_sections) {
+		if (!job->diff_sections)
+			job->diff_sections = compare_elf_files(old_fd, new_fd, elf_compare_sections);
+		if (job->diff_sections)
+			job->diff_exports = compare_elf_files(old_fd, new_fd, elf_compare_exports);
+	}
+	return true;
+}
+
+/*
+ * Check whether look_inside() has any work to do for this file, which is
+ * worth caching: it's compressed, an archive, or an ELF file.
+ */
+static bool
+may_look_inside(int fd)
+{
+	unsigned char magic[SELFMAG];
+
+	if (pread(fd, magic, SELFMAG, 0) == SELFMAG && !memcmp(magic, ELFMAG, SELFMAG))
+		return true;
+	if (opt_decompress)
+		return zstream_format(fd) != ZSTREAM_NONE || archive_format(fd) != ARCHIVE_NONE;
+	return false;
+}
+
+/*
+ * Look inside two files that differ, or look up what we found when we
+ * last did. The cache key is the digest of both files, which costs two
+ * full reads; this only pays off for larger files. Like the plain
+ * comparison, we read each file once (through the buffer pool, so that
+ * -O direct applies), and drop their pages from the cache when done.
+ * compare_regular_files() leaves them in the cache for us, so with
+ * buffered I/O, the digests only go to the disk for what the plain
+ * comparison did not read, and look_inside() finds it all in the cache.
+ */
+static void
+inspect_files(struct pjob *job)
+{
+	unsigned char old_md[DIGEST_SIZE], new_md[DIGEST_SIZE];
+	bool cacheable = false;
+	struct fcompare fc;
+
+	memset(&fc, 0, sizeof(fc));
+	fc.old_path = fstate_path(job->old);
+	fc.new_path = fstate_path(job->new);
+	fc.size = job->old->inode->size;
+	fc.new_fd = -1;
+
+	if ((fc.old_fd = fstate_open(job->old)) < 0 || (fc.new_fd = fstate_open(job->new)) < 0)
+		goto out;
 
-		offset += old_len;
+	if (verdicts != NULL && fc.size >= VCACHE_MIN_SIZE && may_look_inside(fc.old_fd)
+	 && fcompare_digest(fc.old_fd, fc.old_path, old_md)
+	 && fcompare_digest(fc.new_fd, fc.new_path, new_md)) {
+		if (vcache_lookup(verdicts, old_md, new_md, job))
+			goto out;
+		cacheable = true;
 	}
 
-	close(old_fd);
-	close(new_fd);
+	/* don't cache the outcome of a comparison that failed half way */
+	if (look_inside(job, fc.old_fd, fc.new_fd) && cacheable)
+		vcache_store(verdicts, old_md, new_md, job);
 
-	return status;
+out:
+	if (fc.old_fd >= 0 && fc.new_fd >= 0)
+		fcompare_drop_cache(&fc);
+	if (fc.old_fd >= 0)
+		close(fc.old_fd);
+	if (fc.new_fd >= 0)
+		close(fc.new_fd);
 }
 
 /*
- * compare two directory entries an reports any discrepancies to stdout.
- * Returns false iff there was an error
+ * Digest a file that exists on one side only, for the media index
  */
 static bool
-compare_files(struct report *report, struct fstate *old, struct fstate *new)
+pjob_add_digest(struct pjob *job, const char *path)
 {
-	bool status = true;
+	struct pjob_digest *dig;
+	unsigned char md[DIGEST_SIZE];
+	bool ok;
+	int fd;
 
-	if (old->type != new->type) {
-		report_changed_file(report, FSTATE_CHANGED_REMOVED, old);
-		report_changed_file(report, FSTATE_CHANGED_ADDED, new);
-	} else {
-		struct stat *old_stb, *new_stb;
-		int how = 0;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "Error: unable to open %s: %m\n", path);
+		return false;
+	}
+	ok = fcompare_digest(fd, path, md);
+	close(fd);
+	if (!ok)
+		return false;
 
-		if (!(old_stb = fstate_stat(old)) || !(new_stb = fstate_stat(new)))
-			return false;
+	if ((job->ndigests % 16) == 0)
+		job->digests = reallocarray(job->digests, job->ndigests + 16, sizeof(job->digests[0]));
+	dig = &job->digests[job->ndigests++];
+	dig->path = strdup(path);
+	memcpy(dig->md, md, DIGEST_SIZE);
+	return true;
+}
 
-		if ((S_ISUID|S_ISGID|S_ISVTX) & (old_stb->st_mode ^ new_stb->st_mode))
-			how |= FSTATE_CHANGED_CRIT;
-		if (old_stb->st_uid != new_stb->st_uid
-		 || old_stb->st_gid != new_stb->st_gid)
-			how |= FSTATE_CHANGED_CRIT;
-		if (ALLPERMS & (old_stb->st_mode ^ new_stb->st_mode))
-			how |= FSTATE_CHANGED_MODE;
-
-		switch (old->type) {
-		case DT_REG:
-			if (!compare_regular_files(report, old, new))
-				how |= FSTATE_CHANGED_DATA;
-			break;
+static bool
+collect_summarized_file(const char *path, int type, off_t size, void *user)
+{
+	/* Empty files are identical to each other all over the place */
+	if (size == 0)
+		return true;
+	return pjob_add_digest(user, path);
+}
 
-		case DT_LNK:
-			{
-				const char *old_link, *new_link;
+/*
+ * Read what the report writer needs for an entry that exists on one side
+ * only: the summary of a directory with -s, and the digests of regular
+ * files for the media index. e is the entry of move detection, if it went
+ * through it.
+ */
+static void
+collect_single(struct pjob *job, struct fstate *fs, struct move_entry *e)
+{
+	fsummary_fn_t *fn = media_index? collect_summarized_file : NULL;
+	bool ok = true;
+
+	if (opt_summarize && fs->type == DT_DIR) {
+		if (e != NULL)
+			ok = move_entry_summarize(e, &job->summary, fn, job);
+		else
+			ok = fstate_summarize(fs, &job->summary, fn, job);
+	} else if (media_index != NULL && fs->type == DT_REG && fs->inode->size != 0) {
+		ok = pjob_add_digest(job, fstate_path(fs));
+	}
 
-				if (!(old_link = fstate_readlink(old))
-				 || !(new_link = fstate_readlink(new))) {
-					status = false;
-				} else if (strcmp(old_link, new_link))
-					how |= FSTATE_CHANGED_DATA;
-			}
-			break;
+	if (!ok)
+		job->partial = true;
+}
 
-		case DT_CHR:
-		case DT_BLK:
-			if (old_stb->st_rdev != new_stb->st_rdev)
-				how |= FSTATE_CHANGED_DATA;
-			break;
+static bool
+stage_content(struct pjob *job)
+{
+	if (job->single) {
+		collect_single(job, job->old? job->old : job->new, NULL);
+		return true;
+	}
 
-		default:
-			/* no checks beyond basic inode attr checks */
-		}
+	if (opt_text_diff && compare_text_files(job))
+		return true;
 
-		if (how != 0) {
-			report_changed_file(report, how | FSTATE_CHANGED_REMOVED, old);
-			report_changed_file(report, how | FSTATE_CHANGED_ADDED, new);
+	/* the metadata stage found the sizes to differ, but there may be more to it */
+	if (job->how & FSTATE_CHANGED_DATA) {
+		if (is_kernel_module(job->old)) {
+			job->how &= ~FSTATE_CHANGED_DATA;
+			compare_regular_files(job);
 		}
+	} else
+		compare_regular_files(job);
 
+	if ((job->how & FSTATE_CHANGED_DATA) && is_compressed_kernel_module(job->old))
+		compare_compressed_modules(job);
 
-		if (old->type == DT_DIR) {
-			struct dstate *old_subdir, *new_subdir;
+	if (job->how & (FSTATE_CHANGED_SIGNATURE | FSTATE_CHANGED_CONTAINER))
+		return true;
 
-			old_subdir = fstate_descend(old);
-			new_subdir = fstate_descend(new);
-			status = compare_directories(report, old_subdir, new_subdir);
-			dstate_free(old_subdir);
-			dstate_free(new_subdir);
+	if (will_inspect(job))
+		inspect_files(job);
+	return true;
+}
+
+/*
+ * Report stage: runs in submission order. Reports any discrepancies
+ * found by the previous stages to stdout, and frees the job.
+ */
+static bool
+stage_report(struct report *report, struct pjob *job)
+{
+	struct fstate *old = job->old, *new = job->new;
+	bool status = true;
+
+	if (job->held) {
+		status = report_hold(report, job->held);
+	} else if (job->single) {
+		bool descend = false;
+
+		if (!job->failed)
+			status = report_single(report, job, old? old : new, &descend);
+	} else if (old->type != new->type) {
+		if (!job->failed) {
+			report_changed_file(report, FSTATE_CHANGED_REMOVED, old);
+			report_changed_file(report, FSTATE_CHANGED_ADDED, new);
 		}
+	} else if (job->how != 0) {
+		report_changed_file(report, job->how | FSTATE_CHANGED_REMOVED, old);
+		report_changed_file(report, job->how | FSTATE_CHANGED_ADDED, new);
+		if (job->how & FSTATE_CHANGED_CONTAINER)
+			report_detail(report, "%s data differs, contents are identical", job->container);
+		else if (job->diff_entries)
+			report_detail(report, "%s entries: %s", job->container, job->diff_entries);
+		else if (job->diff_region)
+			report_detail(report, "difference in %s at offset %lld",
+					job->diff_region, (long long) job->diff_offset);
+		else if (job->diff_offset >= 0)
+			report_detail(report, "first difference at offset %lld", (long long) job->diff_offset);
+		if (job->diff_sections)
+			report_detail(report, "sections: %s", job->diff_sections);
+		if (job->diff_exports)
+			report_detail(report, "exported symbols: %s", job->diff_exports);
+		if (job->diff_text)
+			report_diff(report, job->diff_text);
 	}
+
+	if (opt_debug && job->descend && !job->single)
+		printf("D: Comparing %s vs %s\n", fstate_path(old), fstate_path(new));
+
+	pjob_free(job);
 	return status;
 }
 
+/*
+ * Report an entry that exists on one side only, and record it in the media
+ * index. If it is a directory, *descend is set to tell the caller to report
+ * its contents, too; with -s, it is reported as a single line instead.
+ */
 static bool
-report_recursively(struct report *report, int how, struct fstate *fs)
+report_single(struct report *report, struct pjob *job, struct fstate *fs, bool *descend)
 {
-	const char *path = fstate_path(fs);
-	struct stat *stb;
-	bool status = true;
+	bool status = !job->partial;
+	unsigned int i;
 
-	if (!(stb = fstate_stat(fs))) {
-		fprintf(stderr, "Error: failed to stat %s: %m\n", path);
-		return false;
+	if (opt_summarize && fs->type == DT_DIR) {
+		if (!report_changed_tree(report, job->how, fs, &job->summary))
+			status = false;
+	} else {
+		if (!report_changed_file(report, job->how, fs))
+			return false;
+		if (fs->type == DT_DIR)
+			*descend = true;
 	}
 
-	if (!report_changed_file(report, how, fs))
-		return false;
+	for (i = 0; i < job->ndigests; ++i) {
+		if (!mindex_add(media_index, job->how, job->digests[i].path, job->digests[i].md))
+			status = false;
+	}
+	return status;
+}
 
-	if (fs->type == DT_DIR) {
-		struct dstate *subdir;
-		struct fstate *entry;
+/*
+ * Report an unpaired entry of move detection. The pipeline is done by
+ * now, so we read what we need right here.
+ */
+static bool
+report_unpaired(struct report *report, int how, struct fstate *fs, struct move_entry *e, bool *descend)
+{
+	struct pjob job = { .how = how };
+	bool status;
 
-		subdir = fstate_descend(fs);
-		while ((entry = dstate_current_entry(subdir)) != NULL) {
-			if (!report_recursively(report, how, entry))
-				status = false;
-			subdir->cursor += 1;
-		}
+	if (!fstate_stat(fs))
+		return false;
 
-		dstate_free(subdir);
-	}
+	collect_single(&job, fs, e);
+	status = report_single(report, &job, fs, descend);
+	pjob_free_digests(&job);
 	return status;
 }
+
+/*
+ * Report an entry that was held back for move detection
+ */
+static bool
+report_held_entry(struct report *report, void *entry, void *user)
+{
+	return movedet_report(entry, report, report_unpaired);
+}
@@ -0,0 +1,250 @@
+/*
+ * ftreeresults
+ *
+ * Record and query the results of comparing a set of packages
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fstate.h"
+
+static const char *		verdicts[] = {
+	"changed",
+	"added",
+	"removed",
+	"unchanged",
+	"moved",
+	NULL
+};
+
+static void
+usage(int exitval)
+{
+	fprintf(stderr,
+		"Usage: ftreeresults [-f file] command [args]\n"
+		" -f    results file (default _results/results.db)\n"
+		" -h    display this help message output\n"
+		"Commands:\n"
+		" store package [verdict]\n"
+		"       record the result of comparing a package, reading its output from stdin.\n"
+		"       The verdict defaults to \"changed\" if there is any output, and to\n"
+		"       \"unchanged\" otherwise\n"
+		" lookup package\n"
+		"       print the verdict for a package; exit status is 1 if it has not been recorded\n"
+		" show package\n"
+		"       print the output of comparing a package\n"
+		" list [verdict]\n"
+		"       list all packages with the given verdict, or all packages\n"
+		" report\n"
+		"       print the output of all packages that are not unchanged\n"
+		"Verdicts are \"changed\", \"added\", \"removed\" and \"unchanged\"; \"moved\" is\n"
+		"used for the files that moved between packages.\n"
+	       );
+	exit(exitval);
+}
+
+static bool
+valid_verdict(const char *verdict)
+{
+	unsigned int i;
+
+	for (i = 0; verdicts[i]; ++i) {
+		if (!strcmp(verdicts[i], verdict))
+			return true;
+	}
+	fprintf(stderr, "Error: unknown verdict \"%s\"\n", verdict);
+	return false;
+}
+
+static char *
+read_stdin(size_t *len)
+{
+	size_t size = 65536, n;
+	char *buf;
+
+	buf = malloc(size);
+	*len = 0;
+	while ((n = fread(buf + *len, 1, size - *len, stdin)) > 0) {
+		*len += n;
+		if (*len == size)
+			buf = realloc(buf, size *= 2);
+	}
+
+	if (ferror(stdin)) {
+		fprintf(stderr, "Error: failed to read from stdin: %m\n");
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static bool
+do_store(const char *path, const char *package, const char *verdict)
+{
+	struct results *res;
+	size_t len;
+	char *body;
+	bool ok;
+
+	if (verdict && !valid_verdict(verdict))
+		return false;
+
+	if (!(body = read_stdin(&len)))
+		return false;
+
+	if (verdict == NULL)
+		verdict = len? "changed" : "unchanged";
+
+	if (!(res = results_open(path, true))) {
+		free(body);
+		return false;
+	}
+
+	ok = results_add(res, package, verdict, body, len);
+	results_close(res);
+	free(body);
+	return ok;
+}
+
+/*
+ * Print the verdict, or the output, for a single package. This is a
+ * single lookup in the index, which is what verify-one-directory does
+ * for every package when restarting.
+ */
+static bool
+do_lookup(const char *path, const char *package, bool show)
+{
+	struct results *res;
+	char *verdict, *body = NULL;
+	size_t len;
+
+	/* nothing has been recorded yet */
+	if (access(path, F_OK) < 0)
+		return false;
+
+	if (!(res = results_open(path, false)))
+		return false;
+
+	verdict = results_lookup(res, package, show? &body : NULL, &len);
+	results_close(res);
+
+	if (verdict == NULL)
+		return false;
+
+	if (show)
+		fwrite(body, 1, len, stdout);
+	else
+		printf("%s\n", verdict);
+
+	free(verdict);
+	free(body);
+	return true;
+}
+
+static bool
+list_package(const char *package, const char *verdict, const char *body, size_t len, void *user)
+{
+	bool *with_verdict = user;
+
+	if (*with_verdict)
+		printf("%s: %s\n", package, verdict);
+	else
+		printf("%s\n", package);
+	return true;
+}
+
+static bool
+report_package(const char *package, const char *verdict, const char *body, size_t len, void *user)
+{
+	if (len == 0)
+		return true;
+
+	printf("## %s: %s ##\n", package, verdict);
+	fwrite(body, 1, len, stdout);
+	if (body[len - 1] != '\n')
+		printf("\n");
+	return true;
+}
+
+static bool
+do_list(const char *path, const char *verdict, bool report)
+{
+	struct results *res;
+	bool with_verdict = (verdict == NULL);
+	bool ok = true;
+	unsigned int i;
+
+	if (verdict && !valid_verdict(verdict))
+		return false;
+
+	if (access(path, F_OK) < 0)
+		return true;
+
+	if (!(res = results_open(path, false)))
+		return false;
+
+	for (i = 0; ok && verdicts[i]; ++i) {
+		if (verdict && strcmp(verdict, verdicts[i]))
+			continue;
+
+		if (report) {
+			if (strcmp(verdicts[i], "unchanged"))
+				ok = results_foreach(res, verdicts[i], true, report_package, NULL);
+		} else {
+			ok = results_foreach(res, verdicts[i], false, list_package, &with_verdict);
+		}
+	}
+
+	results_close(res);
+	return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *path = "_results/results.db";
+	const char *command;
+	int nargs, c;
+	bool ok;
+
+	while ((c = getopt(argc, argv, "f:h")) != -1) {
+		switch (c) {
+		case 'f':
+			path = optarg;
+			break;
+
+		case 'h':
+			usage(0);
+		default:
+			usage(1);
+		}
+	}
+
+	if (optind >= argc)
+		usage(1);
+
+	command = argv[optind++];
+	nargs = argc - optind;
+
+	if (!strcmp(command, "store") && (nargs == 1 || nargs == 2))
+		ok = do_store(path, argv[optind], (nargs == 2)? argv[optind + 1] : NULL);
+	else if (!strcmp(command, "lookup") && nargs == 1)
+		ok = do_lookup(path, argv[optind], false);
+	else if (!strcmp(command, "show") && nargs == 1)
+		ok = do_lookup(path, argv[optind], true);
+	else if (!strcmp(command, "list") && nargs <= 1)
+		ok = do_list(path, nargs? argv[optind] : NULL, false);
+	else if (!strcmp(command, "report") && nargs == 0)
+		ok = do_list(path, NULL, true);
+	else
+		usage(1);
+
+	return ok? 0 : 1;
+}
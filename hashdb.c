@@ -0,0 +1,383 @@
+/*
+ * ftreecmp
+ *
+ * A simple on-disk hash table.
+ *
+ * The file starts with a small header, followed by a fixed-size array of
+ * buckets. Each bucket holds the file offset of the most recently added
+ * record that hashes to it; records are appended to the end of the file
+ * and chained through their "next" field. Only the bucket array is mapped
+ * into memory; records are read one by one when walking a chain.
+ *
+ * Keys do not need to be unique; a lookup returns all matching records.
+ *
+ * Records are never modified once written; hashdb_remove() merely unlinks
+ * them from their chain. Optionally, each record is flushed to disk before
+ * it is linked, so that after a crash, the table contains only complete
+ * records.
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "fstate.h"
+
+#define HASHDB_MAGIC		0x42445446	/* "FTDB" */
+#define HASHDB_VERSION		1
+#define HASHDB_NBUCKETS		(1 << 20)
+
+struct hashdb_header {
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		nbuckets;
+	uint32_t		pad;
+	uint64_t		end;		/* offset of end of record area */
+};
+
+struct hashdb_record {
+	uint64_t		next;
+	uint32_t		keylen;
+	uint32_t		datalen;
+};
+
+struct hashdb {
+	char *			path;
+	int			fd;
+	bool			writable;
+	bool			sync;
+
+	size_t			map_size;
+	struct hashdb_header *	hdr;
+	uint64_t *		buckets;
+};
+
+static uint64_t
+hashdb_hash(const void *key, size_t keylen)
+{
+	const unsigned char *p = key;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (keylen--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+struct hashdb *
+hashdb_open(const char *path, bool writable)
+{
+	struct hashdb_header hdr;
+	struct hashdb *db;
+	int fd, n;
+
+	if ((fd = open(path, writable? O_RDWR|O_CREAT : O_RDONLY, 0644)) < 0) {
+		fprintf(stderr, "Error: unable to open %s: %m\n", path);
+		return NULL;
+	}
+
+	if (flock(fd, writable? LOCK_EX : LOCK_SH) < 0) {
+		fprintf(stderr, "Error: unable to lock %s: %m\n", path);
+		goto failed;
+	}
+
+	if ((n = pread(fd, &hdr, sizeof(hdr), 0)) == 0 && writable) {
+		/* new file: write header and allocate the bucket array */
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = HASHDB_MAGIC;
+		hdr.version = HASHDB_VERSION;
+		hdr.nbuckets = HASHDB_NBUCKETS;
+		hdr.end = sizeof(hdr) + hdr.nbuckets * sizeof(uint64_t);
+
+		if (ftruncate(fd, hdr.end) < 0
+		 || pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+			fprintf(stderr, "Error: unable to initialize %s: %m\n", path);
+			goto failed;
+		}
+	} else if (n != sizeof(hdr)
+		|| hdr.magic != HASHDB_MAGIC || hdr.version != HASHDB_VERSION
+		|| hdr.nbuckets == 0 || (hdr.nbuckets & (hdr.nbuckets - 1))) {
+		fprintf(stderr, "Error: %s is not a valid database file\n", path);
+		goto failed;
+	}
+
+	db = calloc(1, sizeof(*db));
+	db->path = strdup(path);
+	db->fd = fd;
+	db->writable = writable;
+
+	db->map_size = sizeof(hdr) + hdr.nbuckets * sizeof(uint64_t);
+	db->hdr = mmap(NULL, db->map_size, writable? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (db->hdr == MAP_FAILED) {
+		fprintf(stderr, "Error: unable to map %s: %m\n", path);
+		free(db->path);
+		free(db);
+		goto failed;
+	}
+	db->buckets = (uint64_t *) (db->hdr + 1);
+
+	return db;
+
+failed:
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Flush every record to disk before linking it
+ */
+void
+hashdb_set_sync(struct hashdb *db, bool enable)
+{
+	db->sync = enable;
+}
+
+void
+hashdb_close(struct hashdb *db)
+{
+	if (db->sync)
+		msync(db->hdr, db->map_size, MS_SYNC);
+	munmap(db->hdr, db->map_size);
+	close(db->fd);
+	free(db->path);
+	free(db);
+}
+
+/*
+ * Write back the page(s) of the mapping that hold the given range
+ */
+static bool
+hashdb_sync_range(struct hashdb *db, void *addr, size_t len)
+{
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t) addr & ~(page - 1);
+
+	if (msync((void *) start, (uintptr_t) addr + len - start, MS_SYNC) < 0) {
+		fprintf(stderr, "Error: unable to sync %s: %m\n", db->path);
+		return false;
+	}
+	return true;
+}
+
+bool
+hashdb_insert(struct hashdb *db, const void *key, size_t keylen, const void *data, size_t datalen)
+{
+	uint64_t *bucket = &db->buckets[hashdb_hash(key, keylen) & (db->hdr->nbuckets - 1)];
+	uint64_t offset = db->hdr->end;
+	struct hashdb_record rec;
+	struct iovec iov[3];
+
+	if (!db->writable)
+		return false;
+
+	rec.next = *bucket;
+	rec.keylen = keylen;
+	rec.datalen = datalen;
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (void *) key;
+	iov[1].iov_len = keylen;
+	iov[2].iov_base = (void *) data;
+	iov[2].iov_len = datalen;
+
+	if (pwritev(db->fd, iov, 3, offset) != sizeof(rec) + keylen + datalen) {
+		fprintf(stderr, "Error: unable to write to %s: %m\n", db->path);
+		return false;
+	}
+
+	if (db->sync && fdatasync(db->fd) < 0) {
+		fprintf(stderr, "Error: unable to sync %s: %m\n", db->path);
+		return false;
+	}
+
+	/* Link the record only after it has been written. The end of the
+	 * record area has to be on disk before the bucket points beyond it. */
+	db->hdr->end = offset + sizeof(rec) + keylen + datalen;
+	if (db->sync && !hashdb_sync_range(db, &db->hdr->end, sizeof(db->hdr->end)))
+		return false;
+
+	*bucket = offset;
+	if (db->sync && !hashdb_sync_range(db, bucket, sizeof(*bucket)))
+		return false;
+	return true;
+}
+
+/*
+ * Read the record at the given offset. The caller has to free() the
+ * returned buffer, which holds the key followed by the data.
+ */
+static unsigned char *
+hashdb_read_record(struct hashdb *db, uint64_t offset, struct hashdb_record *rec)
+{
+	unsigned char *buf;
+	size_t len;
+
+	if (offset < sizeof(*db->hdr) || offset >= db->hdr->end
+	 || pread(db->fd, rec, sizeof(*rec), offset) != sizeof(*rec)) {
+		fprintf(stderr, "Error: %s: corrupt record at offset %llu\n", db->path, (unsigned long long) offset);
+		return NULL;
+	}
+
+	len = rec->keylen + rec->datalen;
+	if (offset + sizeof(*rec) + len > db->hdr->end) {
+		fprintf(stderr, "Error: %s: truncated record at offset %llu\n", db->path, (unsigned long long) offset);
+		return NULL;
+	}
+
+	buf = malloc(len + 1);
+	if (pread(db->fd, buf, len, offset + sizeof(*rec)) != len) {
+		fprintf(stderr, "Error: unable to read from %s: %m\n", db->path);
+		free(buf);
+		return NULL;
+	}
+	buf[len] = '\0';
+
+	return buf;
+}
+
+/*
+ * Invoke fn for every record of the chain, in the order they were added
+ * (which is the reverse order of the chain).
+ */
+static bool
+hashdb_walk_chain(struct hashdb *db, uint64_t head, const void *key, size_t keylen,
+		hashdb_fn_t *fn, void *user)
+{
+	struct hashdb_record rec;
+	uint64_t *chain = NULL, offset;
+	unsigned int count = 0;
+	bool status = true;
+
+	for (offset = head; offset != 0; offset = rec.next) {
+		if (offset < sizeof(*db->hdr) || offset >= db->hdr->end
+		 || (count && offset >= chain[count - 1])
+		 || pread(db->fd, &rec, sizeof(rec), offset) != sizeof(rec)) {
+			fprintf(stderr, "Error: %s: corrupt hash chain at offset %llu\n",
+					db->path, (unsigned long long) offset);
+			free(chain);
+			return false;
+		}
+
+		if ((count % 64) == 0)
+			chain = reallocarray(chain, count + 64, sizeof(chain[0]));
+		chain[count++] = offset;
+	}
+
+	while (status && count--) {
+		unsigned char *buf;
+
+		if (!(buf = hashdb_read_record(db, chain[count], &rec))) {
+			status = false;
+			break;
+		}
+
+		if (key == NULL || (rec.keylen == keylen && !memcmp(buf, key, keylen)))
+			status = fn(buf, rec.keylen, buf + rec.keylen, rec.datalen, user);
+		free(buf);
+	}
+
+	free(chain);
+	return status;
+}
+
+bool
+hashdb_lookup(struct hashdb *db, const void *key, size_t keylen, hashdb_fn_t *fn, void *user)
+{
+	uint64_t head = db->buckets[hashdb_hash(key, keylen) & (db->hdr->nbuckets - 1)];
+
+	return hashdb_walk_chain(db, head, key, keylen, fn, user);
+}
+
+/*
+ * Walk all records, one bucket at a time. After each bucket, bucket_done
+ * is called. Since all records with identical keys live in the same
+ * bucket, this allows the caller to process groups of records without
+ * ever holding the whole table in memory.
+ */
+bool
+hashdb_foreach(struct hashdb *db, hashdb_fn_t *fn, bool (*bucket_done)(void *user), void *user)
+{
+	unsigned int i;
+
+	for (i = 0; i < db->hdr->nbuckets; ++i) {
+		if (db->buckets[i] == 0)
+			continue;
+
+		if (!hashdb_walk_chain(db, db->buckets[i], NULL, 0, fn, user))
+			return false;
+		if (bucket_done && !bucket_done(user))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Unlink all records for which match returns true. This has to look at
+ * every record of the table, so it is meant for rare cleanups only.
+ */
+bool
+hashdb_remove(struct hashdb *db, hashdb_fn_t *match, void *user)
+{
+	struct hashdb_record rec;
+	unsigned int i;
+
+	if (!db->writable)
+		return false;
+
+	for (i = 0; i < db->hdr->nbuckets; ++i) {
+		uint64_t *bucket = &db->buckets[i];
+		uint64_t offset, prev = 0;
+
+		for (offset = *bucket; offset != 0; offset = rec.next) {
+			unsigned char *buf;
+			bool unlink;
+
+			if (!(buf = hashdb_read_record(db, offset, &rec)))
+				return false;
+			unlink = match(buf, rec.keylen, buf + rec.keylen, rec.datalen, user);
+			free(buf);
+
+			if (rec.next >= offset) {
+				fprintf(stderr, "Error: %s: corrupt hash chain at offset %llu\n",
+						db->path, (unsigned long long) offset);
+				return false;
+			}
+
+			if (!unlink) {
+				prev = offset;
+				continue;
+			}
+
+			if (prev == 0) {
+				*bucket = rec.next;
+				if (db->sync && !hashdb_sync_range(db, bucket, sizeof(*bucket)))
+					return false;
+			} else {
+				if (pwrite(db->fd, &rec.next, sizeof(rec.next),
+						prev + offsetof(struct hashdb_record, next)) != sizeof(rec.next)) {
+					fprintf(stderr, "Error: unable to write to %s: %m\n", db->path);
+					return false;
+				}
+				if (db->sync && fdatasync(db->fd) < 0) {
+					fprintf(stderr, "Error: unable to sync %s: %m\n", db->path);
+					return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,371 @@
+/*
+ * ftreecmp
+ *
+ * Media-wide index of files that were added to or removed from a package.
+ *
+ * verify-one-directory compares one package at a time, so a file that
+ * migrates from package foo to foo-common shows up as a removal in one
+ * result and as an addition in another. While comparing, we record every
+ * added or removed regular file in an on-disk hash table, twice:
+ *
+ *  - keyed by content digest, so that we can find files that moved
+ *    unchanged, possibly to a different path
+ *  - keyed by path, so that we can find files that moved and changed
+ *
+ * Once all packages have been compared, mindex_report_moves() walks the
+ * table bucket by bucket and prints all moves between packages.
+ *
+ * When a package is compared again, the records of the previous run are
+ * removed first, so that files it no longer has do not show up as moves.
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include "fstate.h"
+
+#define MINDEX_KEY_CONTENT	'C'
+#define MINDEX_KEY_PATH		'P'
+#define MINDEX_KEY_PACKAGE	'N'	/* the package has been recorded */
+
+struct mindex {
+	struct hashdb *		db;
+	char *			package;
+	char *			old_root;
+	char *			new_root;
+};
+
+static bool
+mindex_found(const void *key, size_t keylen, const void *data, size_t datalen, void *user)
+{
+	*(bool *) user = true;
+	return true;
+}
+
+/* A file record of the package */
+static bool
+mindex_match_package(const void *key, size_t keylen, const void *data, size_t datalen, void *user)
+{
+	const struct mindex *idx = user;
+	const char *package = (const char *) data + 1;
+
+	if (keylen == 0 || (*(const char *) key != MINDEX_KEY_CONTENT && *(const char *) key != MINDEX_KEY_PATH))
+		return false;
+	return datalen >= 2 && strnlen(package, datalen - 1) < datalen - 1 && !strcmp(package, idx->package);
+}
+
+/*
+ * Remove the records of a previous run of the package. This scans the
+ * whole table, so we only do it if the package has been recorded before.
+ */
+static bool
+mindex_forget_package(struct mindex *idx)
+{
+	unsigned char key[256];
+	size_t pkglen = strlen(idx->package);
+	bool found = false;
+
+	if (pkglen >= sizeof(key) - 1) {
+		fprintf(stderr, "Error: package name %s is too long\n", idx->package);
+		return false;
+	}
+
+	key[0] = MINDEX_KEY_PACKAGE;
+	memcpy(key + 1, idx->package, pkglen);
+	if (!hashdb_lookup(idx->db, key, 1 + pkglen, mindex_found, &found))
+		return false;
+
+	if (found)
+		return hashdb_remove(idx->db, mindex_match_package, idx);
+	return hashdb_insert(idx->db, key, 1 + pkglen, "", 0);
+}
+
+struct mindex *
+mindex_open(const char *path, const char *package, const char *old_root, const char *new_root)
+{
+	struct mindex *idx;
+	struct hashdb *db;
+
+	if (package == NULL) {
+		fprintf(stderr, "Error: recording to a media index requires a package name\n");
+		return NULL;
+	}
+
+	if (!(db = hashdb_open(path, true)))
+		return NULL;
+
+	idx = calloc(1, sizeof(*idx));
+	idx->db = db;
+	idx->package = strdup(package);
+	idx->old_root = strdup(old_root);
+	idx->new_root = strdup(new_root);
+
+	if (!mindex_forget_package(idx)) {
+		mindex_close(idx);
+		return NULL;
+	}
+	return idx;
+}
+
+void
+mindex_close(struct mindex *idx)
+{
+	hashdb_close(idx->db);
+	free(idx->package);
+	free(idx->old_root);
+	free(idx->new_root);
+	free(idx);
+}
+
+/*
+ * Strip the root directory of the tree, so that paths of different
+ * packages can be compared.
+ */
+static const char *
+mindex_relative_path(const char *path, const char *root)
+{
+	size_t len = strlen(root);
+
+	if (!strncmp(path, root, len) && path[len] == '/')
+		return path + len;
+	return path;
+}
+
+/*
+ * Record a regular file, given its content digest. Record data is the side
+ * ('+' or '-'), the package name and either the path or the digest of the
+ * file, depending on the key. Empty files are identical to each other all
+ * over the place; the caller should not record them.
+ */
+bool
+mindex_add(struct mindex *idx, int how, const char *fullpath, const unsigned char *md)
+{
+	unsigned char key[PATH_MAX + 1], data[PATH_MAX + 256];
+	const char *path, *root;
+	size_t pathlen, pkglen;
+
+	root = (how & FSTATE_CHANGED_ADDED)? idx->new_root : idx->old_root;
+	path = mindex_relative_path(fullpath, root);
+
+	pathlen = strlen(path);
+	pkglen = strlen(idx->package);
+	if (pathlen >= PATH_MAX || pkglen >= 255)
+		return false;
+
+	data[0] = (how & FSTATE_CHANGED_ADDED)? '+' : '-';
+	memcpy(data + 1, idx->package, pkglen + 1);
+
+	key[0] = MINDEX_KEY_CONTENT;
+	memcpy(key + 1, md, DIGEST_SIZE);
+	memcpy(data + 2 + pkglen, path, pathlen + 1);
+	if (!hashdb_insert(idx->db, key, 1 + DIGEST_SIZE, data, 2 + pkglen + pathlen + 1))
+		return false;
+
+	key[0] = MINDEX_KEY_PATH;
+	memcpy(key + 1, path, pathlen);
+	memcpy(data + 2 + pkglen, md, DIGEST_SIZE);
+	return hashdb_insert(idx->db, key, 1 + pathlen, data, 2 + pkglen + DIGEST_SIZE);
+}
+
+/*
+ * Reporting of moves. We collect all records of one bucket, and
+ * evaluate them once the bucket is complete.
+ */
+struct mindex_record {
+	unsigned char *		key;
+	size_t			keylen;
+	size_t			datalen;
+	char			side;
+	const char *		package;
+	const unsigned char *	value;		/* path or digest */
+};
+
+struct mindex_bucket {
+	unsigned int		count;
+	struct mindex_record *	records;
+	unsigned long		nmoves;
+};
+
+static bool
+mindex_collect(const void *key, size_t keylen, const void *data, size_t datalen, void *user)
+{
+	struct mindex_bucket *bucket = user;
+	struct mindex_record *rec;
+	unsigned char *copy;
+	size_t pkglen;
+
+	if (datalen < 3 || (pkglen = strnlen((const char *) data + 1, datalen - 1)) >= datalen - 2)
+		return true;
+
+	/* one buffer for key and data */
+	copy = malloc(keylen + datalen + 1);
+	memcpy(copy, key, keylen);
+	memcpy(copy + keylen, data, datalen);
+	copy[keylen + datalen] = '\0';
+
+	bucket->records = reallocarray(bucket->records, bucket->count + 1, sizeof(*rec));
+	rec = &bucket->records[bucket->count++];
+	rec->key = copy;
+	rec->keylen = keylen;
+	rec->datalen = datalen;
+	rec->side = copy[keylen];
+	rec->package = (const char *) copy + keylen + 1;
+	rec->value = copy + keylen + 2 + pkglen;
+	return true;
+}
+
+static int
+mindex_record_compare(const void *a, const void *b)
+{
+	const struct mindex_record *ra = a, *rb = b;
+	size_t len = (ra->keylen < rb->keylen)? ra->keylen : rb->keylen;
+	int rv;
+
+	if ((rv = memcmp(ra->key, rb->key, len)) != 0)
+		return rv;
+	if (ra->keylen != rb->keylen)
+		return (ra->keylen < rb->keylen)? -1 : 1;
+
+	len = (ra->datalen < rb->datalen)? ra->datalen : rb->datalen;
+	if ((rv = memcmp(ra->key + ra->keylen, rb->key + rb->keylen, len)) != 0)
+		return rv;
+	if (ra->datalen != rb->datalen)
+		return (ra->datalen < rb->datalen)? -1 : 1;
+	return 0;
+}
+
+/*
+ * For a group of records with identical content digest, report every file
+ * that was removed from one package and added to another. If there are
+ * several candidates, prefer the one with the same path.
+ */
+static void
+mindex_report_content_group(struct mindex_bucket *bucket, struct mindex_record *group, unsigned int count)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < count; ++i) {
+		struct mindex_record *old = &group[i];
+		struct mindex_record *same_path = NULL;
+
+		if (old->side != '-')
+			continue;
+
+		for (j = 0; j < count; ++j) {
+			struct mindex_record *new = &group[j];
+
+			if (new->side == '+' && strcmp(old->package, new->package)
+			 && !strcmp((const char *) old->value, (const char *) new->value))
+				same_path = new;
+		}
+
+		for (j = 0; j < count; ++j) {
+			struct mindex_record *new = &group[j];
+
+			if (new->side != '+' || !strcmp(old->package, new->package))
+				continue;
+			if (same_path && new != same_path)
+				continue;
+
+			printf("%s:%s => %s:%s\n",
+					old->package, old->value,
+					new->package, new->value);
+			bucket->nmoves++;
+
+			if (same_path)
+				break;
+		}
+	}
+}
+
+/*
+ * For a group of records with identical path, report files that moved to a
+ * different package, and changed their content on the way.
+ */
+static void
+mindex_report_path_group(struct mindex_bucket *bucket, struct mindex_record *group, unsigned int count)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < count; ++i) {
+		struct mindex_record *old = &group[i];
+
+		if (old->side != '-')
+			continue;
+
+		for (j = 0; j < count; ++j) {
+			struct mindex_record *new = &group[j];
+
+			if (new->side != '+' || !strcmp(old->package, new->package)
+			 || !memcmp(old->value, new->value, DIGEST_SIZE))
+				continue;
+
+			printf("%s:%.*s => %s:%.*s (content changed)\n",
+					old->package, (int) old->keylen - 1, old->key + 1,
+					new->package, (int) new->keylen - 1, new->key + 1);
+			bucket->nmoves++;
+			break;
+		}
+	}
+}
+
+static bool
+mindex_bucket_done(void *user)
+{
+	struct mindex_bucket *bucket = user;
+	unsigned int i, j;
+
+	qsort(bucket->records, bucket->count, sizeof(bucket->records[0]), mindex_record_compare);
+
+	/* A package that was compared more than once leaves duplicate records */
+	for (i = 1; i < bucket->count; ++i) {
+		if (!mindex_record_compare(&bucket->records[i - 1], &bucket->records[i]))
+			bucket->records[i - 1].side = '\0';
+	}
+
+	for (i = 0; i < bucket->count; i = j) {
+		struct mindex_record *group = &bucket->records[i];
+
+		for (j = i + 1; j < bucket->count; ++j) {
+			struct mindex_record *rec = &bucket->records[j];
+
+			if (rec->keylen != group->keylen || memcmp(rec->key, group->key, rec->keylen))
+				break;
+		}
+
+		if (group->key[0] == MINDEX_KEY_CONTENT)
+			mindex_report_content_group(bucket, group, j - i);
+		else if (group->key[0] == MINDEX_KEY_PATH)
+			mindex_report_path_group(bucket, group, j - i);
+	}
+
+	for (i = 0; i < bucket->count; ++i)
+		free(bucket->records[i].key);
+	bucket->count = 0;
+	return true;
+}
+
+bool
+mindex_report_moves(const char *path)
+{
+	struct mindex_bucket bucket;
+	struct hashdb *db;
+	bool rv;
+
+	if (!(db = hashdb_open(path, false)))
+		return false;
+
+	memset(&bucket, 0, sizeof(bucket));
+	rv = hashdb_foreach(db, mindex_collect, mindex_bucket_done, &bucket);
+
+	if (bucket.records)
+		free(bucket.records);
+	hashdb_close(db);
+	return rv;
+}
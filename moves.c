@@ -0,0 +1,590 @@
+/*
+ * ftreecmp
+ *
+ * Detection of files and directories that were moved, rather than added
+ * or removed.
+ *
+ * All entries that compare_directories() finds on one side only are
+ * collected here, and hold their place in the report. Once the comparison
+ * is done, we try to pair removed entries with added entries of identical
+ * content and attributes. To keep this cheap, we first compute a key over
+ * type, attributes and (for directories) the shape of the subtree, and
+ * only read file contents when a removed and an added entry share the same
+ * key. Entries that could not be paired are then reported from the subtree
+ * we have read, without walking it again. If there is nothing to pair
+ * with, the subtree is read only when the entry is reported.
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "fstate.h"
+
+struct move_entry {
+	struct move_entry *	parent;
+	struct move_entry *	next;		/* next sibling */
+	struct move_entry *	children;
+
+	struct fstate *		fs;
+	int			how;
+	unsigned int		depth;
+
+	bool			expanded;
+	bool			failed;		/* reading the subtree failed */
+	bool			partial;	/* some descendant was paired */
+	struct move_entry *	peer;
+
+	bool			have_digest;
+	unsigned char		key[DIGEST_SIZE];	/* type, attributes, shape of subtree */
+	unsigned char		digest[DIGEST_SIZE];	/* ... plus file contents */
+};
+
+struct movedet {
+	struct move_entry *	list;
+	struct move_entry **	tail;
+	unsigned int		nadded;
+	unsigned int		nremoved;
+
+	unsigned int		count;
+	struct move_entry **	all;
+};
+
+struct movedet *
+movedet_new(void)
+{
+	struct movedet *md;
+
+	md = calloc(1, sizeof(*md));
+	md->tail = &md->list;
+	return md;
+}
+
+static struct move_entry *
+move_entry_new(struct move_entry *parent, int how, struct fstate *fs)
+{
+	struct move_entry *e;
+
+	e = calloc(1, sizeof(*e));
+	e->parent = parent;
+	e->how = how;
+	e->fs = fstate_clone(fs);
+	if (parent)
+		e->depth = parent->depth + 1;
+	return e;
+}
+
+/*
+ * Return the entry following @e when walking the subtree of @root in
+ * pre-order. If @descend is false, skip the children of @e.
+ */
+static struct move_entry *
+move_entry_next(struct move_entry *e, const struct move_entry *root, bool descend)
+{
+	if (descend && e->children)
+		return e->children;
+
+	while (e != root) {
+		if (e->next)
+			return e->next;
+		e = e->parent;
+	}
+	return NULL;
+}
+
+/*
+ * Free the children of an entry. Each child is unlinked before we descend
+ * into it, so that its parent pointer leads us back up.
+ */
+static void
+move_entry_free_children(struct move_entry *root)
+{
+	struct move_entry *e = root, *child;
+
+	while (e != root || e->children) {
+		if ((child = e->children) != NULL) {
+			e->children = child->next;
+			e = child;
+			continue;
+		}
+
+		child = e;
+		e = e->parent;
+		fstate_free(child->fs);
+		free(child);
+	}
+}
+
+static void
+move_entry_free(struct move_entry *e)
+{
+	move_entry_free_children(e);
+	fstate_free(e->fs);
+	free(e);
+}
+
+void
+movedet_free(struct movedet *md)
+{
+	struct move_entry *e;
+
+	while ((e = md->list) != NULL) {
+		md->list = e->next;
+		move_entry_free(e);
+	}
+
+	if (md->all)
+		free(md->all);
+	free(md);
+}
+
+struct move_entry *
+movedet_add(struct movedet *md, int how, struct fstate *fs)
+{
+	struct move_entry *e;
+
+	e = move_entry_new(NULL, how, fs);
+	*(md->tail) = e;
+	md->tail = &e->next;
+
+	if (how & FSTATE_CHANGED_ADDED)
+		md->nadded++;
+	else
+		md->nremoved++;
+	return e;
+}
+
+/*
+ * Stat an entry, and if it is a directory, create its children.
+ */
+static bool
+move_entry_read(struct move_entry *e)
+{
+	struct move_entry **pos = &e->children;
+	struct dstate *subdir;
+	struct fstate *entry;
+	bool status = true;
+
+	if (!fstate_stat(e->fs))
+		return false;
+
+	if (e->fs->type == DT_LNK)
+		return fstate_readlink(e->fs) != NULL;
+
+	if (e->fs->type != DT_DIR)
+		return true;
+
+	if (!(subdir = fstate_descend(e->fs)))
+		return false;
+
+	while ((entry = dstate_current_entry(subdir)) != NULL) {
+		struct move_entry *child;
+
+		child = move_entry_new(e, e->how, entry);
+		*pos = child;
+		pos = &child->next;
+		dstate_advance(subdir);
+	}
+	if (subdir->failed)
+		status = false;
+
+	dstate_free(subdir);
+	return status;
+}
+
+/*
+ * Compute the key of an entry whose children have their keys already.
+ */
+static void
+move_entry_key(struct move_entry *e)
+{
+	struct finode *inode = e->fs->inode;
+	struct move_entry *child;
+	struct digest d;
+
+	digest_init(&d);
+	digest_update(&d, &e->fs->type, sizeof(e->fs->type));
+	digest_update(&d, &inode->mode, sizeof(inode->mode));
+	digest_update(&d, &inode->uid, sizeof(inode->uid));
+	digest_update(&d, &inode->gid, sizeof(inode->gid));
+
+	switch (e->fs->type) {
+	case DT_REG:
+		digest_update(&d, &inode->size, sizeof(inode->size));
+		break;
+
+	case DT_LNK:
+		digest_update(&d, e->fs->link_dest, strlen(e->fs->link_dest) + 1);
+		break;
+
+	case DT_CHR:
+	case DT_BLK:
+		digest_update(&d, &inode->rdev, sizeof(inode->rdev));
+		break;
+
+	case DT_DIR:
+		for (child = e->children; child; child = child->next) {
+			digest_update(&d, child->fs->name, strlen(child->fs->name) + 1);
+			digest_update(&d, child->key, sizeof(child->key));
+		}
+		break;
+	}
+
+	digest_final(&d, e->key);
+}
+
+/*
+ * Collect the subtree of @root in pre-order. Walking the result backwards
+ * visits every entry after all of its descendants.
+ */
+static struct move_entry **
+move_entry_collect(struct move_entry *root, unsigned int *countp)
+{
+	struct move_entry **order = NULL;
+	unsigned int count = 0;
+	struct move_entry *e;
+
+	for (e = root; e; e = move_entry_next(e, root, true)) {
+		if ((count % 64) == 0)
+			order = reallocarray(order, count + 64, sizeof(order[0]));
+		order[count++] = e;
+	}
+
+	*countp = count;
+	return order;
+}
+
+/*
+ * Read the subtree below an entry top-down, one directory at a time. If
+ * @md is given, compute the keys of all entries bottom-up and add them to
+ * the pairing.
+ */
+static bool
+move_entry_expand(struct movedet *md, struct move_entry *root)
+{
+	struct move_entry **order, *e;
+	unsigned int i, count;
+
+	for (e = root; e; e = move_entry_next(e, root, true)) {
+		if (!move_entry_read(e)) {
+			root->failed = true;
+			return false;
+		}
+	}
+
+	order = move_entry_collect(root, &count);
+	if (md != NULL) {
+		for (i = count; i-- > 0; )
+			move_entry_key(order[i]);
+
+		md->all = reallocarray(md->all, md->count + count, sizeof(md->all[0]));
+		memcpy(md->all + md->count, order, count * sizeof(order[0]));
+		md->count += count;
+	}
+
+	for (i = 0; i < count; ++i)
+		order[i]->expanded = true;
+	free(order);
+	return true;
+}
+
+/*
+ * Compute the content digest of an entry. For everything but regular files
+ * and directories, the key already covers everything we compare.
+ */
+static bool
+move_entry_digest(struct move_entry *root)
+{
+	struct move_entry **order, *child;
+	unsigned int i, count;
+	bool status = true;
+
+	if (root->have_digest)
+		return true;
+
+	order = move_entry_collect(root, &count);
+	for (i = count; status && i-- > 0; ) {
+		struct move_entry *e = order[i];
+		struct digest d;
+
+		if (e->have_digest)
+			continue;
+
+		digest_init(&d);
+		digest_update(&d, e->key, sizeof(e->key));
+
+		if (e->fs->type == DT_REG) {
+			unsigned char md[DIGEST_SIZE];
+
+			if (!fstate_digest(e->fs, md)) {
+				status = false;
+				break;
+			}
+			digest_update(&d, md, sizeof(md));
+		} else if (e->fs->type == DT_DIR) {
+			for (child = e->children; child; child = child->next)
+				digest_update(&d, child->digest, sizeof(child->digest));
+		}
+
+		digest_final(&d, e->digest);
+		e->have_digest = true;
+	}
+
+	free(order);
+	return status;
+}
+
+/*
+ * Empty files and directories are identical to each other all over the place.
+ * Pair them only if their names match, too.
+ */
+static bool
+move_entry_trivial(const struct move_entry *e)
+{
+	if (e->fs->type == DT_REG)
+		return e->fs->inode->size == 0;
+	if (e->fs->type == DT_DIR)
+		return e->children == NULL;
+	return false;
+}
+
+/*
+ * An entry can be paired only if neither an ancestor nor a descendant has
+ * been paired already.
+ */
+static bool
+move_entry_available(const struct move_entry *e)
+{
+	if (e->peer || e->partial)
+		return false;
+	while ((e = e->parent) != NULL) {
+		if (e->peer)
+			return false;
+	}
+	return true;
+}
+
+static void
+move_entry_pair(struct move_entry *old, struct move_entry *new)
+{
+	struct move_entry *e;
+
+	old->peer = new;
+	new->peer = old;
+
+	for (e = old->parent; e; e = e->parent)
+		e->partial = true;
+	for (e = new->parent; e; e = e->parent)
+		e->partial = true;
+}
+
+static int
+move_entry_compare_key(const void *a, const void *b)
+{
+	const struct move_entry *ea = *(const struct move_entry **) a;
+	const struct move_entry *eb = *(const struct move_entry **) b;
+	int rv;
+
+	if ((rv = memcmp(ea->key, eb->key, sizeof(ea->key))) != 0)
+		return rv;
+
+	/* Within a group of identical keys, look at the shallow entries first */
+	if (ea->depth != eb->depth)
+		return (ea->depth < eb->depth)? -1 : 1;
+	return 0;
+}
+
+/*
+ * Try to find a partner for the removed entry @old in the group of entries
+ * with identical keys. Prefer a partner with the same name.
+ */
+static struct move_entry *
+movedet_find_peer(struct move_entry **group, unsigned int count, struct move_entry *old)
+{
+	struct move_entry *best = NULL;
+	unsigned int i;
+
+	for (i = 0; i < count; ++i) {
+		struct move_entry *new = group[i];
+		bool same_name;
+
+		if (!(new->how & FSTATE_CHANGED_ADDED) || !move_entry_available(new))
+			continue;
+
+		same_name = !strcmp(old->fs->name, new->fs->name);
+		if (!same_name && (best != NULL || move_entry_trivial(old)))
+			continue;
+
+		if (!move_entry_digest(old) || !move_entry_digest(new))
+			return NULL;
+		if (memcmp(old->digest, new->digest, sizeof(old->digest)))
+			continue;
+
+		best = new;
+		if (same_name)
+			break;
+	}
+
+	return best;
+}
+
+/*
+ * Read the subtrees of all collected entries, and pair them. If all of them
+ * are on one side, there is nothing to pair, and movedet_report() reads
+ * each subtree when it gets to it.
+ */
+void
+movedet_pair(struct movedet *md)
+{
+	struct move_entry *e;
+	unsigned int i, j, k, depth, max_depth = 0;
+
+	if (md->nadded == 0 || md->nremoved == 0)
+		return;
+
+	/* an entry we failed to read is left out of the pairing */
+	for (e = md->list; e; e = e->next)
+		move_entry_expand(md, e);
+
+	qsort(md->all, md->count, sizeof(md->all[0]), move_entry_compare_key);
+
+	for (i = 0; i < md->count; ++i) {
+		if (md->all[i]->depth > max_depth)
+			max_depth = md->all[i]->depth;
+	}
+
+	/* Pair top-down, so that moving a directory shows up as one line */
+	for (depth = 0; depth <= max_depth; ++depth) {
+		for (i = 0; i < md->count; i = j) {
+			for (j = i + 1; j < md->count; ++j) {
+				if (memcmp(md->all[i]->key, md->all[j]->key, DIGEST_SIZE))
+					break;
+			}
+
+			if (j - i < 2)
+				continue;
+
+			for (k = i; k < j; ++k) {
+				struct move_entry *old = md->all[k], *new;
+
+				if (old->depth != depth
+				 || !(old->how & FSTATE_CHANGED_REMOVED)
+				 || !move_entry_available(old))
+					continue;
+
+				if ((new = movedet_find_peer(md->all + i, j - i, old)) != NULL)
+					move_entry_pair(old, new);
+			}
+		}
+	}
+}
+
+/*
+ * Count the entries below a directory, like fstate_summarize() does, but
+ * from the subtree we have read already
+ */
+bool
+move_entry_summarize(struct move_entry *root, struct fsummary *sum, fsummary_fn_t *fn, void *user)
+{
+	struct move_entry *e;
+	bool status = true;
+
+	/* we failed to read all of it */
+	if (!root->expanded)
+		return fstate_summarize(root->fs, sum, fn, user);
+
+	memset(sum, 0, sizeof(*sum));
+	for (e = move_entry_next(root, root, true); e; e = move_entry_next(e, root, true)) {
+		struct finode *inode = e->fs->inode;
+
+		sum->entries++;
+		switch (IFTODT(inode->mode)) {
+		case DT_REG:
+			sum->files++;
+			sum->bytes += inode->size;
+			if (fn && !fn(fstate_path(e->fs), DT_REG, inode->size, user))
+				status = false;
+			break;
+
+		case DT_DIR:
+			sum->dirs++;
+			break;
+
+		case DT_LNK:
+			sum->symlinks++;
+			break;
+
+		default:
+			sum->other++;
+		}
+	}
+
+	return status;
+}
+
+static bool
+movedet_report_unpaired(struct move_entry *root, struct report *report, movedet_report_fn_t *report_fn)
+{
+	struct move_entry *e = root;
+	bool status = true;
+
+	while (e != NULL) {
+		bool descend = false;
+
+		if (!report_fn(report, e->how, e->fs, e, &descend))
+			status = false;
+		e = move_entry_next(e, root, descend);
+	}
+
+	/* we failed to read all of it, and have complained already */
+	if (!root->expanded)
+		status = false;
+	return status;
+}
+
+/*
+ * Report a collected entry in its place. A move is reported in place of
+ * the removed entry; anything that could not be paired is handed to
+ * report_fn, which sets *descend if it wants to see the children, too.
+ */
+bool
+movedet_report(struct move_entry *root, struct report *report, movedet_report_fn_t *report_fn)
+{
+	struct move_entry *e = root;
+	bool status = true;
+
+	/* nothing was paired, so nobody has read the subtree yet */
+	if (!root->expanded && !root->failed) {
+		bool lazy = move_entry_expand(NULL, root);
+
+		status = movedet_report_unpaired(root, report, report_fn) && lazy;
+		move_entry_free_children(root);
+		return status;
+	}
+
+	while (e != NULL) {
+		bool descend = false;
+
+		if (e->peer) {
+			if ((e->how & FSTATE_CHANGED_REMOVED)
+			 && !report_moved_file(report, e->fs, e->peer->fs))
+				status = false;
+		} else if (!e->partial) {
+			if (!movedet_report_unpaired(e, report, report_fn))
+				status = false;
+		} else {
+			if (!report_changed_file(report, e->how, e->fs))
+				status = false;
+			descend = true;
+		}
+
+		e = move_entry_next(e, root, descend);
+	}
+
+	return status;
+}
@@ -0,0 +1,621 @@
+/*
+ * ftreecmp
+ *
+ * Staged pipeline for comparing two trees.
+ *
+ * The caller acts as the walker: it merges the directory listings and
+ * submits one job per pair of entries. From there, jobs pass through
+ *
+ *  - a metadata stage (one thread) that stats the entries, compares their
+ *    attributes and decides whether the contents need to be compared
+ *  - a pool of content comparators
+ *  - a single report writer, which puts the jobs back into the order in
+ *    which they were submitted, so that the output is deterministic
+ *
+ * The stages are connected by bounded lock-free queues. A job that needs
+ * no content comparison goes from the metadata stage straight to the
+ * report writer. The number of jobs in flight is limited by the size of
+ * the writer's reorder window.
+ *
+ * In layout order mode, the metadata stage holds back content jobs in
+ * batches, and passes each batch on sorted by the physical location of
+ * the files on disk, so that the comparators read the device mostly front
+ * to back instead of seeking all over the place. A batch is flushed when
+ * it is full, or when the walker does not keep up with us. Since the
+ * report writer restores submission order, this does not affect the
+ * output.
+ *
+ * A thread that has to wait for another stage spins briefly, then yields,
+ * and eventually blocks on a condition variable. Whoever changes the state
+ * it waits for wakes it up, which costs an atomic load as long as nobody
+ * is blocked.
+ *
+ * Each queue keeps occupancy counters. A queue that is mostly full, and
+ * whose producers frequently stall, is in front of the bottleneck; a queue
+ * that is mostly empty, with stalling consumers, is behind it.
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "fstate.h"
+
+#define PQUEUE_SIZE		1024
+#define PIPELINE_WINDOW		4096
+#define PIPELINE_BATCH_SIZE	256
+
+static bool			pipeline_layout_order = false;
+
+/*
+ * Where threads block once spinning did not help
+ */
+struct pwait {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	atomic_uint		waiters;
+};
+
+/*
+ * Bounded multi-producer, multi-consumer queue. Each slot carries a
+ * sequence number that tells producers and consumers whose turn it is.
+ */
+struct pqueue_slot {
+	atomic_ulong		seq;
+	struct pjob *		job;
+};
+
+struct pqueue {
+	struct pqueue_slot	slots[PQUEUE_SIZE];
+
+	atomic_ulong		head;
+	atomic_ulong		tail;
+	atomic_int		producers;
+	struct pwait		wait;
+
+	/* occupancy counters */
+	atomic_ulong		pushed;
+	atomic_ulong		occupancy_sum;
+	atomic_ulong		occupancy_max;
+	atomic_ulong		full_stalls;
+	atomic_ulong		empty_stalls;
+};
+
+struct pipeline {
+	const struct pipeline_ops *ops;
+	struct report *		report;
+
+	unsigned int		nworkers;
+	pthread_t		metadata_thread;
+	pthread_t *		workers;
+	pthread_t		writer_thread;
+
+	struct pqueue		metadata_queue;
+	struct pqueue		content_queue;
+	struct pqueue		report_queue;
+
+	/* owned by the metadata stage */
+	struct pjob *		batch[PIPELINE_BATCH_SIZE];
+	unsigned int		batch_count;
+
+	/* owned by the walker */
+	unsigned long		submitted;
+	unsigned long		window_stalls;
+	struct pwait		window_wait;
+
+	/* owned by the writer */
+	struct pjob *		reorder[PIPELINE_WINDOW];
+	unsigned long		reorder_sum;
+	unsigned long		reorder_max;
+	atomic_ulong		reported;
+
+	atomic_bool		failed;
+};
+
+/* Counters accumulated over all pipeline runs */
+struct pqueue_stats {
+	unsigned long		pushed;
+	unsigned long		occupancy_sum;
+	unsigned long		occupancy_max;
+	unsigned long		full_stalls;
+	unsigned long		empty_stalls;
+};
+
+static struct {
+	unsigned int		runs;
+	unsigned int		nworkers;
+	unsigned long		jobs;
+	unsigned long		window_stalls;
+	unsigned long		reorder_sum;
+	unsigned long		reorder_max;
+	unsigned long		batches;
+	unsigned long		located;
+	struct pqueue_stats	metadata, content, report;
+} pipeline_stats;
+
+static void
+pwait_init(struct pwait *w)
+{
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	atomic_init(&w->waiters, 0);
+}
+
+static void
+pwait_destroy(struct pwait *w)
+{
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+}
+
+/*
+ * Wake up everyone blocked in pwait_until(). The fence pairs with the one
+ * in pwait_until(): either we see the waiter, or it sees our update.
+ */
+static void
+pwait_wake(struct pwait *w)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&w->waiters, memory_order_relaxed) == 0)
+		return;
+
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Wait until ready() returns true: spin briefly, then yield, and
+ * eventually block until another stage wakes us up.
+ */
+static void
+pwait_until(struct pwait *w, bool (*ready)(void *), void *arg)
+{
+	unsigned int spins;
+
+	for (spins = 0; spins < 128; ++spins) {
+		if (ready(arg))
+			return;
+		if (spins >= 64)
+			sched_yield();
+	}
+
+	pthread_mutex_lock(&w->lock);
+	atomic_fetch_add(&w->waiters, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	while (!ready(arg))
+		pthread_cond_wait(&w->cond, &w->lock);
+	atomic_fetch_sub(&w->waiters, 1);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void
+pqueue_init(struct pqueue *q, int producers)
+{
+	unsigned int i;
+
+	memset(q, 0, sizeof(*q));
+	for (i = 0; i < PQUEUE_SIZE; ++i)
+		atomic_init(&q->slots[i].seq, i);
+	atomic_init(&q->producers, producers);
+	pwait_init(&q->wait);
+}
+
+static void
+pqueue_destroy(struct pqueue *q)
+{
+	pwait_destroy(&q->wait);
+}
+
+/* There is a free slot for the next push */
+static bool
+pqueue_has_room(void *arg)
+{
+	struct pqueue *q = arg;
+	unsigned long pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+	return atomic_load_explicit(&q->slots[pos % PQUEUE_SIZE].seq, memory_order_acquire) == pos;
+}
+
+/* There is a job for the next pop, or there will never be one */
+static bool
+pqueue_has_job(void *arg)
+{
+	struct pqueue *q = arg;
+	unsigned long pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+	return atomic_load_explicit(&q->slots[pos % PQUEUE_SIZE].seq, memory_order_acquire) == pos + 1
+	    || atomic_load(&q->producers) == 0;
+}
+
+static bool
+pqueue_try_push(struct pqueue *q, struct pjob *job)
+{
+	unsigned long pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	struct pqueue_slot *slot;
+
+	while (true) {
+		long diff;
+
+		slot = &q->slots[pos % PQUEUE_SIZE];
+		diff = (long) atomic_load_explicit(&slot->seq, memory_order_acquire) - (long) pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+						memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+		}
+	}
+
+	slot->job = job;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	pwait_wake(&q->wait);
+	return true;
+}
+
+static bool
+pqueue_try_pop(struct pqueue *q, struct pjob **job)
+{
+	unsigned long pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	struct pqueue_slot *slot;
+
+	while (true) {
+		long diff;
+
+		slot = &q->slots[pos % PQUEUE_SIZE];
+		diff = (long) atomic_load_explicit(&slot->seq, memory_order_acquire) - (long) (pos + 1);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+						memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+		}
+	}
+
+	*job = slot->job;
+	atomic_store_explicit(&slot->seq, pos + PQUEUE_SIZE, memory_order_release);
+	pwait_wake(&q->wait);
+	return true;
+}
+
+static void
+pqueue_push(struct pqueue *q, struct pjob *job)
+{
+	unsigned long occupancy, max;
+
+	if (!pqueue_try_push(q, job)) {
+		atomic_fetch_add_explicit(&q->full_stalls, 1, memory_order_relaxed);
+		do {
+			pwait_until(&q->wait, pqueue_has_room, q);
+		} while (!pqueue_try_push(q, job));
+	}
+
+	occupancy = atomic_load_explicit(&q->tail, memory_order_relaxed)
+		  - atomic_load_explicit(&q->head, memory_order_relaxed);
+	if ((long) occupancy < 0)
+		occupancy = 0;
+
+	atomic_fetch_add_explicit(&q->pushed, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&q->occupancy_sum, occupancy, memory_order_relaxed);
+
+	max = atomic_load_explicit(&q->occupancy_max, memory_order_relaxed);
+	while (occupancy > max
+	    && !atomic_compare_exchange_weak_explicit(&q->occupancy_max, &max, occupancy,
+				memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+/*
+ * Wait for the next job. Returns false once the queue is empty and all
+ * producers are done.
+ */
+static bool
+pqueue_pop(struct pqueue *q, struct pjob **job)
+{
+	if (pqueue_try_pop(q, job))
+		return true;
+
+	atomic_fetch_add_explicit(&q->empty_stalls, 1, memory_order_relaxed);
+	while (true) {
+		if (pqueue_try_pop(q, job))
+			return true;
+		if (atomic_load(&q->producers) == 0)
+			return pqueue_try_pop(q, job);
+		pwait_until(&q->wait, pqueue_has_job, q);
+	}
+}
+
+static void
+pqueue_close(struct pqueue *q)
+{
+	atomic_fetch_sub(&q->producers, 1);
+	pwait_wake(&q->wait);
+}
+
+static void
+pqueue_stats_add(struct pqueue_stats *stats, struct pqueue *q)
+{
+	unsigned long max = atomic_load(&q->occupancy_max);
+
+	stats->pushed += atomic_load(&q->pushed);
+	stats->occupancy_sum += atomic_load(&q->occupancy_sum);
+	if (max > stats->occupancy_max)
+		stats->occupancy_max = max;
+	stats->full_stalls += atomic_load(&q->full_stalls);
+	stats->empty_stalls += atomic_load(&q->empty_stalls);
+}
+
+static void
+pqueue_stats_print(FILE *fp, const char *name, const struct pqueue_stats *stats)
+{
+	fprintf(fp, "  %-8s queue: %8lu jobs, occupancy avg %6.1f max %4lu/%u, producer stalls %lu, consumer stalls %lu\n",
+			name, stats->pushed,
+			stats->pushed? (double) stats->occupancy_sum / stats->pushed : 0.0,
+			stats->occupancy_max, PQUEUE_SIZE,
+			stats->full_stalls, stats->empty_stalls);
+}
+
+void
+pipeline_set_layout_order(bool enable)
+{
+	pipeline_layout_order = enable;
+}
+
+/*
+ * The stages
+ */
+static void
+pipeline_run_stage(struct pipeline *pipe, bool (*fn)(struct pjob *), struct pjob *job)
+{
+	if (!job->failed && !fn(job)) {
+		job->failed = true;
+		atomic_store(&pipe->failed, true);
+	}
+}
+
+static int
+pjob_layout_compare(const void *a, const void *b)
+{
+	const struct pjob *ja = *(const struct pjob **) a;
+	const struct pjob *jb = *(const struct pjob **) b;
+
+	if (ja->old_location != jb->old_location)
+		return (ja->old_location < jb->old_location)? -1 : 1;
+	if (ja->new_location != jb->new_location)
+		return (ja->new_location < jb->new_location)? -1 : 1;
+	return (ja->seq < jb->seq)? -1 : 1;
+}
+
+static void
+pipeline_flush_batch(struct pipeline *pipe)
+{
+	unsigned int i;
+
+	if (pipe->batch_count == 0)
+		return;
+
+	qsort(pipe->batch, pipe->batch_count, sizeof(pipe->batch[0]), pjob_layout_compare);
+	for (i = 0; i < pipe->batch_count; ++i)
+		pqueue_push(&pipe->content_queue, pipe->batch[i]);
+
+	pipe->batch_count = 0;
+	pipeline_stats.batches++;
+}
+
+/*
+ * Look up where the files are located on disk. Files we cannot locate
+ * (for instance, because they are empty) sort first.
+ */
+static void
+pipeline_add_to_batch(struct pipeline *pipe, struct pjob *job)
+{
+	if (job->single) {
+		/* entries on one side only are read for the media index */
+		if (fstate_physical_location(job->old? job->old : job->new, &job->old_location)) {
+			job->new_location = job->old_location;
+			pipeline_stats.located++;
+		}
+	} else if (fstate_physical_location(job->old, &job->old_location)
+		&& fstate_physical_location(job->new, &job->new_location)) {
+		pipeline_stats.located++;
+	}
+
+	pipe->batch[pipe->batch_count++] = job;
+	if (pipe->batch_count >= PIPELINE_BATCH_SIZE)
+		pipeline_flush_batch(pipe);
+}
+
+static void *
+pipeline_metadata_thread(void *arg)
+{
+	struct pipeline *pipe = arg;
+	struct pjob *job;
+
+	while (true) {
+		if (!pqueue_try_pop(&pipe->metadata_queue, &job)) {
+			/* don't sit on a batch while waiting for the walker */
+			pipeline_flush_batch(pipe);
+			if (!pqueue_pop(&pipe->metadata_queue, &job))
+				break;
+		}
+
+		pipeline_run_stage(pipe, pipe->ops->metadata, job);
+
+		if (!job->compare_content || job->failed)
+			pqueue_push(&pipe->report_queue, job);
+		else if (pipeline_layout_order)
+			pipeline_add_to_batch(pipe, job);
+		else
+			pqueue_push(&pipe->content_queue, job);
+	}
+
+	pipeline_flush_batch(pipe);
+	pqueue_close(&pipe->content_queue);
+	pqueue_close(&pipe->report_queue);
+	return NULL;
+}
+
+static void *
+pipeline_content_thread(void *arg)
+{
+	struct pipeline *pipe = arg;
+	struct pjob *job;
+
+	while (pqueue_pop(&pipe->content_queue, &job)) {
+		pipeline_run_stage(pipe, pipe->ops->content, job);
+		pqueue_push(&pipe->report_queue, job);
+	}
+
+	pqueue_close(&pipe->report_queue);
+	return NULL;
+}
+
+static void *
+pipeline_writer_thread(void *arg)
+{
+	struct pipeline *pipe = arg;
+	unsigned long next = 0, pending = 0;
+	struct pjob *job;
+
+	while (pqueue_pop(&pipe->report_queue, &job)) {
+		pipe->reorder[job->seq % PIPELINE_WINDOW] = job;
+		pending++;
+
+		pipe->reorder_sum += pending;
+		if (pending > pipe->reorder_max)
+			pipe->reorder_max = pending;
+
+		while ((job = pipe->reorder[next % PIPELINE_WINDOW]) != NULL) {
+			pipe->reorder[next % PIPELINE_WINDOW] = NULL;
+			pending--;
+
+			if (!pipe->ops->report(pipe->report, job))
+				atomic_store(&pipe->failed, true);
+
+			atomic_store_explicit(&pipe->reported, ++next, memory_order_release);
+			pwait_wake(&pipe->window_wait);
+		}
+	}
+
+	return NULL;
+}
+
+struct pipeline *
+pipeline_new(const struct pipeline_ops *ops, struct report *report, unsigned int nworkers)
+{
+	struct pipeline *pipe;
+	unsigned int i;
+
+	if (nworkers == 0)
+		nworkers = 1;
+
+	pipe = calloc(1, sizeof(*pipe));
+	pipe->ops = ops;
+	pipe->report = report;
+	pipe->nworkers = nworkers;
+
+	pwait_init(&pipe->window_wait);
+	pqueue_init(&pipe->metadata_queue, 1);
+	pqueue_init(&pipe->content_queue, 1);
+	pqueue_init(&pipe->report_queue, 1 + nworkers);
+
+	pthread_create(&pipe->metadata_thread, NULL, pipeline_metadata_thread, pipe);
+
+	pipe->workers = calloc(nworkers, sizeof(pipe->workers[0]));
+	for (i = 0; i < nworkers; ++i)
+		pthread_create(&pipe->workers[i], NULL, pipeline_content_thread, pipe);
+
+	pthread_create(&pipe->writer_thread, NULL, pipeline_writer_thread, pipe);
+	return pipe;
+}
+
+/*
+ * Hand a job to the pipeline. The pipeline takes ownership; the report
+ * stage is responsible for freeing it.
+ */
+static bool
+pipeline_window_open(void *arg)
+{
+	struct pipeline *pipe = arg;
+
+	return pipe->submitted - atomic_load_explicit(&pipe->reported, memory_order_acquire) < PIPELINE_WINDOW;
+}
+
+void
+pipeline_submit(struct pipeline *pipe, struct pjob *job)
+{
+	if (!pipeline_window_open(pipe)) {
+		pipe->window_stalls++;
+		pwait_until(&pipe->window_wait, pipeline_window_open, pipe);
+	}
+	job->seq = pipe->submitted++;
+
+	pqueue_push(&pipe->metadata_queue, job);
+}
+
+/*
+ * Wait for all submitted jobs to be reported, and tear down the pipeline.
+ * Returns false if any stage failed.
+ */
+bool
+pipeline_finish(struct pipeline *pipe)
+{
+	unsigned int i;
+	bool status;
+
+	pqueue_close(&pipe->metadata_queue);
+
+	pthread_join(pipe->metadata_thread, NULL);
+	for (i = 0; i < pipe->nworkers; ++i)
+		pthread_join(pipe->workers[i], NULL);
+	pthread_join(pipe->writer_thread, NULL);
+
+	pipeline_stats.runs++;
+	pipeline_stats.nworkers = pipe->nworkers;
+	pipeline_stats.jobs += pipe->submitted;
+	pipeline_stats.window_stalls += pipe->window_stalls;
+	pipeline_stats.reorder_sum += pipe->reorder_sum;
+	if (pipe->reorder_max > pipeline_stats.reorder_max)
+		pipeline_stats.reorder_max = pipe->reorder_max;
+	pqueue_stats_add(&pipeline_stats.metadata, &pipe->metadata_queue);
+	pqueue_stats_add(&pipeline_stats.content, &pipe->content_queue);
+	pqueue_stats_add(&pipeline_stats.report, &pipe->report_queue);
+
+	status = !atomic_load(&pipe->failed);
+	pqueue_destroy(&pipe->metadata_queue);
+	pqueue_destroy(&pipe->content_queue);
+	pqueue_destroy(&pipe->report_queue);
+	pwait_destroy(&pipe->window_wait);
+	free(pipe->workers);
+	free(pipe);
+	return status;
+}
+
+void
+pipeline_print_stats(FILE *fp)
+{
+	fprintf(fp, "Pipeline statistics: %lu jobs in %u run(s), %u content comparator(s)\n",
+			pipeline_stats.jobs, pipeline_stats.runs, pipeline_stats.nworkers);
+	pqueue_stats_print(fp, "metadata", &pipeline_stats.metadata);
+	pqueue_stats_print(fp, "content", &pipeline_stats.content);
+	pqueue_stats_print(fp, "report", &pipeline_stats.report);
+	fprintf(fp, "  reorder window: occupancy avg %6.1f max %4lu/%u, walker stalls %lu\n",
+			pipeline_stats.jobs? (double) pipeline_stats.reorder_sum / pipeline_stats.jobs : 0.0,
+			pipeline_stats.reorder_max, PIPELINE_WINDOW,
+			pipeline_stats.window_stalls);
+	if (pipeline_layout_order)
+		fprintf(fp, "  layout order: %lu batches, %lu file pairs located on disk\n",
+				pipeline_stats.batches, pipeline_stats.located);
+}
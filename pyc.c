@@ -0,0 +1,85 @@
+/*
+ * ftreecmp
+ *
+ * Python bytecode files.
+ *
+ * The header of a .pyc file records the mtime and size of the source file
+ * it was compiled from, so it changes with every rebuild even if the code
+ * object that follows does not. Since Python 3.7 (PEP 552), the header can
+ * hold a hash of the source instead; in that case, nothing is volatile.
+ *
+ * Header layouts:
+ *   Python 2, 3.0 - 3.2:	magic, mtime
+ *   Python 3.3 - 3.6:	magic, mtime, source size
+ *   Python 3.7+:	magic, flags, mtime, source size	(flags == 0)
+ *			magic, flags, source hash		(flags & 1)
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fstate.h"
+
+#define PYC_HEADER_LEN		16
+
+/*
+ * First magic numbers of the respective header layouts. Python 3 started
+ * over at 3000; the magic numbers of Python 2 (20121 to 62211) are all
+ * above that.
+ */
+#define PYC_MAGIC_PY33		3190
+#define PYC_MAGIC_PY37		3390
+#define PYC_MAGIC_PY2		20000
+
+static bool
+pyc_has_suffix(const char *path)
+{
+	size_t len = strlen(path);
+
+	return len > 4 && (!strcmp(path + len - 4, ".pyc") || !strcmp(path + len - 4, ".pyo"));
+}
+
+/*
+ * If this is a timestamp based .pyc file, add the source mtime and size
+ * to the set of ranges to ignore. Returns false if the file is not a .pyc
+ * file, or has no volatile fields.
+ */
+bool
+pyc_identify_ignore_ranges(int fd, const char *path, unsigned int classes, struct ignore_set *set)
+{
+	unsigned char hdr[PYC_HEADER_LEN];
+	unsigned int magic;
+	ssize_t n;
+
+	memset(set, 0, sizeof(*set));
+
+	if (!(classes & PYC_IGNORE_TIMESTAMP) || !pyc_has_suffix(path))
+		return false;
+
+	/* The header is in the first page we read anyway */
+	if ((n = pread(fd, hdr, sizeof(hdr), 0)) < 8)
+		return false;
+
+	if (hdr[2] != '\r' || hdr[3] != '\n')
+		return false;
+	magic = hdr[0] | (hdr[1] << 8);
+
+	if (magic < PYC_MAGIC_PY33 || magic >= PYC_MAGIC_PY2) {
+		ignore_set_add(set, 4, 4);
+	} else if (magic < PYC_MAGIC_PY37) {
+		if (n >= 12)
+			ignore_set_add(set, 4, 8);
+	} else if (n >= 16) {
+		uint32_t flags = hdr[4] | (hdr[5] << 8) | (hdr[6] << 16) | ((uint32_t) hdr[7] << 24);
+
+		/* hash based pycs have nothing to ignore */
+		if (flags == 0)
+			ignore_set_add(set, 8, 8);
+	}
+
+	return set->count != 0;
+}
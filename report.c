@@ -12,12 +12,24 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <limits.h>
 
 #include "fstate.h"
 
+struct report_hole {
+	off_t		offset;
+	void *		entry;
+};
+
 struct report {
 	char *		package_name;
 	unsigned int	lines_written;
+	FILE *		out;
+
+	/* once an entry is held back, everything after it goes to the spool */
+	FILE *		spool;
+	unsigned int	nholes;
+	struct report_hole *holes;
 };
 
 static void		__render_change_bit_legend(struct report *report);
@@ -32,6 +44,7 @@ report_new(const char *package_name)
 
 	report = calloc(1, sizeof(*report));
 	report->package_name = strdup(package_name);
+	report->out = stdout;
 	return report;
 }
 
@@ -53,11 +66,146 @@ report_printf(struct report *report, const char *fmt, ...)
 	va_list ap;
 
 	if (!report->lines_written++)
-		printf("%s: file changes\n", report->package_name);
+		fprintf(report->out, "%s: file changes\n", report->package_name);
+
+	va_start(ap, fmt);
+	vfprintf(report->out, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Print additional information about the entry reported last, on a
+ * line of its own
+ */
+void
+report_detail(struct report *report, const char *fmt, ...)
+{
+	va_list ap;
+
+	report_printf(report, "%-12s ", "");
 
 	va_start(ap, fmt);
-	vprintf(fmt, ap);
+	vfprintf(report->out, fmt, ap);
 	va_end(ap);
+
+	fputc('\n', report->out);
+}
+
+/*
+ * Hold back an entry that cannot be reported yet, and keep its place in
+ * the report. Everything reported after it is spooled to a temporary
+ * file until report_release() fills in the held entries.
+ */
+bool
+report_hold(struct report *report, void *entry)
+{
+	struct report_hole *hole;
+
+	if (report->spool == NULL) {
+		if (!(report->spool = tmpfile())) {
+			fprintf(stderr, "Error: unable to create report spool: %m\n");
+			return false;
+		}
+		report->out = report->spool;
+	}
+
+	/* a held entry is always reported, either as is or as moved */
+	if (!report->lines_written++)
+		fprintf(report->out, "%s: file changes\n", report->package_name);
+
+	if ((report->nholes % 64) == 0)
+		report->holes = reallocarray(report->holes, report->nholes + 64, sizeof(report->holes[0]));
+	hole = &report->holes[report->nholes++];
+	hole->offset = ftello(report->spool);
+	hole->entry = entry;
+	return true;
+}
+
+/*
+ * Copy count bytes of the spool to stdout, or everything that's left
+ * if count is negative
+ */
+static bool
+report_copy_spool(struct report *report, off_t count)
+{
+	char buffer[65536];
+	size_t n, want;
+
+	while (count != 0) {
+		want = sizeof(buffer);
+		if (count > 0 && (off_t) want > count)
+			want = count;
+
+		if ((n = fread(buffer, 1, want, report->spool)) == 0)
+			break;
+		fwrite(buffer, 1, n, stdout);
+		if (count > 0)
+			count -= n;
+	}
+
+	if (ferror(report->spool)) {
+		fprintf(stderr, "Error: unable to read report spool: %m\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Write out the spooled report, invoking fn for every held entry in its
+ * place
+ */
+bool
+report_release(struct report *report, report_held_fn_t *fn, void *user)
+{
+	off_t pos = 0;
+	bool status = true;
+	unsigned int i;
+
+	if (report->spool == NULL)
+		return true;
+
+	fflush(report->spool);
+	rewind(report->spool);
+	report->out = stdout;
+
+	for (i = 0; i < report->nholes; ++i) {
+		struct report_hole *hole = &report->holes[i];
+
+		if (!report_copy_spool(report, hole->offset - pos))
+			status = false;
+		pos = hole->offset;
+
+		if (!fn(report, hole->entry, user))
+			status = false;
+	}
+
+	if (!report_copy_spool(report, -1))
+		status = false;
+
+	fclose(report->spool);
+	report->spool = NULL;
+	free(report->holes);
+	report->holes = NULL;
+	report->nholes = 0;
+	return status;
+}
+
+/*
+ * Print a unified diff below the entry reported last, one detail line per
+ * line of the diff
+ */
+void
+report_diff(struct report *report, const char *diff)
+{
+	while (*diff) {
+		const char *nl = strchr(diff, '\n');
+		int len = nl? nl - diff : (int) strlen(diff);
+
+		report_detail(report, "%.*s", len, diff);
+		diff += len;
+		if (*diff)
+			diff++;
+	}
 }
 
 static char
@@ -137,58 +285,58 @@ symbolic_permissions(unsigned long mode)
 }
 
 static char *
-__render_attrs(const struct stat *stb)
+__render_attrs(const struct finode *inode)
 {
 	static char buffer[128];
 
 	snprintf(buffer, sizeof(buffer),
 			"%s uid %03u gid %03u",
-			symbolic_permissions(stb->st_mode),
-			stb->st_uid, stb->st_gid);
+			symbolic_permissions(inode->mode),
+			inode->uid, inode->gid);
 	return buffer;
 }
 
 static void
-__report_inode(struct report *report, const char *pfx, struct fstate *fs)
+__report_inode(struct report *report, const char *pfx, struct fstate *fs, const char *path)
 {
-	const struct stat *stb = fs->stb;
+	const struct finode *inode = fs->inode;
 
 	report_printf(report, "%-12s %s               %s\n",
-			pfx, __render_attrs(stb),
-			fstate_path(fs));
+			pfx, __render_attrs(inode),
+			path);
 }
 
 static void
-__report_regular_file(struct report *report, const char *pfx, struct fstate *fs)
+__report_regular_file(struct report *report, const char *pfx, struct fstate *fs, const char *path)
 {
-	const struct stat *stb = fs->stb;
+	const struct finode *inode = fs->inode;
 
 	report_printf(report, "%-12s %s %13lu %s\n",
-			pfx, __render_attrs(stb),
-			(unsigned long) stb->st_size,
-			fstate_path(fs));
+			pfx, __render_attrs(inode),
+			(unsigned long) inode->size,
+			path);
 }
 
 static void
-__report_symlink(struct report *report, const char *pfx, struct fstate *fs)
+__report_symlink(struct report *report, const char *pfx, struct fstate *fs, const char *path)
 {
 	const char *dest = fs->link_dest;
-	struct stat *stb = fs->stb;
+	const struct finode *inode = fs->inode;
 
 	report_printf(report, "%-12s %s               %s -> %s\n",
-			pfx, __render_attrs(stb),
-			fstate_path(fs), dest);
+			pfx, __render_attrs(inode),
+			path, dest);
 }
 
 static void
-__report_device(struct report *report, const char *pfx, struct fstate *fs)
+__report_device(struct report *report, const char *pfx, struct fstate *fs, const char *path)
 {
-	struct stat *stb = fs->stb;
+	const struct finode *inode = fs->inode;
 
 	report_printf(report, "%-12s %s dev %04x:%04x %s\n",
-			pfx, __render_attrs(stb),
-			major(stb->st_rdev), minor(stb->st_rdev),
-			fstate_path(fs));
+			pfx, __render_attrs(inode),
+			major(inode->rdev), minor(inode->rdev),
+			path);
 }
 
 const char *
@@ -201,7 +349,9 @@ __render_change_bits(int how)
 	buf[i++] = ' ';
 	buf[i++] = ' ';
 
-	if (how & FSTATE_CHANGED_ADDED)
+	if (how & FSTATE_CHANGED_MOVED)
+		buf[i++] = '>';
+	else if (how & FSTATE_CHANGED_ADDED)
 		buf[i++] = '+';
 	else if (how & FSTATE_CHANGED_REMOVED)
 		buf[i++] = '-';
@@ -211,7 +361,12 @@ __render_change_bits(int how)
 
 	buf[i++] = change_bit_to_sym(how, FSTATE_CHANGED_CRIT, 'C');
 	buf[i++] = change_bit_to_sym(how, FSTATE_CHANGED_MODE, 'M');
-	buf[i++] = change_bit_to_sym(how, FSTATE_CHANGED_DATA, 'D');
+	if (how & FSTATE_CHANGED_CONTAINER)
+		buf[i++] = 'Z';
+	else if (how & FSTATE_CHANGED_SIGNATURE)
+		buf[i++] = 'S';
+	else
+		buf[i++] = change_bit_to_sym(how, FSTATE_CHANGED_DATA, 'D');
 	buf[i++] = ' ';
 
 	buf[i] = '\0';
@@ -224,41 +379,77 @@ __render_change_bit_legend(struct report *report)
 	report_printf(report, "\nDescription of change bits:\n");
 	report_printf(report, " +   added\n");
 	report_printf(report, " -   removed\n");
+	report_printf(report, " >   moved (identical content and attributes, different path)\n");
 	report_printf(report, " C   critical change (file type, owner, set*id bits etc)\n");
 	report_printf(report, " M   mode change (file permissions)\n");
 	report_printf(report, " D   data change (file content, symlink target, device major/minor)\n");
+	report_printf(report, " Z   container change (compressed data or archive differs, contents are identical)\n");
+	report_printf(report, " S   signature change (kernel module signature differs, module is identical)\n");
 	report_printf(report, "\n");
 }
 
-bool
-report_changed_file(struct report *report, int how, struct fstate *fs)
+static bool
+__report_entry(struct report *report, int how, struct fstate *fs, const char *path)
 {
-	const struct stat *stb;
 	const char *pfx;
 
-	if (!(stb = fstate_stat(fs)))
+	if (!fstate_stat(fs))
 		return false;
 
 	pfx = __render_change_bits(how);
 
 	switch (fs->type) {
 	case DT_REG:
-		__report_regular_file(report, pfx, fs);
+		__report_regular_file(report, pfx, fs, path);
 		break;
 	case DT_LNK:
 		if (!fstate_readlink(fs))
 			return false;
-		__report_symlink(report, pfx, fs);
+		__report_symlink(report, pfx, fs, path);
 		break;
 	case DT_CHR:
 	case DT_BLK:
-		__report_device(report, pfx, fs);
+		__report_device(report, pfx, fs, path);
 		break;
 	default:
-		__report_inode(report, pfx, fs);
+		__report_inode(report, pfx, fs, path);
 		break;
 	}
 
 	return true;
 }
 
+bool
+report_changed_file(struct report *report, int how, struct fstate *fs)
+{
+	return __report_entry(report, how, fs, fstate_path(fs));
+}
+
+/*
+ * Report a file or directory that was moved without any change. This
+ * shows up as a single line "old_path => new_path"
+ */
+bool
+report_moved_file(struct report *report, struct fstate *old, struct fstate *new)
+{
+	char pathbuf[2 * PATH_MAX + 8];
+
+	snprintf(pathbuf, sizeof(pathbuf), "%s => %s", fstate_path(old), fstate_path(new));
+	return __report_entry(report, FSTATE_CHANGED_MOVED, new, pathbuf);
+}
+
+/*
+ * Report a directory that was added or removed with everything below it,
+ * in a single line
+ */
+bool
+report_changed_tree(struct report *report, int how, struct fstate *fs, const struct fsummary *sum)
+{
+	char pathbuf[PATH_MAX + 256];
+
+	snprintf(pathbuf, sizeof(pathbuf),
+			"%s/ (%lu entries, %llu bytes: %lu files, %lu dirs, %lu symlinks, %lu other)",
+			fstate_path(fs), sum->entries, sum->bytes,
+			sum->files, sum->dirs, sum->symlinks, sum->other);
+	return __report_entry(report, how, fs, pathbuf);
+}
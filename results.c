@@ -0,0 +1,263 @@
+/*
+ * ftreeresults
+ *
+ * Store for the results of comparing a set of packages.
+ *
+ * verify-one-directory used to write one text file per package, and
+ * looked at each of them to decide whether a package had been compared
+ * already. With several thousand packages per architecture, that's a lot
+ * of tiny files. Instead, we keep all results in a single on-disk hash
+ * table, with two kinds of records:
+ *
+ *  - keyed by package name: the verdict and the zstd compressed output
+ *    of the comparison
+ *  - keyed by verdict: the package name
+ *
+ * Records are only ever appended. The verdict record is written first,
+ * and the package record last, and each record is on disk before it is
+ * linked into its hash chain. If we crash, the package either has a
+ * complete result or none at all; at worst, there is a stale verdict
+ * record, which is ignored because it does not match the package record.
+ * If a package is recorded more than once, the most recent result wins.
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <zstd.h>
+
+#include "fstate.h"
+
+#define RESULTS_KEY_PACKAGE	'P'
+#define RESULTS_KEY_VERDICT	'V'
+
+#define RESULTS_NAME_MAX	1024
+#define RESULTS_ZSTD_LEVEL	9
+
+struct results {
+	struct hashdb *		db;
+};
+
+struct results *
+results_open(const char *path, bool writable)
+{
+	struct results *res;
+	struct hashdb *db;
+
+	if (!(db = hashdb_open(path, writable)))
+		return NULL;
+
+	/* results are precious; every record must be on disk before it is linked */
+	if (writable)
+		hashdb_set_sync(db, true);
+
+	res = calloc(1, sizeof(*res));
+	res->db = db;
+	return res;
+}
+
+void
+results_close(struct results *res)
+{
+	hashdb_close(res->db);
+	free(res);
+}
+
+static size_t
+results_make_key(unsigned char *key, int type, const char *name)
+{
+	size_t len = strlen(name);
+
+	key[0] = type;
+	memcpy(key + 1, name, len);
+	return 1 + len;
+}
+
+/*
+ * Record the result for a package. The body is the output of the
+ * comparison, which is stored compressed.
+ */
+bool
+results_add(struct results *res, const char *package, const char *verdict, const void *body, size_t len)
+{
+	unsigned char key[1 + RESULTS_NAME_MAX];
+	size_t keylen, vlen, bound, zlen;
+	uint64_t body_len = len;
+	unsigned char *data;
+	bool ok = false;
+
+	if (strlen(package) >= RESULTS_NAME_MAX || strlen(verdict) >= RESULTS_NAME_MAX) {
+		fprintf(stderr, "Error: package name or verdict too long\n");
+		return false;
+	}
+
+	keylen = results_make_key(key, RESULTS_KEY_VERDICT, verdict);
+	if (!hashdb_insert(res->db, key, keylen, package, strlen(package)))
+		return false;
+
+	vlen = strlen(verdict) + 1;
+	bound = ZSTD_compressBound(len);
+	data = malloc(vlen + sizeof(body_len) + bound);
+
+	memcpy(data, verdict, vlen);
+	memcpy(data + vlen, &body_len, sizeof(body_len));
+
+	zlen = ZSTD_compress(data + vlen + sizeof(body_len), bound, body, len, RESULTS_ZSTD_LEVEL);
+	if (ZSTD_isError(zlen)) {
+		fprintf(stderr, "Error: unable to compress result for %s: %s\n", package, ZSTD_getErrorName(zlen));
+		goto out;
+	}
+
+	keylen = results_make_key(key, RESULTS_KEY_PACKAGE, package);
+	ok = hashdb_insert(res->db, key, keylen, data, vlen + sizeof(body_len) + zlen);
+
+out:
+	free(data);
+	return ok;
+}
+
+struct results_record {
+	char *			data;
+	size_t			len;
+};
+
+static bool
+results_found(const void *key, size_t keylen, const void *data, size_t datalen, void *user)
+{
+	struct results_record *rec = user;
+
+	/* the most recent record wins; we decode it once the lookup is done */
+	free(rec->data);
+	rec->data = malloc(datalen + 1);
+	memcpy(rec->data, data, datalen);
+	rec->data[datalen] = '\0';
+	rec->len = datalen;
+	return true;
+}
+
+/*
+ * Look up the result for a package. Returns the verdict (malloc'ed), or
+ * NULL if the package has not been recorded. If body is not NULL, the
+ * decompressed output of the comparison is returned there, too.
+ */
+char *
+results_lookup(struct results *res, const char *package, char **body, size_t *len)
+{
+	struct results_record rec = { 0 };
+	unsigned char key[1 + RESULTS_NAME_MAX];
+	char *verdict = NULL;
+	uint64_t body_len;
+	size_t keylen, vlen;
+
+	if (strlen(package) >= RESULTS_NAME_MAX)
+		return NULL;
+
+	keylen = results_make_key(key, RESULTS_KEY_PACKAGE, package);
+	if (!hashdb_lookup(res->db, key, keylen, results_found, &rec) || rec.data == NULL)
+		goto out;
+
+	vlen = strnlen(rec.data, rec.len) + 1;
+	if (vlen + sizeof(body_len) > rec.len) {
+		fprintf(stderr, "Error: corrupt result record for %s\n", package);
+		goto out;
+	}
+	memcpy(&body_len, rec.data + vlen, sizeof(body_len));
+
+	if (body) {
+		const char *zdata = rec.data + vlen + sizeof(body_len);
+		char *buf;
+		size_t n;
+
+		buf = malloc(body_len + 1);
+		n = ZSTD_decompress(buf, body_len, zdata, rec.len - vlen - sizeof(body_len));
+		if (ZSTD_isError(n) || n != body_len) {
+			fprintf(stderr, "Error: corrupt result body for %s\n", package);
+			free(buf);
+			goto out;
+		}
+		buf[n] = '\0';
+		*body = buf;
+		*len = body_len;
+	}
+
+	verdict = strdup(rec.data);
+
+out:
+	free(rec.data);
+	return verdict;
+}
+
+struct results_names {
+	unsigned int		count;
+	char **			names;
+};
+
+static bool
+results_collect(const void *key, size_t keylen, const void *data, size_t datalen, void *user)
+{
+	struct results_names *list = user;
+	char *name;
+
+	name = malloc(datalen + 1);
+	memcpy(name, data, datalen);
+	name[datalen] = '\0';
+
+	if ((list->count % 64) == 0)
+		list->names = reallocarray(list->names, list->count + 64, sizeof(list->names[0]));
+	list->names[list->count++] = name;
+	return true;
+}
+
+static int
+results_compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char **) a, *(const char **) b);
+}
+
+/*
+ * Invoke fn for every package whose current verdict is the given one, in
+ * alphabetical order. Packages that were recorded with this verdict, but
+ * have been recorded with a different one since, are skipped.
+ */
+bool
+results_foreach(struct results *res, const char *verdict, bool with_body, results_fn_t *fn, void *user)
+{
+	struct results_names list = { 0 };
+	unsigned char key[1 + RESULTS_NAME_MAX];
+	size_t keylen;
+	unsigned int i;
+	bool status = true;
+
+	if (strlen(verdict) >= RESULTS_NAME_MAX)
+		return false;
+
+	keylen = results_make_key(key, RESULTS_KEY_VERDICT, verdict);
+	if (!hashdb_lookup(res->db, key, keylen, results_collect, &list))
+		status = false;
+
+	qsort(list.names, list.count, sizeof(list.names[0]), results_compare_names);
+
+	for (i = 0; status && i < list.count; ++i) {
+		char *current, *body = NULL;
+		size_t len = 0;
+
+		/* skip duplicates */
+		if (i && !strcmp(list.names[i], list.names[i - 1]))
+			continue;
+
+		current = results_lookup(res, list.names[i], with_body? &body : NULL, &len);
+		if (current && !strcmp(current, verdict))
+			status = fn(list.names[i], current, body, len, user);
+		free(current);
+		free(body);
+	}
+
+	for (i = 0; i < list.count; ++i)
+		free(list.names[i]);
+	free(list.names);
+	return status;
+}
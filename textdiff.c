@@ -0,0 +1,392 @@
+/*
+ * ftreecmp
+ *
+ * Unified diffs of text files.
+ *
+ * When a configuration file or script changes, the reviewer wants to see
+ * what changed without unpacking both packages again. We compute a line
+ * based diff with the linear space variant of Myers' O(ND) algorithm: find
+ * the middle snake of the edit graph, and recurse on both halves. Lines
+ * are compared by hash first. Memory use is linear in the number of lines.
+ *
+ * Like other diff implementations, we do not insist on a minimal diff when
+ * the files are very different: once the edit cost of a split exceeds a
+ * limit (about the square root of the number of lines), we split at the
+ * point that got furthest, which bounds the running time.
+ *
+ * The output is in unified diff format with three lines of context, and is
+ * cut off after a given number of lines.
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "fstate.h"
+
+#define TEXTDIFF_CONTEXT	3
+
+struct textdiff_line {
+	const char *		data;
+	unsigned int		len;		/* without the newline */
+	bool			newline;	/* false for an incomplete last line */
+	uint32_t		hash;
+};
+
+struct textdiff_file {
+	unsigned int		nlines;
+	struct textdiff_line *	lines;
+	bool *			changed;
+};
+
+struct textdiff {
+	struct textdiff_file	old;
+	struct textdiff_file	new;
+
+	/* forward and backward V arrays of Myers' algorithm, indexed by diagonal */
+	int *			vf;
+	int *			vb;
+	int			max_cost;
+
+	/* output */
+	char *			buf;
+	size_t			len;
+	unsigned int		lines_out;
+	unsigned int		max_lines;
+	bool			truncated;
+};
+
+static void
+textdiff_file_init(struct textdiff_file *f, const char *data, size_t size)
+{
+	const char *end = data + size, *p;
+	unsigned int n;
+
+	for (n = 0, p = data; p < end; ++n) {
+		const char *nl = memchr(p, '\n', end - p);
+
+		p = nl? nl + 1 : end;
+	}
+
+	f->nlines = n;
+	f->lines = calloc(n? n : 1, sizeof(f->lines[0]));
+	f->changed = calloc(n? n : 1, sizeof(f->changed[0]));
+
+	for (n = 0, p = data; p < end; ++n) {
+		struct textdiff_line *line = &f->lines[n];
+		const char *nl = memchr(p, '\n', end - p);
+		uint32_t hash = 2166136261u;
+		const char *q;
+
+		line->data = p;
+		line->len = (nl? nl : end) - p;
+		line->newline = (nl != NULL);
+
+		/* FNV-1a */
+		for (q = p; q < p + line->len; ++q)
+			hash = (hash ^ (unsigned char) *q) * 16777619u;
+		line->hash = hash;
+
+		p = nl? nl + 1 : end;
+	}
+}
+
+static void
+textdiff_file_destroy(struct textdiff_file *f)
+{
+	free(f->lines);
+	free(f->changed);
+}
+
+static inline bool
+textdiff_lines_equal(const struct textdiff *td, int i, int j)
+{
+	const struct textdiff_line *a = &td->old.lines[i];
+	const struct textdiff_line *b = &td->new.lines[j];
+
+	return a->hash == b->hash && a->len == b->len && a->newline == b->newline
+	    && !memcmp(a->data, b->data, a->len);
+}
+
+/*
+ * Find the middle snake of the edit graph for old[a0, a1) and new[b0, b1).
+ * On return, the snake runs from (*x0, *y0) to (*x1, *y1); the optimal
+ * path passes through it.
+ */
+static void
+textdiff_split(struct textdiff *td, int a0, int a1, int b0, int b1,
+		int *x0, int *y0, int *x1, int *y1)
+{
+	int N = a1 - a0, M = b1 - b0;
+	int delta = N - M;
+	bool odd = delta & 1;
+	int *vf = td->vf, *vb = td->vb;
+	int D, k;
+
+	vf[1] = 0;
+	vb[1] = 0;
+
+	for (D = 0; D <= (N + M + 1) / 2; ++D) {
+		for (k = -D; k <= D; k += 2) {
+			int x, y, xs, ys;
+
+			if (k == -D || (k != D && vf[k - 1] < vf[k + 1]))
+				x = vf[k + 1];
+			else
+				x = vf[k - 1] + 1;
+			y = x - k;
+
+			xs = x, ys = y;
+			while (x < N && y < M && textdiff_lines_equal(td, a0 + x, b0 + y))
+				x++, y++;
+			vf[k] = x;
+
+			if (odd && delta - k >= -(D - 1) && delta - k <= D - 1
+			 && vf[k] + vb[delta - k] >= N) {
+				*x0 = a0 + xs, *y0 = b0 + ys;
+				*x1 = a0 + x, *y1 = b0 + y;
+				return;
+			}
+		}
+
+		for (k = -D; k <= D; k += 2) {
+			int x, y, xs, ys;
+
+			if (k == -D || (k != D && vb[k - 1] < vb[k + 1]))
+				x = vb[k + 1];
+			else
+				x = vb[k - 1] + 1;
+			y = x - k;
+
+			xs = x, ys = y;
+			while (x < N && y < M && textdiff_lines_equal(td, a1 - x - 1, b1 - y - 1))
+				x++, y++;
+			vb[k] = x;
+
+			if (!odd && delta - k >= -D && delta - k <= D
+			 && vb[k] + vf[delta - k] >= N) {
+				*x0 = a1 - x, *y0 = b1 - y;
+				*x1 = a1 - xs, *y1 = b1 - ys;
+				return;
+			}
+		}
+
+		/* Too expensive; split at the forward point that got furthest */
+		if (D >= td->max_cost) {
+			int best = -1;
+
+			for (k = -D; k <= D; k += 2) {
+				int x = vf[k], y = vf[k] - k;
+
+				if (x > N || y < 0 || y > M || (x == N && y == M))
+					continue;
+				if (x + y > best) {
+					best = x + y;
+					*x0 = *x1 = a0 + x;
+					*y0 = *y1 = b0 + y;
+				}
+			}
+			if (best > 0)
+				return;
+		}
+	}
+
+	/* not reached */
+	*x0 = *x1 = a0;
+	*y0 = *y1 = b0;
+}
+
+static void
+textdiff_compare(struct textdiff *td, int a0, int a1, int b0, int b1)
+{
+	int x0, y0, x1, y1;
+
+	/* skip common prefix and suffix */
+	while (a0 < a1 && b0 < b1 && textdiff_lines_equal(td, a0, b0))
+		a0++, b0++;
+	while (a0 < a1 && b0 < b1 && textdiff_lines_equal(td, a1 - 1, b1 - 1))
+		a1--, b1--;
+
+	if (a0 == a1) {
+		while (b0 < b1)
+			td->new.changed[b0++] = true;
+		return;
+	}
+	if (b0 == b1) {
+		while (a0 < a1)
+			td->old.changed[a0++] = true;
+		return;
+	}
+
+	textdiff_split(td, a0, a1, b0, b1, &x0, &y0, &x1, &y1);
+	textdiff_compare(td, a0, x0, b0, y0);
+	textdiff_compare(td, x1, a1, y1, b1);
+}
+
+static void
+textdiff_printf(struct textdiff *td, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	td->buf = realloc(td->buf, td->len + n + 1);
+
+	va_start(ap, fmt);
+	td->len += vsnprintf(td->buf + td->len, n + 1, fmt, ap);
+	va_end(ap);
+}
+
+static bool
+textdiff_line_out(struct textdiff *td, char tag, const struct textdiff_file *f, unsigned int i)
+{
+	const struct textdiff_line *line = &f->lines[i];
+
+	if (td->lines_out >= td->max_lines) {
+		td->truncated = true;
+		return false;
+	}
+
+	textdiff_printf(td, "%c%.*s\n", tag, (int) line->len, line->data);
+	td->lines_out++;
+
+	if (!line->newline)
+		textdiff_printf(td, "\\ No newline at end of file\n");
+	return true;
+}
+
+/*
+ * Print the hunk covering old[i0, i1) and new[j0, j1).
+ */
+static bool
+textdiff_hunk(struct textdiff *td, unsigned int i0, unsigned int i1, unsigned int j0, unsigned int j1)
+{
+	unsigned int i = i0, j = j0;
+
+	if (td->lines_out >= td->max_lines) {
+		td->truncated = true;
+		return false;
+	}
+
+	textdiff_printf(td, "@@ -%u,%u +%u,%u @@\n",
+			i1 > i0? i0 + 1 : i0, i1 - i0,
+			j1 > j0? j0 + 1 : j0, j1 - j0);
+	td->lines_out++;
+
+	while (i < i1 || j < j1) {
+		if (i < i1 && td->old.changed[i]) {
+			if (!textdiff_line_out(td, '-', &td->old, i++))
+				return false;
+		} else if (j < j1 && td->new.changed[j]) {
+			if (!textdiff_line_out(td, '+', &td->new, j++))
+				return false;
+		} else {
+			if (!textdiff_line_out(td, ' ', &td->old, i))
+				return false;
+			i++, j++;
+		}
+	}
+
+	return true;
+}
+
+static void
+textdiff_output(struct textdiff *td)
+{
+	unsigned int n_old = td->old.nlines, n_new = td->new.nlines;
+	unsigned int i = 0, j = 0;
+
+	while (i < n_old || j < n_new) {
+		unsigned int hi0, hj0, hi1, hj1, common;
+
+		/* skip to the next change */
+		while (i < n_old && j < n_new && !td->old.changed[i] && !td->new.changed[j])
+			i++, j++;
+		if (i >= n_old && j >= n_new)
+			break;
+
+		hi0 = (i > TEXTDIFF_CONTEXT)? i - TEXTDIFF_CONTEXT : 0;
+		hj0 = j - (i - hi0);
+
+		/* extend the hunk as long as changes are close together */
+		while (true) {
+			while (i < n_old && td->old.changed[i])
+				i++;
+			while (j < n_new && td->new.changed[j])
+				j++;
+
+			for (common = 0; i + common < n_old && j + common < n_new
+					&& !td->old.changed[i + common] && !td->new.changed[j + common]; ++common)
+				;
+
+			if (i + common >= n_old && j + common >= n_new) {
+				/* trailing context up to the end of both files */
+				if (common > TEXTDIFF_CONTEXT)
+					common = TEXTDIFF_CONTEXT;
+				break;
+			}
+			if (common > 2 * TEXTDIFF_CONTEXT) {
+				common = TEXTDIFF_CONTEXT;
+				break;
+			}
+			i += common;
+			j += common;
+		}
+
+		hi1 = i + common;
+		hj1 = j + common;
+		if (!textdiff_hunk(td, hi0, hi1, hj0, hj1))
+			break;
+		i = hi1;
+		j = hj1;
+	}
+
+	if (td->truncated)
+		textdiff_printf(td, "[diff truncated after %u lines]\n", td->max_lines);
+}
+
+/*
+ * Compute a unified diff of two text buffers. Returns a malloc'ed string
+ * with one line per diff line, or NULL if the buffers are identical.
+ */
+char *
+textdiff_unified(const char *old, size_t old_size, const char *new, size_t new_size, unsigned int max_lines)
+{
+	struct textdiff td;
+	size_t vsize;
+
+	memset(&td, 0, sizeof(td));
+	td.max_lines = max_lines;
+
+	textdiff_file_init(&td.old, old, old_size);
+	textdiff_file_init(&td.new, new, new_size);
+
+	/* diagonals range from -(N + M) to N + M */
+	vsize = 2 * ((size_t) td.old.nlines + td.new.nlines) + 3;
+	td.vf = malloc(vsize * sizeof(int));
+	td.vb = malloc(vsize * sizeof(int));
+	td.vf += vsize / 2;
+	td.vb += vsize / 2;
+
+	for (td.max_cost = 1; (size_t) td.max_cost * td.max_cost < vsize / 2; td.max_cost <<= 1)
+		;
+	if (td.max_cost < 256)
+		td.max_cost = 256;
+
+	textdiff_compare(&td, 0, td.old.nlines, 0, td.new.nlines);
+
+	textdiff_output(&td);
+
+	free(td.vf - vsize / 2);
+	free(td.vb - vsize / 2);
+	textdiff_file_destroy(&td.old);
+	textdiff_file_destroy(&td.new);
+	return td.buf;
+}
@@ -0,0 +1,219 @@
+/*
+ * ftreecmp
+ *
+ * Persistent cache of comparison verdicts.
+ *
+ * The same content shows up in many packages (flavors of the kernel,
+ * noarch packages built for every architecture), and in every run over
+ * the same media. Once the plain comparison has found two files to differ,
+ * looking inside them (decompressing, comparing archives entry by entry,
+ * comparing ELF sections and exported symbols) is by far the most
+ * expensive part of the comparison. We remember the outcome in an on-disk
+ * hash table, keyed by the digests of both files and the options that
+ * affect the outcome, so that this is done only once for each pair. The
+ * key also carries a version, so that verdicts reached by an older way
+ * of comparing are not used.
+ *
+ * The record data is the change bits, followed by the container name and
+ * the lists of differing archive entries, sections and exported symbols,
+ * each NUL terminated (empty if not set).
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "fstate.h"
+
+#define VCACHE_KEY_VERDICT	'V'
+
+/* Bump this whenever the way we look inside files changes */
+#define VCACHE_VERSION		2
+
+/* Change bits that are decided by the normalized comparison */
+#define VCACHE_HOW_MASK		(FSTATE_CHANGED_DATA | FSTATE_CHANGED_CONTAINER)
+
+struct vcache {
+	struct hashdb *		db;
+	pthread_mutex_t		lock;
+	uint32_t		options;
+};
+
+struct vcache_key {
+	unsigned char		type;
+	unsigned char		version;
+	unsigned char		old_md[DIGEST_SIZE];
+	unsigned char		new_md[DIGEST_SIZE];
+	unsigned char		options[4];
+};
+
+static atomic_ulong		vcache_hits;
+static atomic_ulong		vcache_misses;
+
+/*
+ * Open the cache. options is a bitmask of everything that changes the
+ * verdict for a given pair of files (ignore classes and comparison modes).
+ */
+struct vcache *
+vcache_open(const char *path, uint32_t options)
+{
+	struct vcache *vc;
+	struct hashdb *db;
+
+	if (!(db = hashdb_open(path, true)))
+		return NULL;
+
+	vc = calloc(1, sizeof(*vc));
+	vc->db = db;
+	vc->options = options;
+	pthread_mutex_init(&vc->lock, NULL);
+	return vc;
+}
+
+void
+vcache_close(struct vcache *vc)
+{
+	hashdb_close(vc->db);
+	pthread_mutex_destroy(&vc->lock);
+	free(vc);
+}
+
+static void
+vcache_make_key(const struct vcache *vc, const unsigned char *old_md, const unsigned char *new_md,
+		struct vcache_key *key)
+{
+	key->type = VCACHE_KEY_VERDICT;
+	key->version = VCACHE_VERSION;
+	memcpy(key->old_md, old_md, DIGEST_SIZE);
+	memcpy(key->new_md, new_md, DIGEST_SIZE);
+	key->options[0] = vc->options;
+	key->options[1] = vc->options >> 8;
+	key->options[2] = vc->options >> 16;
+	key->options[3] = vc->options >> 24;
+}
+
+struct vcache_record {
+	char *			data;
+	size_t			len;
+};
+
+static bool
+vcache_found(const void *key, size_t keylen, const void *data, size_t datalen, void *user)
+{
+	struct vcache_record *rec = user;
+
+	/* the most recent record wins */
+	free(rec->data);
+	rec->data = malloc(datalen + 1);
+	memcpy(rec->data, data, datalen);
+	rec->data[datalen] = '\0';
+	rec->len = datalen;
+	return true;
+}
+
+/* Return the next string of the record, or NULL if it's empty */
+static char *
+vcache_next_string(char **pos, const char *end)
+{
+	char *s = *pos;
+
+	if (s >= end)
+		return NULL;
+	*pos += strlen(s) + 1;
+	return *s? s : NULL;
+}
+
+static char *
+vcache_strdup(const char *s)
+{
+	return s? strdup(s) : NULL;
+}
+
+/*
+ * Look up the verdict for a pair of files. On success, the change bits and
+ * details of the job are set as if the comparison had been done. The job
+ * keeps the record, because job->container points into it.
+ */
+bool
+vcache_lookup(struct vcache *vc, const unsigned char *old_md, const unsigned char *new_md, struct pjob *job)
+{
+	struct vcache_record rec = { NULL, 0 };
+	struct vcache_key key;
+	char *pos, *end;
+	uint32_t how;
+
+	vcache_make_key(vc, old_md, new_md, &key);
+
+	pthread_mutex_lock(&vc->lock);
+	hashdb_lookup(vc->db, &key, sizeof(key), vcache_found, &rec);
+	pthread_mutex_unlock(&vc->lock);
+
+	if (rec.data == NULL || rec.len < sizeof(how)) {
+		free(rec.data);
+		atomic_fetch_add(&vcache_misses, 1);
+		return false;
+	}
+
+	memcpy(&how, rec.data, sizeof(how));
+	pos = rec.data + sizeof(how);
+	end = rec.data + rec.len;
+
+	job->how = (job->how & ~VCACHE_HOW_MASK) | (how & VCACHE_HOW_MASK);
+	job->container = vcache_next_string(&pos, end);
+	job->diff_entries = vcache_strdup(vcache_next_string(&pos, end));
+	job->diff_sections = vcache_strdup(vcache_next_string(&pos, end));
+	job->diff_exports = vcache_strdup(vcache_next_string(&pos, end));
+	job->cached_verdict = rec.data;
+
+	atomic_fetch_add(&vcache_hits, 1);
+	return true;
+}
+
+/*
+ * Record the verdict of a comparison
+ */
+bool
+vcache_store(struct vcache *vc, const unsigned char *old_md, const unsigned char *new_md, const struct pjob *job)
+{
+	const char *strings[4] = { job->container, job->diff_entries, job->diff_sections, job->diff_exports };
+	struct vcache_key key;
+	uint32_t how = job->how & VCACHE_HOW_MASK;
+	size_t len = sizeof(how);
+	unsigned int i;
+	char *data;
+	bool ok;
+
+	for (i = 0; i < 4; ++i)
+		len += (strings[i]? strlen(strings[i]) : 0) + 1;
+
+	data = malloc(len);
+	memcpy(data, &how, sizeof(how));
+	for (i = 0, len = sizeof(how); i < 4; ++i) {
+		const char *s = strings[i]? strings[i] : "";
+
+		strcpy(data + len, s);
+		len += strlen(s) + 1;
+	}
+
+	vcache_make_key(vc, old_md, new_md, &key);
+
+	pthread_mutex_lock(&vc->lock);
+	ok = hashdb_insert(vc->db, &key, sizeof(key), data, len);
+	pthread_mutex_unlock(&vc->lock);
+
+	free(data);
+	return ok;
+}
+
+void
+vcache_print_stats(FILE *fp)
+{
+	fprintf(fp, "Verdict cache: %lu hits, %lu misses\n",
+			atomic_load(&vcache_hits),
+			atomic_load(&vcache_misses));
+}
@@ -0,0 +1,269 @@
+/*
+ * ftreecmp
+ *
+ * Iterative traversal of two directory trees.
+ *
+ * Rather than recursing through C stack frames, we keep an explicit stack
+ * of directory pairs. walk_next() merges the listings of the directory pair
+ * on top of the stack and returns one pair of entries at a time; if either
+ * side is missing, the entry was added or removed. The caller decides
+ * whether to descend into a pair of directories by calling walk_descend().
+ *
+ * A frame may also hold one directory only; this is used when reporting
+ * everything below a directory that was added or removed.
+ *
+ * Each frame keeps the listings of its directories until it is done. To
+ * bound the memory used by deep hierarchies, listings of frames below the
+ * top of the stack are evicted when the total size of all listings exceeds
+ * the memory budget, and re-read when we return to them.
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+
+#include "fstate.h"
+
+struct walk_frame {
+	struct dstate *		old;
+	struct dstate *		new;
+	int			how;		/* for one-sided frames */
+};
+
+struct walk {
+	size_t			mem_budget;
+
+	unsigned int		depth;
+	unsigned int		size;
+	struct walk_frame *	stack;
+
+	/* cursors to advance before returning the next pair */
+	struct walk_frame *	pending;
+	bool			advance_old;
+	bool			advance_new;
+
+	/* part of the trees could not be read */
+	bool			failed;
+};
+
+struct walk *
+walk_new(size_t mem_budget)
+{
+	struct walk *walk;
+
+	walk = calloc(1, sizeof(*walk));
+	walk->mem_budget = mem_budget;
+	return walk;
+}
+
+static void
+walk_frame_destroy(struct walk_frame *frame)
+{
+	if (frame->old)
+		dstate_free(frame->old);
+	if (frame->new)
+		dstate_free(frame->new);
+}
+
+void
+walk_free(struct walk *walk)
+{
+	while (walk->depth)
+		walk_frame_destroy(&walk->stack[--(walk->depth)]);
+	free(walk->stack);
+	free(walk);
+}
+
+static void
+walk_apply_pending(struct walk *walk)
+{
+	struct walk_frame *frame;
+
+	if ((frame = walk->pending) == NULL)
+		return;
+
+	if (walk->advance_old)
+		dstate_advance(frame->old);
+	if (walk->advance_new)
+		dstate_advance(frame->new);
+	walk->pending = NULL;
+}
+
+/*
+ * Evict listings from the bottom of the stack until we're within budget
+ * again. The frame on top of the stack is never evicted.
+ */
+static void
+walk_enforce_budget(struct walk *walk)
+{
+	unsigned int i;
+
+	if (walk->mem_budget == 0)
+		return;
+
+	for (i = 0; i + 1 < walk->depth && dstate_memory_used() > walk->mem_budget; ++i) {
+		struct walk_frame *frame = &walk->stack[i];
+
+		if (frame->old)
+			dstate_evict(frame->old);
+		if (frame->new)
+			dstate_evict(frame->new);
+	}
+}
+
+/*
+ * Push a frame for comparing two directories. The walk takes ownership of
+ * the dstate objects. Either of them may be NULL, in which case the
+ * entries of the other directory are returned as added (or removed).
+ */
+void
+walk_push(struct walk *walk, struct dstate *old, struct dstate *new, int how)
+{
+	struct walk_frame *frame;
+
+	walk_apply_pending(walk);
+
+	if (walk->depth >= walk->size) {
+		walk->size += 16;
+		walk->stack = reallocarray(walk->stack, walk->size, sizeof(walk->stack[0]));
+	}
+
+	frame = &walk->stack[walk->depth++];
+	frame->old = old;
+	frame->new = new;
+	frame->how = how;
+
+	walk_enforce_budget(walk);
+}
+
+/*
+ * Descend into the directory entries returned by the last call to
+ * walk_next(). One of old and new may be NULL.
+ */
+bool
+walk_descend(struct walk *walk, struct fstate *old, struct fstate *new)
+{
+	struct dstate *old_subdir = NULL, *new_subdir = NULL;
+	int how = 0;
+
+	if (old && !(old_subdir = fstate_descend(old)))
+		return false;
+
+	if (new && !(new_subdir = fstate_descend(new))) {
+		if (old_subdir)
+			dstate_free(old_subdir);
+		return false;
+	}
+
+	if (old == NULL)
+		how = FSTATE_CHANGED_ADDED;
+	else if (new == NULL)
+		how = FSTATE_CHANGED_REMOVED;
+
+	walk_push(walk, old_subdir, new_subdir, how);
+	return true;
+}
+
+/*
+ * Returns true if the entries returned by walk_next() come from a
+ * directory that exists on one side only.
+ */
+bool
+walk_one_sided(const struct walk *walk)
+{
+	return walk->depth && walk->stack[walk->depth - 1].how != 0;
+}
+
+/*
+ * Returns true if part of the trees could not be read, and the walk
+ * skipped it
+ */
+bool
+walk_failed(const struct walk *walk)
+{
+	return walk->failed;
+}
+
+/*
+ * Return the next pair of entries. If the entry exists on one side only,
+ * the other pointer is set to NULL, and *how tells whether it was added or
+ * removed.
+ */
+bool
+walk_next(struct walk *walk, struct fstate **old_ret, struct fstate **new_ret, int *how_ret)
+{
+	walk_apply_pending(walk);
+
+	while (walk->depth) {
+		struct walk_frame *frame = &walk->stack[walk->depth - 1];
+		struct fstate *old_fs = NULL, *new_fs = NULL;
+		struct dstate *lost = NULL;
+		int rv;
+
+		if (frame->old && !dstate_restore(frame->old))
+			lost = frame->old;
+		else if (frame->new && !dstate_restore(frame->new))
+			lost = frame->new;
+
+		if (lost != NULL) {
+			/* the directory went away while evicted */
+			fprintf(stderr, "Error: unable to re-read %s, skipping the rest of it\n", lost->path);
+			walk->failed = true;
+			walk_frame_destroy(frame);
+			walk->depth -= 1;
+			continue;
+		}
+
+		if (frame->old)
+			old_fs = dstate_current_entry(frame->old);
+		if (frame->new)
+			new_fs = dstate_current_entry(frame->new);
+
+		/* the rest of the listing is gone; merging what's left of the
+		 * other side would report it all as added or removed */
+		if ((frame->old && frame->old->failed) || (frame->new && frame->new->failed)) {
+			walk->failed = true;
+			walk_frame_destroy(frame);
+			walk->depth -= 1;
+			continue;
+		}
+
+		if (old_fs == NULL && new_fs == NULL) {
+			walk_frame_destroy(frame);
+			walk->depth -= 1;
+			continue;
+		}
+
+		if (old_fs == NULL)
+			rv = 1;
+		else if (new_fs == NULL)
+			rv = -1;
+		else
+			rv = dstate_compare_current(frame->old, frame->new);
+
+		walk->pending = frame;
+		walk->advance_old = (rv <= 0);
+		walk->advance_new = (rv >= 0);
+
+		if (rv < 0) {
+			*old_ret = old_fs;
+			*new_ret = NULL;
+			*how_ret = FSTATE_CHANGED_REMOVED;
+		} else if (rv > 0) {
+			*old_ret = NULL;
+			*new_ret = new_fs;
+			*how_ret = FSTATE_CHANGED_ADDED;
+		} else {
+			*old_ret = old_fs;
+			*new_ret = new_fs;
+			*how_ret = 0;
+		}
+		return true;
+	}
+
+	return false;
+}
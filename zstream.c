@@ -0,0 +1,399 @@
+/*
+ * ftreecmp
+ *
+ * Streaming decompression of gzip, xz, zstd and bzip2 files.
+ *
+ * Compressors embed timestamps, file names and the like in their headers,
+ * and different compressor versions or settings produce different output
+ * for the same input. To find out whether two compressed files really
+ * differ, we decompress both and compare the results. This is done in
+ * fixed size chunks, so memory use does not depend on the file size.
+ *
+ * Concatenated streams (as produced by pigz, or cat a.gz b.gz) are
+ * decompressed in sequence, just like the command line tools do.
+ *
+ * A stream may also be limited to a range of the file; this is used for
+ * compressed ELF sections. These are zlib or zstd compressed, or not at
+ * all (ZSTREAM_NONE), in which case the data is passed through as is.
+ *
+ * Copyright (C) 2025 SUSE Linux
+ * Written by okir@suse.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <zlib.h>
+#include <lzma.h>
+#include <zstd.h>
+#include <bzlib.h>
+
+#include "fstate.h"
+
+struct zstream {
+	int			fd;
+	int			format;
+	const char *		path;
+
+	off_t			in_offset;
+	off_t			in_end;		/* -1 means end of file */
+
+	unsigned char *		buffer;		/* from the I/O buffer pool */
+	unsigned char *		inbuf;		/* start of data in buffer */
+	size_t			in_pos;
+	size_t			in_len;
+	bool			in_eof;
+
+	bool			end;		/* decoder reached the end of a stream */
+	bool			eof;
+
+	union {
+		z_stream	gz;
+		lzma_stream	xz;
+		ZSTD_DStream *	zstd;
+		bz_stream	bz;
+	} u;
+};
+
+static const struct {
+	int			format;
+	const char *		name;
+	const unsigned char *	magic;
+	unsigned int		magic_len;
+} zstream_formats[] = {
+	{ ZSTREAM_GZIP,		"gzip",		(const unsigned char *) "\x1f\x8b",		2 },
+	{ ZSTREAM_XZ,		"xz",		(const unsigned char *) "\xfd" "7zXZ\0",	6 },
+	{ ZSTREAM_ZSTD,		"zstd",		(const unsigned char *) "\x28\xb5\x2f\xfd",	4 },
+	{ ZSTREAM_BZIP2,	"bzip2",	(const unsigned char *) "BZh",		3 },
+	{ ZSTREAM_ZLIB,		"zlib",		NULL,					0 },
+	{ ZSTREAM_NONE }
+};
+
+/*
+ * "BZh" alone is too likely to show up at the start of a text file. It is
+ * followed by the block size ('1' to '9') and the magic of the first block,
+ * or the end of stream marker if the stream is empty.
+ */
+static bool
+zstream_is_bzip2(const unsigned char *magic, size_t len)
+{
+	if (len < 10 || magic[3] < '1' || magic[3] > '9')
+		return false;
+	return !memcmp(magic + 4, "\x31\x41\x59\x26\x53\x59", 6)
+	    || !memcmp(magic + 4, "\x17\x72\x45\x38\x50\x90", 6);
+}
+
+/*
+ * Identify the compression format of a file by its magic.
+ */
+int
+zstream_format(int fd)
+{
+	unsigned char magic[10];
+	ssize_t n;
+	unsigned int i;
+
+	if ((n = pread(fd, magic, sizeof(magic), 0)) <= 0)
+		return ZSTREAM_NONE;
+
+	for (i = 0; zstream_formats[i].format != ZSTREAM_NONE; ++i) {
+		if (zstream_formats[i].magic_len && n >= zstream_formats[i].magic_len
+		 && !memcmp(magic, zstream_formats[i].magic, zstream_formats[i].magic_len)) {
+			if (zstream_formats[i].format == ZSTREAM_BZIP2
+			 && !zstream_is_bzip2(magic, n))
+				continue;
+			return zstream_formats[i].format;
+		}
+	}
+
+	return ZSTREAM_NONE;
+}
+
+const char *
+zstream_format_name(int format)
+{
+	unsigned int i;
+
+	for (i = 0; zstream_formats[i].format != ZSTREAM_NONE; ++i) {
+		if (zstream_formats[i].format == format)
+			return zstream_formats[i].name;
+	}
+	return "uncompressed";
+}
+
+static bool
+zstream_decoder_init(struct zstream *zs)
+{
+	switch (zs->format) {
+	case ZSTREAM_NONE:
+		return true;
+
+	case ZSTREAM_GZIP:
+		/* 16 + MAX_WBITS: expect a gzip header */
+		return inflateInit2(&zs->u.gz, 16 + MAX_WBITS) == Z_OK;
+
+	case ZSTREAM_ZLIB:
+		return inflateInit(&zs->u.gz) == Z_OK;
+
+	case ZSTREAM_XZ:
+		return lzma_stream_decoder(&zs->u.xz, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK;
+
+	case ZSTREAM_ZSTD:
+		return (zs->u.zstd = ZSTD_createDStream()) != NULL
+		    && !ZSTD_isError(ZSTD_initDStream(zs->u.zstd));
+
+	case ZSTREAM_BZIP2:
+		return BZ2_bzDecompressInit(&zs->u.bz, 0, 0) == BZ_OK;
+	}
+
+	return false;
+}
+
+static void
+zstream_decoder_destroy(struct zstream *zs)
+{
+	switch (zs->format) {
+	case ZSTREAM_GZIP:
+	case ZSTREAM_ZLIB:
+		inflateEnd(&zs->u.gz);
+		break;
+
+	case ZSTREAM_XZ:
+		lzma_end(&zs->u.xz);
+		break;
+
+	case ZSTREAM_ZSTD:
+		ZSTD_freeDStream(zs->u.zstd);
+		break;
+
+	case ZSTREAM_BZIP2:
+		BZ2_bzDecompressEnd(&zs->u.bz);
+		break;
+	}
+}
+
+struct zstream *
+zstream_open(int fd, int format, const char *path)
+{
+	return zstream_open_range(fd, format, path, 0, -1);
+}
+
+/*
+ * Decompress the size bytes at offset. If size is negative, read up to
+ * the end of the file.
+ */
+struct zstream *
+zstream_open_range(int fd, int format, const char *path, off_t offset, off_t size)
+{
+	struct zstream *zs;
+
+	zs = calloc(1, sizeof(*zs));
+	zs->fd = fd;
+	zs->format = format;
+	zs->path = path;
+	zs->in_offset = offset;
+	zs->in_end = (size < 0)? -1 : offset + size;
+	zs->inbuf = zs->buffer = fcompare_buffer_get();
+
+	if (zs->buffer == NULL) {
+		free(zs);
+		return NULL;
+	}
+
+	if (!zstream_decoder_init(zs)) {
+		fprintf(stderr, "Error: unable to initialize %s decoder for %s\n",
+				zstream_format_name(format), path);
+		fcompare_buffer_put(zs->buffer);
+		free(zs);
+		return NULL;
+	}
+
+	return zs;
+}
+
+void
+zstream_close(struct zstream *zs)
+{
+	zstream_decoder_destroy(zs);
+	fcompare_buffer_put(zs->buffer);
+	free(zs);
+}
+
+static bool
+zstream_fill(struct zstream *zs)
+{
+	size_t count = FCOMPARE_IOSIZE;
+	ssize_t n;
+
+	if (zs->in_pos < zs->in_len || zs->in_eof)
+		return true;
+
+	if (zs->in_end >= 0 && count > zs->in_end - zs->in_offset)
+		count = zs->in_end - zs->in_offset;
+
+	/* with -O direct, this reads the compressed data with O_DIRECT */
+	if ((n = fcompare_pread(zs->fd, zs->buffer, count, zs->in_offset, &zs->inbuf)) < 0) {
+		fprintf(stderr, "Error: failed to read from %s: %m\n", zs->path);
+		return false;
+	}
+
+	zs->in_offset += n;
+	zs->in_pos = 0;
+	zs->in_len = n;
+	if (n == 0)
+		zs->in_eof = true;
+	return true;
+}
+
+/*
+ * Run the decoder once. Returns the number of bytes produced, or -1 on error.
+ */
+static ssize_t
+zstream_decode(struct zstream *zs, unsigned char *buf, size_t len)
+{
+	size_t avail = zs->in_len - zs->in_pos;
+	unsigned char *in = zs->inbuf + zs->in_pos;
+	size_t consumed, produced;
+	int rv;
+
+	if (zs->end && avail == 0 && zs->in_eof) {
+		zs->eof = true;
+		return 0;
+	}
+
+	switch (zs->format) {
+	case ZSTREAM_NONE:
+		consumed = produced = (avail < len)? avail : len;
+		memcpy(buf, in, produced);
+		zs->end = true;
+		break;
+
+	case ZSTREAM_GZIP:
+	case ZSTREAM_ZLIB:
+		/* a gzip member ended and there is more data; start the next member */
+		if (zs->end && avail) {
+			/* zlib streams in ELF sections may be followed by padding */
+			if (zs->format == ZSTREAM_ZLIB) {
+				zs->eof = true;
+				return 0;
+			}
+			/* gzip files may be padded with NUL bytes after the last member */
+			if (in[0] == '\0') {
+				for (consumed = 0; consumed < avail && in[consumed] == '\0'; ++consumed)
+					;
+				if (consumed < avail)
+					return -1;
+				produced = 0;
+				break;
+			}
+			if (inflateReset(&zs->u.gz) != Z_OK)
+				return -1;
+			zs->end = false;
+		}
+
+		zs->u.gz.next_in = in;
+		zs->u.gz.avail_in = avail;
+		zs->u.gz.next_out = buf;
+		zs->u.gz.avail_out = len;
+		rv = inflate(&zs->u.gz, Z_NO_FLUSH);
+		if (rv != Z_OK && rv != Z_STREAM_END && !(rv == Z_BUF_ERROR && avail == 0))
+			return -1;
+		if (rv == Z_STREAM_END)
+			zs->end = true;
+		consumed = avail - zs->u.gz.avail_in;
+		produced = len - zs->u.gz.avail_out;
+		break;
+
+	case ZSTREAM_XZ:
+		zs->u.xz.next_in = in;
+		zs->u.xz.avail_in = avail;
+		zs->u.xz.next_out = buf;
+		zs->u.xz.avail_out = len;
+		rv = lzma_code(&zs->u.xz, zs->in_eof? LZMA_FINISH : LZMA_RUN);
+		if (rv != LZMA_OK && rv != LZMA_STREAM_END)
+			return -1;
+		if (rv == LZMA_STREAM_END)
+			zs->end = true;
+		consumed = avail - zs->u.xz.avail_in;
+		produced = len - zs->u.xz.avail_out;
+		break;
+
+	case ZSTREAM_ZSTD:
+		{
+			ZSTD_inBuffer input = { in, avail, 0 };
+			ZSTD_outBuffer output = { buf, len, 0 };
+			size_t ret;
+
+			ret = ZSTD_decompressStream(zs->u.zstd, &output, &input);
+			if (ZSTD_isError(ret))
+				return -1;
+			/* ret == 0 means a frame was completely decoded */
+			if (input.pos || output.pos)
+				zs->end = (ret == 0);
+			consumed = input.pos;
+			produced = output.pos;
+		}
+		break;
+
+	case ZSTREAM_BZIP2:
+		if (zs->end && avail) {
+			BZ2_bzDecompressEnd(&zs->u.bz);
+			memset(&zs->u.bz, 0, sizeof(zs->u.bz));
+			if (BZ2_bzDecompressInit(&zs->u.bz, 0, 0) != BZ_OK)
+				return -1;
+			zs->end = false;
+		}
+
+		zs->u.bz.next_in = (char *) in;
+		zs->u.bz.avail_in = avail;
+		zs->u.bz.next_out = (char *) buf;
+		zs->u.bz.avail_out = len;
+		rv = BZ2_bzDecompress(&zs->u.bz);
+		if (rv != BZ_OK && rv != BZ_STREAM_END)
+			return -1;
+		if (rv == BZ_STREAM_END)
+			zs->end = true;
+		consumed = avail - zs->u.bz.avail_in;
+		produced = len - zs->u.bz.avail_out;
+		break;
+
+	default:
+		return -1;
+	}
+
+	zs->in_pos += consumed;
+	if (produced == 0 && consumed == 0 && zs->in_eof) {
+		/* input exhausted; it's an error if we're in the middle of a stream */
+		if (!zs->end)
+			return -1;
+		zs->eof = true;
+	}
+	return produced;
+}
+
+/*
+ * Read up to len bytes of decompressed data. Unlike read(2), this only
+ * returns less than len bytes at the end of the stream. Returns -1 on error.
+ */
+ssize_t
+zstream_read(struct zstream *zs, void *buf, size_t len)
+{
+	size_t total = 0;
+
+	while (total < len && !zs->eof) {
+		ssize_t n;
+
+		if (!zstream_fill(zs))
+			return -1;
+
+		if ((n = zstream_decode(zs, (unsigned char *) buf + total, len - total)) < 0) {
+			fprintf(stderr, "Error: %s: corrupt %s data\n", zs->path, zstream_format_name(zs->format));
+			return -1;
+		}
+		total += n;
+	}
+
+	return total;
+}